@@ -519,6 +519,20 @@ void CopyFromOneVectorToMultiVals(const void *graph, const dtype *src,
             count, len);
 }
 
+bool inverted_dropout = false;
+
+void SetInvertedDropout(bool inverted) {
+    inverted_dropout = inverted;
+}
+
+// what kept values are multiplied with in training, and all values out of it
+dtype DropoutScale(bool on_training, dtype drop_factor) {
+    if (on_training) {
+        return inverted_dropout && drop_factor > 0 ? 1 / (1 - drop_factor) : 1;
+    }
+    return inverted_dropout ? 1 : 1 - drop_factor;
+}
+
 __global__ void KernelActivated(ActivatedEnum activated, const dtype *src,
         dtype**dest,
         dtype* dest2,
@@ -526,6 +540,7 @@ __global__ void KernelActivated(ActivatedEnum activated, const dtype *src,
         int len,
         bool is_being_trained,
         dtype drop_factor,
+        dtype drop_scale,
         const dtype *drop_mask) {
     int index = blockIdx.x * blockDim.x + threadIdx.x;
     int step = blockDim.x * gridDim.x;
@@ -553,11 +568,11 @@ __global__ void KernelActivated(ActivatedEnum activated, const dtype *src,
                 dest[count_i][len_i] = 0.0f;
                 dest2[i] = result;
             } else {
-                dest[count_i][len_i] = result;
+                dest[count_i][len_i] = result * drop_scale;
                 dest2[i] = result;
             }
         } else {
-            dest[count_i][len_i] = result * (1 - drop_factor);
+            dest[count_i][len_i] = result * drop_scale;
             dest2[i] = result;
         }
     }
@@ -578,7 +593,8 @@ void Activated(ActivatedEnum activated, const dtype *src,
     dest_arr.init((dtype**)dest.data(), dest.size());
     int block_count = std::min((len * count - 1 + TPB) / TPB, BLOCK_COUNT);
     KernelActivated<<<block_count, TPB>>>(activated, src, dest_arr.value,
-            dest2, count, len, is_being_trained, drop_factor, drop_mask);
+            dest2, count, len, is_being_trained, drop_factor,
+            DropoutScale(is_being_trained, drop_factor), drop_mask);
 }
 
 __global__ void KernelTanhForward(ActivatedEnum activated, const dtype** xs,
@@ -586,6 +602,7 @@ __global__ void KernelTanhForward(ActivatedEnum activated, const dtype** xs,
         int dim,
         const dtype* drop_mask,
         dtype drop_factor,
+        dtype drop_scale,
         dtype**ys) {
     int index = DeviceDefaultIndex();
     int step = DeviceDefaultStep();
@@ -596,9 +613,11 @@ __global__ void KernelTanhForward(ActivatedEnum activated, const dtype** xs,
             ys[count_i][dim_i] = 0.0f;
         } else {
             if (activated == ActivatedEnum::TANH) {
-                ys[count_i][dim_i] = cuda_tanh(xs[count_i][dim_i]);
+                ys[count_i][dim_i] = cuda_tanh(xs[count_i][dim_i]) *
+                    drop_scale;
             } else if (activated == ActivatedEnum::SIGMOID) {
-                ys[count_i][dim_i] = cuda_sigmoid(xs[count_i][dim_i]);
+                ys[count_i][dim_i] = cuda_sigmoid(xs[count_i][dim_i]) *
+                    drop_scale;
             } else {
                 printf("error\n");
             }
@@ -621,7 +640,7 @@ void TanhForward(ActivatedEnum activated, const std::vector<dtype*> &xs,
     int block_count = DefaultBlockCount(count * dim);
     KernelTanhForward<<<block_count, TPB>>>(activated,
             (const dtype**)x_arr.value, count, dim, drop_mask, drop_factor,
-            y_arr.value);
+            DropoutScale(true, drop_factor), y_arr.value);
 }
 
 __global__ void KernelTanhBackward(ActivatedEnum activated,
@@ -631,6 +650,7 @@ __global__ void KernelTanhBackward(ActivatedEnum activated,
         int dim,
         const dtype* drop_mask,
         dtype drop_factor,
+        dtype drop_scale,
         dtype** in_losses) {
     int index = DeviceDefaultIndex();
     int step = DeviceDefaultStep();
@@ -646,7 +666,7 @@ __global__ void KernelTanhBackward(ActivatedEnum activated,
                 v = losses[count_i][dim_i] * (1 - vals[count_i][dim_i]) *
                     vals[count_i][dim_i];
             }
-            atomicAdd(in_losses[count_i] + dim_i, v);
+            atomicAdd(in_losses[count_i] + dim_i, v * drop_scale);
         }
     }
 }
@@ -668,12 +688,13 @@ void TanhBackward(ActivatedEnum activated, const std::vector<dtype*> &losses,
     int block_count = DefaultBlockCount(count * dim);
     KernelTanhBackward<<<block_count, TPB>>>(activated ,(const dtype**)loss_arr.value,
             (const dtype**)val_arr.value, count, dim, drop_mask, drop_factor,
-            in_loss_arr.value);
+            DropoutScale(true, drop_factor), in_loss_arr.value);
 }
 
 __global__ void KernelDropoutForward(const dtype** xs, int count, int dim,
         const dtype* drop_mask,
         dtype drop_factor,
+        dtype drop_scale,
         dtype**ys) {
     int index = DeviceDefaultIndex();
     int step = DeviceDefaultStep();
@@ -683,7 +704,7 @@ __global__ void KernelDropoutForward(const dtype** xs, int count, int dim,
         if (drop_factor > 0.0f && drop_mask[i] < drop_factor) {
             ys[count_i][dim_i] = 0.0f;
         } else {
-            ys[count_i][dim_i] = xs[count_i][dim_i];
+            ys[count_i][dim_i] = xs[count_i][dim_i] * drop_scale;
         }
     }
 }
@@ -700,7 +721,8 @@ void DropoutForward(const std::vector<dtype*> &xs, int count, int dim,
     y_arr.init((dtype**)ys.data(), ys.size());
     int block_count = DefaultBlockCount(count * dim);
     KernelDropoutForward<<<block_count, TPB>>>((const dtype**)x_arr.value,
-            count, dim, drop_mask, drop_factor, y_arr.value);
+            count, dim, drop_mask, drop_factor,
+            DropoutScale(true, drop_factor), y_arr.value);
 }
 
 __global__ void KernelDropoutBackward(const dtype **losses, const dtype **vals,
@@ -708,6 +730,7 @@ __global__ void KernelDropoutBackward(const dtype **losses, const dtype **vals,
         int dim,
         const dtype* drop_mask,
         dtype drop_factor,
+        dtype drop_scale,
         dtype** in_losses) {
     int index = DeviceDefaultIndex();
     int step = DeviceDefaultStep();
@@ -715,7 +738,8 @@ __global__ void KernelDropoutBackward(const dtype **losses, const dtype **vals,
         int count_i = i / dim;
         int dim_i = i % dim;
         if (drop_factor <= 0.0f || drop_mask[i] > drop_factor) {
-            atomicAdd(in_losses[count_i] + dim_i, losses[count_i][dim_i]);
+            atomicAdd(in_losses[count_i] + dim_i,
+                    losses[count_i][dim_i] * drop_scale);
         }
     }
 }
@@ -737,7 +761,7 @@ void DropoutBackward(const std::vector<dtype*> &losses,
     int block_count = DefaultBlockCount(count * dim);
     KernelDropoutBackward<<<block_count, TPB>>>((const dtype**)loss_arr.value,
             (const dtype**)val_arr.value, count, dim, drop_mask, drop_factor,
-            in_loss_arr.value);
+            DropoutScale(true, drop_factor), in_loss_arr.value);
 }
 
 __global__ void KernelCopyForUniNodeForward(const dtype** xs, const dtype* b,
@@ -1047,6 +1071,7 @@ __global__ void KernelCalculateLtyForUniBackward(ActivatedEnum activated,
         const dtype *y,
         const dtype *drop_mask,
         dtype drop_factor,
+        dtype drop_scale,
         dtype *lty,
         int count,
         int dim) {
@@ -1060,7 +1085,7 @@ __global__ void KernelCalculateLtyForUniBackward(ActivatedEnum activated,
         if (drop_factor > 0.0f && drop_mask[i] < drop_factor) {
             lty[i] = 0.0f;
         } else {
-            dtype lyv = ly[count_i][dim_i];
+            dtype lyv = ly[count_i][dim_i] * drop_scale;
             if (activated == ActivatedEnum::TANH) {
                 lty[i] = lyv * cuda_dtanh(yi);
             } else if (activated == ActivatedEnum::SIGMOID) {
@@ -1094,7 +1119,8 @@ void CalculateLtyForUniBackward(ActivatedEnum activated,
     ly_arr.init((dtype**)ly.data(), ly.size());
     int block_count = std::min(BLOCK_COUNT, (count * dim + TPB - 1) / TPB);
     KernelCalculateLtyForUniBackward<<<block_count, TPB>>>(activated,
-            ly_arr.value, ty, y, drop_mask, drop_factor, lty, count, dim);
+            ly_arr.value, ty, y, drop_mask, drop_factor,
+            DropoutScale(true, drop_factor), lty, count, dim);
     cudaDeviceSynchronize();
 }
 
@@ -1313,6 +1339,7 @@ __global__ void KernelConcatForward(dtype **ins, int64_t *in_dims,
         bool on_training,
         const dtype *drop_mask,
         dtype drop_factor,
+        dtype drop_scale,
         int count,
         int in_count,
         int out_dim) {
@@ -1340,7 +1367,7 @@ __global__ void KernelConcatForward(dtype **ins, int64_t *in_dims,
                 }
                 int in_dim_i = out_dim_i - last_in_dim_sum;
                 dtype v = ins[count_i * in_count + offset_j][in_dim_i];
-                outs[count_i][out_dim_i] = v;
+                outs[count_i][out_dim_i] = v * drop_scale;
             }
         } else {
             int in_dim_sum = 0;
@@ -1356,7 +1383,7 @@ __global__ void KernelConcatForward(dtype **ins, int64_t *in_dims,
             }
             int in_dim_i = out_dim_i - last_in_dim_sum;
             dtype v = ins[count_i * in_count + offset_j][in_dim_i];
-            outs[count_i][out_dim_i] = v * (1 - drop_factor);
+            outs[count_i][out_dim_i] = v * drop_scale;
         }
     }
 }
@@ -1375,13 +1402,15 @@ void ConcatForward(const void *graph, bool on_training, const dtype *drop_mask,
     offset += 2 * count * in_count * sizeof(dtype*);
     int64_t *in_dims = (int64_t*)((char*)graph + offset);
     KernelConcatForward<<<block_count, TPB>>>(ins, in_dims, outs, on_training,
-            drop_mask, drop_factor, count, in_count, out_dim);
+            drop_mask, drop_factor, DropoutScale(on_training, drop_factor),
+            count, in_count, out_dim);
 }
 
 __global__ void KernelConcatBackward(dtype** in_losses, int64_t *in_dims,
         dtype **out_losses,
         const dtype *drop_mask,
         dtype drop_factor,
+        dtype drop_scale,
         int count,
         int in_count,
         int out_dim) {
@@ -1406,7 +1435,7 @@ __global__ void KernelConcatBackward(dtype** in_losses, int64_t *in_dims,
             }
             int in_dim_i = out_dim_i - last_in_dim_sum;
             DeviceAtomicAdd(in_losses[count_i * in_count + offset_j] +
-                    in_dim_i, out_losses[count_i][out_dim_i]);
+                    in_dim_i, out_losses[count_i][out_dim_i] * drop_scale);
         }
     }
 }
@@ -1428,7 +1457,8 @@ void ConcatBackward(const void *graph, const dtype *drop_mask,
     int64_t *in_dims = (int64_t*)graph;
 
     KernelConcatBackward<<<block_count, TPB>>>(in_losses, in_dims, out_losses,
-            drop_mask, drop_factor, count, in_count, out_dim);
+            drop_mask, drop_factor, DropoutScale(true, drop_factor), count,
+            in_count, out_dim);
 }
 
 __global__ void KernelMemset(dtype *p, int len, dtype value) {
@@ -1490,6 +1520,7 @@ __global__ void KernelLookupForward(const int *xids, const dtype *vocabulary,
         bool on_training,
         const dtype *drop_mask,
         dtype drop_factor,
+        dtype drop_scale,
         int count,
         int dim,
         dtype **vals) {
@@ -1506,7 +1537,7 @@ __global__ void KernelLookupForward(const int *xids, const dtype *vocabulary,
                 int xid = xids[count_i];
                 if (xid >= 0) {
                     int voc_i = xid * dim + dim_i;
-                    vals[count_i][dim_i] = vocabulary[voc_i];
+                    vals[count_i][dim_i] = vocabulary[voc_i] * drop_scale;
                 } else {
                     vals[count_i][dim_i] = 0.0f;
                 }
@@ -1515,7 +1546,7 @@ __global__ void KernelLookupForward(const int *xids, const dtype *vocabulary,
             int xid = xids[count_i];
             if (xid >= 0) {
                 int voc_i = xid * dim + dim_i;
-                vals[count_i][dim_i] = vocabulary[voc_i] * (1 - drop_factor);
+                vals[count_i][dim_i] = vocabulary[voc_i] * drop_scale;
             } else {
                 vals[count_i][dim_i] = 0.0f;
             }
@@ -1539,7 +1570,8 @@ void LookupForward(const std::vector<int> &xids, const dtype *vocabulary,
     NumberPointerArray val_arr;
     val_arr.init((dtype**)vals.data(), vals.size());
     KernelLookupForward<<<block_count, TPB>>>(xid_arr.value, vocabulary,
-            on_training, drop_mask, drop_factor,  count, dim,
+            on_training, drop_mask, drop_factor,
+            DropoutScale(on_training, drop_factor), count, dim,
             const_cast<dtype**>(val_arr.value));
 }
 
@@ -1548,6 +1580,7 @@ __global__ void KernelLookupBackward(const int *xids, int unknown_id,
         const dtype** losses,
         const dtype *drop_mask,
         dtype drop_factor,
+        dtype drop_scale,
         int count,
         int dim,
         dtype *grad,
@@ -1567,7 +1600,7 @@ __global__ void KernelLookupBackward(const int *xids, int unknown_id,
                 drop_mask[dim_i * count + count_i] : 1;
             if (drop_factor < dropout) {
                 DeviceAtomicAdd(grad + xid * dim + dim_i,
-                        losses[count_i][dim_i]);
+                        losses[count_i][dim_i] * drop_scale);
             }
         }
     }
@@ -1596,6 +1629,7 @@ void LookupBackward(const std::vector<int> &xids, int unknown_id,
             const_cast<const dtype**>(loss_arr.value),
             drop_mask,
             drop_factor,
+            DropoutScale(true, drop_factor),
             count,
             dim,
             grad,
@@ -2230,6 +2264,7 @@ __global__ void KernelPMultiForward(const dtype **ins1, const dtype **ins2,
         bool on_training,
         const dtype* drop_mask,
         dtype drop_factor,
+        dtype drop_scale,
         dtype** vals) {
     int index = DeviceDefaultIndex();
     int step = DeviceDefaultStep();
@@ -2245,11 +2280,11 @@ __global__ void KernelPMultiForward(const dtype **ins1, const dtype **ins2,
                     drop_mask[dim_i * count + count_i] < drop_factor) {
                 vals[count_i][dim_i] = 0.0f;
             } else {
-                vals[count_i][dim_i] = ins1[count_i][dim_i] *
+                vals[count_i][dim_i] = drop_scale * ins1[count_i][dim_i] *
                     ins2[count_i][dim_i];
             }
         } else {
-            vals[count_i][dim_i] = (1 - drop_factor) * ins1[count_i][dim_i] *
+            vals[count_i][dim_i] = drop_scale * ins1[count_i][dim_i] *
                     ins2[count_i][dim_i];
         }
     }
@@ -2273,7 +2308,7 @@ void PMultiForward(const std::vector<dtype*> &ins1,
     }
     KernelPMultiForward<<<block_count, TPB>>>((const dtype**)ins1_arr.value,
             (const dtype**)ins2_arr.value, count, dim, on_training,drop_mask,
-            dropout, vals_arr.value);
+            dropout, DropoutScale(on_training, dropout), vals_arr.value);
 }
 
 __global__ void KernelPMultiBackward(const dtype **losses,
@@ -2283,6 +2318,7 @@ __global__ void KernelPMultiBackward(const dtype **losses,
         int dim,
         const dtype *drop_mask,
         dtype drop_factor,
+        dtype drop_scale,
         dtype** in_losses1,
         dtype** in_losses2) {
     int index = DeviceDefaultIndex();
@@ -2293,10 +2329,11 @@ __global__ void KernelPMultiBackward(const dtype **losses,
         dtype dropout = drop_factor > 0 ?
             drop_mask[dim_i * count + count_i] : 1;
         if (drop_factor < dropout) {
+            dtype loss = losses[count_i][dim_i] * drop_scale;
             DeviceAtomicAdd(in_losses1[count_i] + dim_i,
-                    losses[count_i][dim_i] * in_vals2[count_i][dim_i]);
+                    loss * in_vals2[count_i][dim_i]);
             DeviceAtomicAdd(in_losses2[count_i] + dim_i,
-                    losses[count_i][dim_i] * in_vals1[count_i][dim_i]);
+                    loss * in_vals1[count_i][dim_i]);
         }
     }
 }
@@ -2321,13 +2358,15 @@ void PMultiBackward(const std::vector<dtype*> &losses,
     KernelPMultiBackward<<<block_count, TPB>>>((const dtype**)losses_arr.value,
             (const dtype**)in_vals1_arr.value,
             (const dtype**)in_vals2_arr.value, count, dim, drop_mask,
-            drop_factor, in_losses1_arr.value, in_losses2_arr.value);
+            drop_factor, DropoutScale(true, drop_factor), in_losses1_arr.value,
+            in_losses2_arr.value);
 }
 
 __global__ void KernelPAddForward(const dtype*** ins, int count, int dim,
         int in_count,
         const dtype *drop_mask,
         dtype drop_factor,
+        dtype drop_scale,
         dtype **vals) {
     int index = DeviceDefaultIndex();
     int step = DeviceDefaultStep();
@@ -2341,7 +2380,7 @@ __global__ void KernelPAddForward(const dtype*** ins, int count, int dim,
             for (int j = 1; j < in_count; ++j) {
                 sum += ins[j][count_i][dim_i];
             }
-            vals[count_i][dim_i] = sum;
+            vals[count_i][dim_i] = sum * drop_scale;
         } else {
             vals[count_i][dim_i] = 0.0f;
         }
@@ -2375,13 +2414,15 @@ void PAddForward(const std::vector<std::vector<dtype*>> &ins, int count,
 
     int block_count = DefaultBlockCount(count * dim);
     KernelPAddForward<<<block_count, TPB>>>((const dtype***)in_arr.value,
-            count, dim, in_count, drop_mask, drop_factor, out_arr.value);
+            count, dim, in_count, drop_mask, drop_factor,
+            DropoutScale(true, drop_factor), out_arr.value);
 }
 
 __global__ void KernelPAddBackward(const dtype **losses, int count, int dim,
         int in_count,
         const dtype *drop_mask,
         dtype drop_factor,
+        dtype drop_scale,
         dtype ***in_losses) {
     int index = DeviceDefaultIndex();
     int step = DeviceDefaultStep();
@@ -2395,7 +2436,7 @@ __global__ void KernelPAddBackward(const dtype **losses, int count, int dim,
             drop_mask[dim_i * count + count_i] : 1;
         if (drop_factor < dropout) {
             DeviceAtomicAdd(in_losses[in_count_i][count_i] + dim_i,
-                    losses[count_i][dim_i]);
+                    losses[count_i][dim_i] * drop_scale);
         }
     }
 }
@@ -2426,7 +2467,8 @@ void PAddBackward(const std::vector<dtype*> &losses, int count, int dim,
 
     int block_count = DefaultBlockCount(in_count * count * dim);
     KernelPAddBackward<<<block_count, TPB>>>((const dtype**)out_loss_arr.value,
-            count, dim, in_count, drop_mask, drop_factor, in_loss_arr.value);
+            count, dim, in_count, drop_mask, drop_factor,
+            DropoutScale(true, drop_factor), in_loss_arr.value);
 }
 
 __global__ void KernelSoftMaxLoss(const dtype **vals, dtype **losses,
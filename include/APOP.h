@@ -84,6 +84,10 @@ class APNode : public Node {
         param = paramInit;
     }
 
+    const void *paramKey() const override {
+        return param;
+    }
+
     inline void clearValue() {
         Node::clearValue();
         ins.clear();
@@ -132,6 +136,10 @@ class APNode : public Node {
         return true;
     }
 
+    size_t typeHashCode() const override {
+        return Node::typeHashCode() ^ ::typeHashCode(param);
+    }
+
 };
 
 class APExecute :public Execute {
@@ -78,6 +78,10 @@ class ActionNode : public Node {
         param = paramInit;
     }
 
+    const void *paramKey() const override {
+        return param;
+    }
+
     //can not be dropped since the output is a scalar
     inline void init(int ndim, dtype dropout) {
         dim = 1;
@@ -121,7 +125,7 @@ class ActionNode : public Node {
                 in->loss[idx] += loss[0] * param->W.val[actid][idx];
                 param->W.grad[actid][idx] += loss[0] * in->val[idx];
             }
-            param->W.indexers[actid] = true;
+            param->W.touchRow(actid);
         }
     }
 
@@ -141,27 +145,36 @@ class ActionNode : public Node {
         return true;
     }
 
+    size_t typeHashCode() const override {
+        return Node::typeHashCode() ^ ::typeHashCode(param);
+    }
+
 };
 
 
 class ActionExecute :public Execute {
   public:
     inline void  forward() {
-        int count = batch.size();
-        //#pragma omp parallel for
-        for (int idx = 0; idx < count; idx++) {
+        forEachNode([this](int idx) {
             batch[idx]->compute();
             batch[idx]->forward_drop(bTrain, drop_factor);
-        }
+        });
     }
 
     inline void backward() {
-        int count = batch.size();
-        //#pragma omp parallel for
-        for (int idx = 0; idx < count; idx++) {
+        forEachNodeExclusively([this](int idx, vector<const void*> &keys) {
+            ActionNode *ptr = static_cast<ActionNode*>(batch[idx]);
+            keys.push_back(ptr->in);
+            if (ptr->actid >= 0) {
+                keys.push_back(ptr->param->W.grad[ptr->actid]);
+                // touched serially here, so parallel backwards never
+                // append to touched_rows
+                ptr->param->W.touchRow(ptr->actid);
+            }
+        }, [this](int idx) {
             batch[idx]->backward_drop();
             batch[idx]->backward();
-        }
+        });
     }
 };
 
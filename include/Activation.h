@@ -0,0 +1,257 @@
+#ifndef N3LDG_ACTIVATION_H
+#define N3LDG_ACTIVATION_H
+
+/*
+*  Activation.h:
+*  activations as compile-time kinds. Activation<kind> runs over a whole
+*  buffer as one Eigen array expression, which is inlined and vectorized,
+*  instead of calling a function pointer per value.
+*  Nodes still take the function pointers (ftanh, dtanh ...),
+*  activationKind() maps the known pairs to their kind once per execute.
+*/
+
+#include "MyTensor.h"
+
+enum ActivationKind {
+    ACTIVATION_EQUAL = 0,
+    ACTIVATION_TANH = 1,
+    ACTIVATION_SIGMOID = 2,
+    ACTIVATION_RELU = 3,
+    ACTIVATION_LEAKY_RELU = 4,
+    ACTIVATION_SELU = 5,
+    ACTIVATION_EXP = 6,
+    ACTIVATION_OTHER = 7 // known by its function pointers only
+};
+
+typedef dtype (*ActivateFunction)(const dtype&);
+typedef dtype (*DerivateFunction)(const dtype&, const dtype&);
+
+typedef Eigen::Map<Eigen::Array<dtype, Eigen::Dynamic, 1> > ArrayMap;
+typedef Eigen::Map<const Eigen::Array<dtype, Eigen::Dynamic, 1> > ConstArrayMap;
+
+// forward: y = f(x)
+// backward: lx = ly * f'(x), or lx += ly * f'(x) when add is set, f' may
+// use y instead of x
+template <ActivationKind kind>
+struct Activation;
+
+template <>
+struct Activation<ACTIVATION_EQUAL> {
+    static void forward(const dtype *x, dtype *y, int size) {
+        ArrayMap(y, size) = ConstArrayMap(x, size);
+    }
+
+    static void backward(const dtype * /*x*/, const dtype * /*y*/,
+            const dtype *ly, dtype *lx, int size, bool add) {
+        if (add) {
+            ArrayMap(lx, size) += ConstArrayMap(ly, size);
+        } else {
+            ArrayMap(lx, size) = ConstArrayMap(ly, size);
+        }
+    }
+};
+
+template <>
+struct Activation<ACTIVATION_TANH> {
+    static void forward(const dtype *x, dtype *y, int size) {
+        ArrayMap(y, size) = ConstArrayMap(x, size).tanh();
+    }
+
+    static void backward(const dtype * /*x*/, const dtype *y, const dtype *ly,
+            dtype *lx, int size, bool add) {
+        ConstArrayMap ys(y, size);
+        if (add) {
+            ArrayMap(lx, size) += ConstArrayMap(ly, size) * (1 + ys) * (1 - ys);
+        } else {
+            ArrayMap(lx, size) = ConstArrayMap(ly, size) * (1 + ys) * (1 - ys);
+        }
+    }
+};
+
+template <>
+struct Activation<ACTIVATION_SIGMOID> {
+    static void forward(const dtype *x, dtype *y, int size) {
+        ArrayMap(y, size) = 1 / (1 + (-ConstArrayMap(x, size)).exp());
+    }
+
+    static void backward(const dtype * /*x*/, const dtype *y, const dtype *ly,
+            dtype *lx, int size, bool add) {
+        ConstArrayMap ys(y, size);
+        if (add) {
+            ArrayMap(lx, size) += ConstArrayMap(ly, size) * (1 - ys) * ys;
+        } else {
+            ArrayMap(lx, size) = ConstArrayMap(ly, size) * (1 - ys) * ys;
+        }
+    }
+};
+
+template <>
+struct Activation<ACTIVATION_RELU> {
+    static void forward(const dtype *x, dtype *y, int size) {
+        ArrayMap(y, size) = ConstArrayMap(x, size).max(dtype(0));
+    }
+
+    static void backward(const dtype *x, const dtype * /*y*/, const dtype *ly,
+            dtype *lx, int size, bool add) {
+        ConstArrayMap xs(x, size);
+        ConstArrayMap lys(ly, size);
+        if (add) {
+            ArrayMap(lx, size) += (xs > 0).select(lys, 0);
+        } else {
+            ArrayMap(lx, size) = (xs > 0).select(lys, 0);
+        }
+    }
+};
+
+template <>
+struct Activation<ACTIVATION_LEAKY_RELU> {
+    static void forward(const dtype *x, dtype *y, int size) {
+        ConstArrayMap xs(x, size);
+        ArrayMap(y, size) = (xs < 0).select(dtype(0.1) * xs, xs);
+    }
+
+    static void backward(const dtype *x, const dtype * /*y*/, const dtype *ly,
+            dtype *lx, int size, bool add) {
+        ConstArrayMap xs(x, size);
+        ConstArrayMap lys(ly, size);
+        if (add) {
+            ArrayMap(lx, size) += (xs < 0).select(dtype(0.1) * lys, lys);
+        } else {
+            ArrayMap(lx, size) = (xs < 0).select(dtype(0.1) * lys, lys);
+        }
+    }
+};
+
+template <>
+struct Activation<ACTIVATION_SELU> {
+    static constexpr dtype LAMBDA = 1.0507009873554804934193349852946;
+    static constexpr dtype ALPHA = 1.6732632423543772848170429916717;
+
+    static void forward(const dtype *x, dtype *y, int size) {
+        ConstArrayMap xs(x, size);
+        ArrayMap(y, size) = (xs <= 0).select(
+                dtype(LAMBDA * ALPHA) * (xs.exp() - 1), dtype(LAMBDA) * xs);
+    }
+
+    static void backward(const dtype *x, const dtype *y, const dtype *ly,
+            dtype *lx, int size, bool add) {
+        ConstArrayMap xs(x, size);
+        ConstArrayMap ys(y, size);
+        ConstArrayMap lys(ly, size);
+        if (add) {
+            ArrayMap(lx, size) += (xs <= 0).select(
+                    lys * (ys + dtype(LAMBDA * ALPHA)), dtype(LAMBDA) * lys);
+        } else {
+            ArrayMap(lx, size) = (xs <= 0).select(
+                    lys * (ys + dtype(LAMBDA * ALPHA)), dtype(LAMBDA) * lys);
+        }
+    }
+};
+
+template <>
+struct Activation<ACTIVATION_EXP> {
+    static void forward(const dtype *x, dtype *y, int size) {
+        ArrayMap(y, size) = ConstArrayMap(x, size).exp();
+    }
+
+    static void backward(const dtype * /*x*/, const dtype *y, const dtype *ly,
+            dtype *lx, int size, bool add) {
+        if (add) {
+            ArrayMap(lx, size) += ConstArrayMap(ly, size) *
+                ConstArrayMap(y, size);
+        } else {
+            ArrayMap(lx, size) = ConstArrayMap(ly, size) *
+                ConstArrayMap(y, size);
+        }
+    }
+};
+
+inline ActivationKind activationKind(ActivateFunction activate,
+        DerivateFunction derivate) {
+    if (activate == fequal && derivate == dequal) {
+        return ACTIVATION_EQUAL;
+    } else if (activate == ftanh && derivate == dtanh) {
+        return ACTIVATION_TANH;
+    } else if (activate == fsigmoid && derivate == dsigmoid) {
+        return ACTIVATION_SIGMOID;
+    } else if (activate == frelu && derivate == drelu) {
+        return ACTIVATION_RELU;
+    } else if (activate == fleaky_relu && derivate == dleaky_relu) {
+        return ACTIVATION_LEAKY_RELU;
+    } else if (activate == fselu && derivate == dselu) {
+        return ACTIVATION_SELU;
+    } else if (activate == fexp && derivate == dexp) {
+        return ACTIVATION_EXP;
+    }
+    return ACTIVATION_OTHER;
+}
+
+// y = activate(x) over size values, through the kind unless it is
+// ACTIVATION_OTHER
+inline void activateValues(ActivationKind kind, ActivateFunction activate,
+        const dtype *x, dtype *y, int size) {
+    switch (kind) {
+        case ACTIVATION_EQUAL:
+            Activation<ACTIVATION_EQUAL>::forward(x, y, size);
+            break;
+        case ACTIVATION_TANH:
+            Activation<ACTIVATION_TANH>::forward(x, y, size);
+            break;
+        case ACTIVATION_SIGMOID:
+            Activation<ACTIVATION_SIGMOID>::forward(x, y, size);
+            break;
+        case ACTIVATION_RELU:
+            Activation<ACTIVATION_RELU>::forward(x, y, size);
+            break;
+        case ACTIVATION_LEAKY_RELU:
+            Activation<ACTIVATION_LEAKY_RELU>::forward(x, y, size);
+            break;
+        case ACTIVATION_SELU:
+            Activation<ACTIVATION_SELU>::forward(x, y, size);
+            break;
+        case ACTIVATION_EXP:
+            Activation<ACTIVATION_EXP>::forward(x, y, size);
+            break;
+        default:
+            for (int i = 0; i < size; ++i) {
+                y[i] = activate(x[i]);
+            }
+    }
+}
+
+// lx = ly * derivate(x, y), or lx += ... when add is set
+inline void derivateLosses(ActivationKind kind, DerivateFunction derivate,
+        const dtype *x, const dtype *y, const dtype *ly, dtype *lx, int size,
+        bool add) {
+    switch (kind) {
+        case ACTIVATION_EQUAL:
+            Activation<ACTIVATION_EQUAL>::backward(x, y, ly, lx, size, add);
+            break;
+        case ACTIVATION_TANH:
+            Activation<ACTIVATION_TANH>::backward(x, y, ly, lx, size, add);
+            break;
+        case ACTIVATION_SIGMOID:
+            Activation<ACTIVATION_SIGMOID>::backward(x, y, ly, lx, size, add);
+            break;
+        case ACTIVATION_RELU:
+            Activation<ACTIVATION_RELU>::backward(x, y, ly, lx, size, add);
+            break;
+        case ACTIVATION_LEAKY_RELU:
+            Activation<ACTIVATION_LEAKY_RELU>::backward(x, y, ly, lx, size,
+                    add);
+            break;
+        case ACTIVATION_SELU:
+            Activation<ACTIVATION_SELU>::backward(x, y, ly, lx, size, add);
+            break;
+        case ACTIVATION_EXP:
+            Activation<ACTIVATION_EXP>::backward(x, y, ly, lx, size, add);
+            break;
+        default:
+            for (int i = 0; i < size; ++i) {
+                dtype d = ly[i] * derivate(x[i], y[i]);
+                lx[i] = add ? lx[i] + d : d;
+            }
+    }
+}
+
+#endif
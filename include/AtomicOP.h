@@ -64,11 +64,13 @@ class ActivateNode :public Node {
 
   public:
     inline void compute() {
-        val.vec() = in->val.vec().unaryExpr(ptr_fun(activate));
+        activateValues(activationKind(activate, derivate), activate,
+                in->val.v, val.v, dim);
     }
 
     void backward() {
-        in->loss.vec() += loss.vec() * in->val.vec().binaryExpr(val.vec(), ptr_fun(derivate));
+        derivateLosses(activationKind(activate, derivate), derivate,
+                in->val.v, val.v, loss.v, in->loss.v, dim, true);
     }
 
   public:
@@ -140,11 +142,12 @@ class TanhNode :public Node {
 
   public:
     inline void compute() {
-        val.vec() = in->val.vec().unaryExpr(ptr_fun(ftanh));
+        Activation<ACTIVATION_TANH>::forward(in->val.v, val.v, dim);
     }
 
     void backward() {
-        in->loss.vec() += loss.vec() * in->val.vec().binaryExpr(val.vec(), ptr_fun(dtanh));
+        Activation<ACTIVATION_TANH>::backward(in->val.v, val.v, loss.v,
+                in->loss.v, dim, true);
     }
 
   public:
@@ -162,9 +165,8 @@ class TanhExecute :public Execute {
     Tensor2D drop_mask;
     int dim;
 public:
-    Tensor1D y, x;
+    Tensor1D y, x, ly, lx;
     int sumDim;
-    bool bTrain;
 
 #if USE_GPU
     void forward() {
@@ -190,7 +192,8 @@ public:
         for (int i = 0; i < count; ++i) {
             for (int j = 0; j < dim; ++j) {
                 dtype v = drop_mask[j][i];
-                batch[i]->drop_mask[j] = v <= dynamicDropValue() ? 0 : 1;
+                batch[i]->drop_mask[j] = v <= dynamicDropValue() ? 0 :
+                    Dropout::Ins().KeepValue(dynamicDropValue());
             }
         }
         for (int idx = 0; idx < count; idx++) {
@@ -221,7 +224,7 @@ public:
             offset += ptr->dim;
         }
 
-        y.vec() = x.vec().unaryExpr(ptr_fun(ftanh));
+        Activation<ACTIVATION_TANH>::forward(x.v, y.v, sumDim);
 
         offset = 0;
         for (int idx = 0; idx < count; idx++) {
@@ -269,7 +272,6 @@ public:
     void backward() {
         int count = batch.size();
         //#pragma omp parallel for
-        Tensor1D lx, ly;
         lx.init(sumDim);
         ly.init(sumDim);
 
@@ -283,7 +285,8 @@ public:
             offset += ptr->dim;
         }
 
-        lx.vec() = ly.vec() * x.vec().binaryExpr(y.vec(), ptr_fun(dtanh));
+        Activation<ACTIVATION_TANH>::backward(x.v, y.v, ly.v, lx.v, sumDim,
+                false);
 
         offset = 0;
         for (int idx = 0; idx < count; idx++) {
@@ -336,11 +339,12 @@ class SigmoidNode :public Node {
 
   public:
     inline void compute() {
-        val.vec() = in->val.vec().unaryExpr(ptr_fun(fsigmoid));
+        Activation<ACTIVATION_SIGMOID>::forward(in->val.v, val.v, dim);
     }
 
     void backward() {
-        in->loss.vec() += loss.vec() * in->val.vec().binaryExpr(val.vec(), ptr_fun(dsigmoid));
+        Activation<ACTIVATION_SIGMOID>::backward(in->val.v, val.v, loss.v,
+                in->loss.v, dim, true);
     }
 
   public:
@@ -359,9 +363,8 @@ class SigmoidExecute :public Execute {
     Tensor2D drop_mask;
     int dim;
 public:
-    Tensor1D x, y;
+    Tensor1D x, y, lx, ly;
     int sumDim;
-    bool bTrain;
 
 #if USE_GPU
     void forward() {
@@ -387,7 +390,8 @@ public:
         for (int i = 0; i < count; ++i) {
             for (int j = 0; j < dim; ++j) {
                 dtype v = drop_mask[j][i];
-                batch[i]->drop_mask[j] = v <= dynamicDropValue() ? 0 : 1;
+                batch[i]->drop_mask[j] = v <= dynamicDropValue() ? 0 :
+                    Dropout::Ins().KeepValue(dynamicDropValue());
             }
         }
         for (int idx = 0; idx < count; idx++) {
@@ -418,7 +422,7 @@ public:
             offset += ptr->dim;
         }
 
-        y.vec() = x.vec().unaryExpr(ptr_fun(fsigmoid));
+        Activation<ACTIVATION_SIGMOID>::forward(x.v, y.v, sumDim);
 
         offset = 0;
         for (int idx = 0; idx < count; idx++) {
@@ -466,7 +470,6 @@ public:
     void backward() {
         int count = batch.size();
         //#pragma omp parallel for
-        Tensor1D lx, ly;
         lx.init(sumDim);
         ly.init(sumDim);
 
@@ -480,7 +483,8 @@ public:
             offset += ptr->dim;
         }
 
-        lx.vec() = ly.vec() * x.vec().binaryExpr(y.vec(), ptr_fun(dsigmoid));
+        Activation<ACTIVATION_SIGMOID>::backward(x.v, y.v, ly.v, lx.v, sumDim,
+                false);
 
         offset = 0;
         for (int idx = 0; idx < count; idx++) {
@@ -534,11 +538,12 @@ class ReluNode :public Node {
 
   public:
     inline void compute() {
-        val.vec() = in->val.vec().unaryExpr(ptr_fun(frelu));
+        Activation<ACTIVATION_RELU>::forward(in->val.v, val.v, dim);
     }
 
     void backward() {
-        in->loss.vec() += loss.vec() * in->val.vec().binaryExpr(val.vec(), ptr_fun(drelu));
+        Activation<ACTIVATION_RELU>::backward(in->val.v, val.v, loss.v,
+                in->loss.v, dim, true);
     }
 
   public:
@@ -873,7 +878,8 @@ class DropoutExecute :public Execute {
         for (int i = 0; i < count; ++i) {
             for (int j = 0; j < dim; ++j) {
                 dtype v = drop_mask[j][i];
-                batch[i]->drop_mask[j] = v <= dynamicDropValue() ? 0 : 1;
+                batch[i]->drop_mask[j] = v <= dynamicDropValue() ? 0 :
+                    Dropout::Ins().KeepValue(dynamicDropValue());
             }
         }
         for (int idx = 0; idx < count; idx++) {
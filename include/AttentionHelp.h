@@ -342,7 +342,9 @@ class AttentionSoftMaxVNode : public Node {
         int count = masks.size();
         for (int idx = 0; idx < count; idx++) {
             masks[idx].init(ndim);
-            mask_losses[idx].init(ndim);
+            if (!inference_only) {
+                mask_losses[idx].init(ndim);
+            }
             unnormed_masks[idx].init(ndim);
         }
         sum.init(ndim);
@@ -95,13 +95,24 @@ class BiNode : public Node {
     inline void init(int ndim, dtype dropout) {
         Node::init(ndim, dropout);
         ty.init(ndim);
-        lty.init(ndim);
+        if (!inference_only) {
+            lty.init(ndim);
+        }
     }
 
     inline void setParam(BiParams* paramInit) {
         param = paramInit;
     }
 
+    const void *paramKey() const override {
+        return param;
+    }
+
+    long long flops() const override {
+        return 2LL * param->W1.outDim() *
+            (param->W1.inDim() + param->W2.inDim());
+    }
+
     inline void clearValue() {
         Node::clearValue();
         in1 = in2 = NULL;
@@ -130,11 +141,13 @@ class BiNode : public Node {
         if (param->bUseB) {
             ty.vec() += param->b.val.vec();
         }
-        val.vec() = ty.vec().unaryExpr(ptr_fun(activate));
+        activateValues(activationKind(activate, derivate), activate, ty.v,
+                val.v, dim);
     }
 
     inline void backward() {
-        lty.vec() = loss.vec() * ty.vec().binaryExpr(val.vec(), ptr_fun(derivate));
+        derivateLosses(activationKind(activate, derivate), derivate, ty.v,
+                val.v, loss.v, lty.v, dim, false);
 
         param->W1.grad.mat() += lty.mat() * in1->val.tmat();
         param->W2.grad.mat() += lty.mat() * in2->val.tmat();
@@ -205,6 +218,15 @@ class LinearBiNode : public Node {
         param = paramInit;
     }
 
+    const void *paramKey() const override {
+        return param;
+    }
+
+    long long flops() const override {
+        return 2LL * param->W1.outDim() *
+            (param->W1.inDim() + param->W2.inDim());
+    }
+
     inline void clearValue() {
         Node::clearValue();
         in1 = in2 = NULL;
@@ -258,17 +280,26 @@ class LinearBiNode : public Node {
         return true;
     }
 
+    size_t typeHashCode() const override {
+        return Node::typeHashCode() ^ ::typeHashCode(param);
+    }
+
 };
 
 
 class BiExecute :public Execute {
   public:
-    Tensor2D x1, x2, ty, y, b;
+    Tensor2D x1, x2, ty, y, b, lx1, lx2, lty, ly;
     Tensor2D drop_mask;
+#if !USE_GPU
+    Tensor2D drop_y;
+    dtype *x1_rows, *x2_rows; // the inputs in place or copied into x1, x2
+#endif
     int inDim1, inDim2, outDim;
     BiParams* param;
     dtype(*activate)(const dtype&);   // activation function
     dtype(*derivate)(const dtype&, const dtype&);  // derivation function of activation function
+    ActivationKind activation; // of activate and derivate
 #if USE_GPU
     void forward() {
         int count = batch.size();
@@ -345,7 +376,8 @@ class BiExecute :public Execute {
         for (int i = 0; i < count; ++i) {
             for (int j = 0; j < outDim; ++j) {
                 dtype v = drop_mask[j][i];
-                batch[i]->drop_mask[j] = v <= dynamicDropValue() ? 0 : 1;
+                batch[i]->drop_mask[j] = v <= dynamicDropValue() ? 0 :
+                    Dropout::Ins().KeepValue(dynamicDropValue());
             }
         }
 
@@ -360,42 +392,25 @@ class BiExecute :public Execute {
 #else
     void  forward() {
         int count = batch.size();
-        x1.init(inDim1, count);
-        x2.init(inDim2, count);
-        b.init(outDim, count);
-        ty.init(outDim, count);
-        y.init(outDim, count);
-
-        for (int idx = 0; idx < count; idx++) {
-            BiNode* ptr = (BiNode*)batch[idx];
-            for (int idy = 0; idy < inDim1; idy++) {
-                x1[idy][idx] = ptr->in1->val[idy];
-            }
-            for (int idy = 0; idy < inDim2; idy++) {
-                x2[idy][idx] = ptr->in2->val[idy];
-            }
-            if (param->bUseB) {
-                for (int idy = 0; idy < outDim; idy++) {
-                    b[idy][idx] = param->b.val.v[idy];
-                }
-            }
-        }
-
-        ty.mat() = param->W1.val.mat() * x1.mat() + param->W2.val.mat() * x2.mat();
+        x1_rows = inputVals([this](int idx) {
+                return static_cast<BiNode*>(batch[idx])->in1;
+                }, inDim1, x1);
+        x2_rows = inputVals([this](int idx) {
+                return static_cast<BiNode*>(batch[idx])->in2;
+                }, inDim2, x2);
+        ty.init(count, outDim);
+        ty.mat() = Mat(x1_rows, count, inDim1) *
+            param->W1.val.mat().transpose() +
+            Mat(x2_rows, count, inDim2) * param->W2.val.mat().transpose();
 
         if (param->bUseB) {
-            ty.vec() = ty.vec() + b.vec();
+            ty.mat().rowwise() += param->b.val.mat().col(0).transpose();
         }
 
-        y.vec() = ty.vec().unaryExpr(ptr_fun(activate));
-
-        for (int idx = 0; idx < count; idx++) {
-            BiNode* ptr = (BiNode*)batch[idx];
-            for (int idy = 0; idy < outDim; idy++) {
-                ptr->val[idy] = y[idy][idx];
-            }
-            ptr->forward_drop(bTrain, drop_factor);
-        }
+        y.init(count, outDim);
+        activateValues(activation, activate, ty.v, y.v, ty.size);
+        outputVals(y, drop_y, ly);
+        forwardDrop(drop_factor);
     }
 #endif
 
@@ -496,45 +511,31 @@ class BiExecute :public Execute {
 #else
     void backward() {
         int count = batch.size();
-        Tensor2D lx1, lx2, lty, ly;
-        lx1.init(inDim1, count);
-        lx2.init(inDim2, count);
-        lty.init(outDim, count);
-        ly.init(outDim, count);
+        outputLosses(ly, outDim);
+        lty.init(count, outDim);
+        derivateLosses(activation, derivate, ty.v, y.v, ly.v, lty.v, ty.size,
+                false);
 
-        for (int idx = 0; idx < count; idx++) {
-            BiNode* ptr = (BiNode*)batch[idx];
-            ptr->backward_drop();
-            for (int idy = 0; idy < outDim; idy++) {
-                ly[idy][idx] = ptr->loss[idy];
-            }
-        }
-
-        lty.vec() = ly.vec() * ty.vec().binaryExpr(y.vec(), ptr_fun(derivate));
-
-        param->W1.grad.mat() += lty.mat() * x1.mat().transpose();
-        param->W2.grad.mat() += lty.mat() * x2.mat().transpose();
+        param->W1.grad.mat() += lty.mat().transpose() *
+            Mat(x1_rows, count, inDim1);
+        param->W2.grad.mat() += lty.mat().transpose() *
+            Mat(x2_rows, count, inDim2);
 
         if (param->bUseB) {
-            for (int idx = 0; idx < count; idx++) {
-                for (int idy = 0; idy < outDim; idy++) {
-                    param->b.grad.v[idy] += lty[idy][idx];
-                }
-            }
+            param->b.grad.mat().col(0) +=
+                lty.mat().colwise().sum().transpose();
         }
 
-        lx1.mat() += param->W1.val.mat().transpose() * lty.mat();
-        lx2.mat() += param->W2.val.mat().transpose() * lty.mat();
-
-        for (int idx = 0; idx < count; idx++) {
-            BiNode* ptr = (BiNode*)batch[idx];
-            for (int idy = 0; idy < inDim1; idy++) {
-                ptr->in1->loss[idy] += lx1[idy][idx];
-            }
-            for (int idy = 0; idy < inDim2; idy++) {
-                ptr->in2->loss[idy] += lx2[idy][idx];
-            }
-        }
+        lx1.init(count, inDim1);
+        lx1.mat() = lty.mat() * param->W1.val.mat();
+        addInputLosses([this](int idx) {
+                return static_cast<BiNode*>(batch[idx])->in1;
+                }, inDim1, lx1.v);
+        lx2.init(count, inDim2);
+        lx2.mat() = lty.mat() * param->W2.val.mat();
+        addInputLosses([this](int idx) {
+                return static_cast<BiNode*>(batch[idx])->in2;
+                }, inDim2, lx2.v);
     }
 #endif
 };
@@ -550,6 +551,7 @@ inline PExecute BiNode::generate(bool bTrain, dtype cur_drop_factor) {
     exec->param = param;
     exec->activate = activate;
     exec->derivate = derivate;
+    exec->activation = activationKind(activate, derivate);
     return exec;
 };
 
@@ -86,6 +86,7 @@ class BiaffineNode : public Node {
     vector<Tensor2D> vals;
     vector<Tensor2D> losses;
     vector<Tensor2D> y1;
+    vector<Tensor2D> lx1, lx2, ly1;
 
   public:
     BiaffineNode() : Node() {
@@ -106,6 +107,10 @@ class BiaffineNode : public Node {
         expandIn2 = expandIns2;
     }
 
+    const void *paramKey() const override {
+        return param;
+    }
+
     inline void clearValue() {
         Node::clearValue();
         in1.clear();
@@ -118,9 +123,12 @@ class BiaffineNode : public Node {
         this->dim = dim;
         vals.resize(classDim);
         losses.resize(classDim);
+        inference_only = InferenceMode::Ins().Enabled();
         for (int i = 0; i < classDim; i++) {
             vals[i].init(dim, dim);
-            losses[i].init(dim, dim);
+            if (!inference_only) {
+                losses[i].init(dim, dim);
+            }
         }
         parents.clear();
     }
@@ -154,6 +162,10 @@ class BiaffineNode : public Node {
         } else
             return false;
     }
+
+    size_t typeHashCode() const override {
+        return Node::typeHashCode() ^ ::typeHashCode(param);
+    }
   public:
     inline void compute() {
         inDim1 = in1[0]->dim;
@@ -187,7 +199,6 @@ class BiaffineNode : public Node {
     }
 
     inline void backward() {
-        vector<Tensor2D> lx1, lx2, ly1;
         lx1.resize(classDim);
         lx2.resize(classDim);
         ly1.resize(classDim);
@@ -31,7 +31,6 @@ class BucketNode : public Node {
         loss = 0;
         degree = 0;
 #endif
-        if (drop_value > 0)drop_mask = 1;
         parents.clear();
     }
 
@@ -101,19 +100,15 @@ class BucketExecute : public Execute {
 class BucketExecute : public Execute {
   public:
     inline void  forward() {
-        int count = batch.size();
-        //#pragma omp parallel for
-        for (int idx = 0; idx < count; idx++) {
+        forEachNode([this](int idx) {
             batch[idx]->forward_drop(bTrain, drop_factor);
-        }
+        });
     }
 
     inline void backward() {
-        int count = batch.size();
-        //#pragma omp parallel for
-        for (int idx = 0; idx < count; idx++) {
+        forEachNode([this](int idx) {
             batch[idx]->backward_drop();
-        }
+        });
     }
 };
 #endif
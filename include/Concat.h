@@ -172,7 +172,8 @@ class ConcatExecute : public Execute {
             for (int i = 0; i < count; ++i) {
                 for (int j = 0; j < outDim; ++j) {
                     dtype v = drop_mask[j][i];
-                    batch[i]->drop_mask[j] = v <= dynamicDropValue() ? 0 : 1;
+                    batch[i]->drop_mask[j] = v <= dynamicDropValue() ? 0 :
+                        Dropout::Ins().KeepValue(dynamicDropValue());
                 }
             }
         }
@@ -219,21 +220,20 @@ class ConcatExecute : public Execute {
 class ConcatExecute : public Execute {
   public:
     inline void  forward() {
-        int count = batch.size();
-        //#pragma omp parallel for
-        for (int idx = 0; idx < count; idx++) {
+        forEachNode([this](int idx) {
             batch[idx]->compute();
             batch[idx]->forward_drop(bTrain, drop_factor);
-        }
+        });
     }
 
     inline void backward() {
-        int count = batch.size();
-        //#pragma omp parallel for
-        for (int idx = 0; idx < count; idx++) {
+        forEachNodeExclusively([this](int idx, vector<const void*> &keys) {
+            ConcatNode *ptr = static_cast<ConcatNode*>(batch[idx]);
+            keys.insert(keys.end(), ptr->ins.begin(), ptr->ins.end());
+        }, [this](int idx) {
             batch[idx]->backward_drop();
             batch[idx]->backward();
-        }
+        });
     }
 };
 #endif
@@ -0,0 +1,236 @@
+#ifndef N3LDG_DATA_PARALLEL_H
+#define N3LDG_DATA_PARALLEL_H
+
+/*
+*  DataParallel.h:
+*  data-parallel training on several cores.
+*  Every worker owns a replica of the model whose params share val with the
+*  master params but keep their own grad, so workers build and run their own
+*  graphs on a shard of the minibatch without touching each other.
+*  reduce() sums the replica grads into the master grads (touched rows only
+*  for sparse params) and clears them, then ModelUpdate runs as usual on the
+*  master params.
+*  Sparse params may instead be updated asynchronously, hogwild style: each
+*  worker applies its touched rows to the master rows right after its
+*  backward, without locks, so the master never sees their grads.
+*/
+
+#include <vector>
+#include <functional>
+#include <iostream>
+#include <cstdlib>
+#include <algorithm>
+#include "BaseParam.h"
+#include "SparseParam.h"
+#include "APParam.h"
+#include "ModelUpdate.h"
+#include "ThreadPool.h"
+
+class DataParallelTrainer {
+public:
+    // master are the params given to ModelUpdate, replicas[i] are the params
+    // of worker i in the same order, e.g. the _params of a ModelUpdate the
+    // replica model exported to. A replica may be the master model itself.
+    // Call it after the master params were initialized or loaded.
+    void init(const std::vector<BaseParam*> &master,
+            const std::vector<std::vector<BaseParam*> > &replicas) {
+#if USE_GPU
+        std::cout << "data parallel training is not supported on gpu" <<
+            std::endl;
+        abort();
+#endif
+        if (replicas.empty()) {
+            std::cout << "DataParallelTrainer init: no replica" << std::endl;
+            abort();
+        }
+        master_params = master;
+        replica_params = replicas;
+        for (std::vector<BaseParam*> &replica : replica_params) {
+            if (replica.size() != master_params.size()) {
+                std::cout << "DataParallelTrainer init: replica has " <<
+                    replica.size() << " params but master has " <<
+                    master_params.size() << std::endl;
+                abort();
+            }
+            for (int i = 0; i < (int)master_params.size(); ++i) {
+                BaseParam *m = master_params.at(i);
+                BaseParam *r = replica.at(i);
+                if (r == m) {
+                    continue;
+                }
+                if (r->val.row != m->val.row || r->val.col != m->val.col ||
+                        r->grad.size != m->grad.size) {
+                    std::cout << "DataParallelTrainer init: param " << i <<
+                        " dims differ" << std::endl;
+                    abort();
+                }
+                r->val.attach(m->val.v, m->val.row, m->val.col);
+                r->clearGrad();
+            }
+        }
+
+        buildChunks();
+        if (ThreadPool::Ins().ThreadCount() < workerCount()) {
+            ThreadPool::Ins().SetThreadCount(workerCount());
+        }
+    }
+
+    int workerCount() const {
+        return replica_params.size();
+    }
+
+    // calls work(worker, begin, end) for every worker with its shard of
+    // [0, count), workers run concurrently and must only use their own
+    // replica and graph
+    void run(int count, const std::function<void(int, int, int)> &work) {
+        int worker_count = workerCount();
+        ThreadPool::Ins().Run(worker_count, [&](int worker) {
+                long long begin = (long long)count * worker / worker_count;
+                long long end = (long long)count * (worker + 1) /
+                    worker_count;
+                if (begin < end) {
+                    work(worker, begin, end);
+                }
+                });
+    }
+
+    // call them at the end of the work passed to run(): the touched rows of
+    // the sparse params of this worker update the master rows at once and
+    // are cleared. Workers touching the same row race on it, a lost update
+    // there is accepted. Sparse grads bypass the grad clipping of update.
+    void asyncUpdateAdagrad(int worker, const ModelUpdate &update) {
+        forEachSparse(worker, [&](SparseParam *m, SparseParam *r) {
+                for (int index : r->touched_rows) {
+                    m->updateRowAdagrad(index, r->grad[index], update._alpha,
+                        update._reg, update._eps);
+                }
+                });
+    }
+
+    void asyncUpdateAdam(int worker, const ModelUpdate &update) {
+        forEachSparse(worker, [&](SparseParam *m, SparseParam *r) {
+                for (int index : r->touched_rows) {
+                    m->updateRowAdam(index, r->grad[index], update._belta1,
+                        update._belta2, update._alpha, update._reg,
+                        update._eps);
+                }
+                });
+    }
+
+    // adds the replica grads to the master grads and clears the former
+    void reduce() {
+        ThreadPool::Ins().Run(chunks.size(), [this](int i) {
+                reduceChunk(chunks.at(i));
+                });
+    }
+
+private:
+    struct Chunk {
+        int param;
+        int row_begin;
+        int row_end;
+    };
+
+    static NRVec<bool> *indexersOf(BaseParam *param) {
+        APParam *ap = dynamic_cast<APParam*>(param);
+        if (ap != NULL) {
+            return &ap->indexers;
+        }
+        return NULL;
+    }
+
+    void forEachSparse(int worker,
+            const std::function<void(SparseParam*, SparseParam*)> &func) {
+        std::vector<BaseParam*> &replica = replica_params.at(worker);
+        for (int i = 0; i < (int)master_params.size(); ++i) {
+            SparseParam *m = dynamic_cast<SparseParam*>(master_params.at(i));
+            if (m == NULL) {
+                continue;
+            }
+            SparseParam *r = static_cast<SparseParam*>(replica.at(i));
+            func(m, r);
+            r->clearGrad();
+        }
+    }
+
+    // splits every dense grad into row ranges of about CHUNK_SIZE values, so
+    // that large matrices are reduced by all threads. A sparse param is one
+    // chunk, only its touched rows are visited.
+    void buildChunks() {
+        static const int CHUNK_SIZE = 16384;
+        chunks.clear();
+        for (int i = 0; i < (int)master_params.size(); ++i) {
+            Tensor2D &grad = master_params.at(i)->grad;
+            if (grad.size == 0) {
+                continue;
+            }
+            int rows = std::max(1, CHUNK_SIZE / std::max(1, grad.col));
+            if (dynamic_cast<SparseParam*>(master_params.at(i)) != NULL) {
+                rows = grad.row;
+            }
+            for (int row = 0; row < grad.row; row += rows) {
+                Chunk chunk;
+                chunk.param = i;
+                chunk.row_begin = row;
+                chunk.row_end = std::min(grad.row, row + rows);
+                chunks.push_back(chunk);
+            }
+        }
+    }
+
+    void reduceChunk(const Chunk &chunk) {
+        BaseParam *m = master_params.at(chunk.param);
+        SparseParam *sparse = dynamic_cast<SparseParam*>(m);
+        if (sparse != NULL) {
+            reduceSparse(chunk.param, sparse);
+            return;
+        }
+        NRVec<bool> *master_indexers = indexersOf(m);
+        int col = m->grad.col;
+        for (std::vector<BaseParam*> &replica : replica_params) {
+            BaseParam *r = replica.at(chunk.param);
+            if (r == m) {
+                continue;
+            }
+            NRVec<bool> *indexers = indexersOf(r);
+            for (int row = chunk.row_begin; row < chunk.row_end; ++row) {
+                if (indexers != NULL) {
+                    if (!(*indexers)[row]) continue;
+                    (*indexers)[row] = false;
+                    (*master_indexers)[row] = true;
+                }
+                dtype *src = r->grad[row];
+                dtype *dst = m->grad[row];
+                for (int idx = 0; idx < col; ++idx) {
+                    dst[idx] += src[idx];
+                    src[idx] = 0;
+                }
+            }
+        }
+    }
+
+    void reduceSparse(int param, SparseParam *m) {
+        int col = m->grad.col;
+        for (std::vector<BaseParam*> &replica : replica_params) {
+            SparseParam *r = static_cast<SparseParam*>(replica.at(param));
+            if (r == m) {
+                continue;
+            }
+            for (int index : r->touched_rows) {
+                m->touchRow(index);
+                dtype *src = r->grad[index];
+                dtype *dst = m->grad[index];
+                for (int idx = 0; idx < col; ++idx) {
+                    dst[idx] += src[idx];
+                }
+            }
+            r->clearGrad();
+        }
+    }
+
+    std::vector<BaseParam*> master_params;
+    std::vector<std::vector<BaseParam*> > replica_params;
+    std::vector<Chunk> chunks;
+};
+
+#endif
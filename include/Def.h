@@ -17,10 +17,12 @@ using namespace Eigen;
 typedef float dtype;
 typedef Eigen::TensorMap<Eigen::Tensor<float, 1>>  Vec;
 typedef Eigen::Map<Matrix<float, Dynamic, Dynamic, RowMajor> > Mat;
+typedef Eigen::TensorMap<Eigen::Tensor<float, 1>, Eigen::Aligned> AlignedVec;
 #else
 typedef double dtype;
 typedef Eigen::TensorMap<Eigen::Tensor<double, 1>>  Vec;
 typedef Eigen::Map<Matrix<double, Dynamic, Dynamic, RowMajor> > Mat;
+typedef Eigen::TensorMap<Eigen::Tensor<double, 1>, Eigen::Aligned> AlignedVec;
 #endif
 
 #endif
@@ -0,0 +1,207 @@
+#ifndef N3LDG_DROPOUT_H
+#define N3LDG_DROPOUT_H
+
+/*
+*  Dropout.h:
+*  random numbers for dropout masks. Every thread draws from its own
+*  xoshiro128+ generator, eight of them side by side so that the compiler
+*  vectorizes the steps. Generators are seeded from Seed() and the order in
+*  which threads first draw after it, so single threaded runs repeat.
+*  Masks keep each value with probability 1 - p, SetExactCount(true) keeps
+*  the former scheme of dropping exactly (int)(dim * p) values per node.
+*  SetInverted(true) scales kept values by 1 / (1 - p) in training instead
+*  of scaling all values by 1 - p out of it, so inference skips dropout.
+*  Models must be trained and evaluated with the same setting.
+*/
+
+#include <cstdint>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include "MyLib.h"
+#if USE_GPU
+#include "n3ldg_cuda.h"
+#endif
+
+class Dropout {
+public:
+    static Dropout &Ins() {
+        static Dropout ins;
+        return ins;
+    }
+
+    // generators reseed on their next draw
+    void Seed(uint64_t seed) {
+        seed_ = seed;
+        streams_ = 0;
+        ++generation_;
+    }
+
+    void SetExactCount(bool exact) {
+        exact_count_ = exact;
+    }
+
+    bool ExactCount() const {
+        return exact_count_;
+    }
+
+    void SetInverted(bool inverted) {
+        inverted_ = inverted;
+#if USE_GPU
+        n3ldg_cuda::SetInvertedDropout(inverted);
+#endif
+    }
+
+    bool Inverted() const {
+        return inverted_;
+    }
+
+    // the mask value of kept values when dropping with probability p
+    dtype KeepValue(dtype p) const {
+        return inverted_ && p > 0 && p < 1 ? 1 / (1 - p) : 1;
+    }
+
+    // size uniform 32 bit values
+    void Draw(uint32_t *values, int size) {
+        Generator &generator = ThreadGenerator();
+        int full = size - size % LANES;
+        generator.Fill(values, full);
+        if (full < size) {
+            uint32_t rest[LANES];
+            generator.Fill(rest, LANES);
+            std::copy(rest, rest + size - full, values + full);
+        }
+    }
+
+    // mask[i] is 0 with probability p, else keep, from draws
+    static void ToMask(const uint32_t *draws, dtype *mask, int size, dtype p,
+            dtype keep) {
+        // compared as signed, which sse2 has, in blocks of LANES, which
+        // vectorize without a remainder loop
+        int32_t threshold = (int32_t)(Threshold(p) ^ 0x80000000u);
+        int full = size - size % LANES;
+        for (int i = 0; i < full; i += LANES) {
+            for (int l = 0; l < LANES; ++l) {
+                mask[i + l] = keep *
+                    ((int32_t)(draws[i + l] ^ 0x80000000u) >= threshold);
+            }
+        }
+        for (int i = full; i < size; ++i) {
+            mask[i] = keep * ((int32_t)(draws[i] ^ 0x80000000u) >= threshold);
+        }
+    }
+
+    void Mask(dtype *mask, int size, dtype p) {
+        static thread_local std::vector<uint32_t> draws;
+        draws.resize(size);
+        Draw(draws.data(), size);
+        ToMask(draws.data(), mask, size, p, KeepValue(p));
+    }
+
+    // exactly drop_count zeros at random positions, inverted masks scale
+    // the others by the kept fraction
+    void ExactMask(dtype *mask, int size, int drop_count) {
+        static thread_local std::vector<int> positions;
+        static thread_local std::vector<uint32_t> draws;
+        positions.resize(size);
+        draws.resize(drop_count);
+        dtype keep = inverted_ && drop_count < size ?
+            (dtype)size / (size - drop_count) : 1;
+        for (int i = 0; i < size; ++i) {
+            positions[i] = i;
+            mask[i] = keep;
+        }
+        Draw(draws.data(), drop_count);
+        for (int i = 0; i < drop_count; ++i) {
+            int j = i + (int)(((uint64_t)draws[i] * (size - i)) >> 32);
+            std::swap(positions[i], positions[j]);
+            mask[positions[i]] = 0;
+        }
+    }
+
+private:
+    static const int LANES = 8;
+
+    struct Generator {
+        uint32_t s[4][LANES];
+        unsigned long long generation = 0;
+
+        static uint32_t Rotl(uint32_t x, int k) {
+            return (x << k) | (x >> (32 - k));
+        }
+
+        // size must be a multiple of LANES. The state is copied to locals,
+        // so that stores to out can not alias it and the lanes vectorize.
+        void Fill(uint32_t *out, int size) {
+            uint32_t s0[LANES], s1[LANES], s2[LANES], s3[LANES];
+            for (int l = 0; l < LANES; ++l) {
+                s0[l] = s[0][l];
+                s1[l] = s[1][l];
+                s2[l] = s[2][l];
+                s3[l] = s[3][l];
+            }
+            for (int i = 0; i < size; i += LANES) {
+                for (int l = 0; l < LANES; ++l) {
+                    out[i + l] = s0[l] + s3[l];
+                    uint32_t t = s1[l] << 9;
+                    s2[l] ^= s0[l];
+                    s3[l] ^= s1[l];
+                    s1[l] ^= s2[l];
+                    s0[l] ^= s3[l];
+                    s2[l] ^= t;
+                    s3[l] = Rotl(s3[l], 11);
+                }
+            }
+            for (int l = 0; l < LANES; ++l) {
+                s[0][l] = s0[l];
+                s[1][l] = s1[l];
+                s[2][l] = s2[l];
+                s[3][l] = s3[l];
+            }
+        }
+    };
+
+    static uint64_t SplitMix(uint64_t &x) {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    static uint32_t Threshold(dtype p) {
+        if (p <= 0) {
+            return 0;
+        }
+        if (p >= 1) {
+            return UINT32_MAX;
+        }
+        return (uint32_t)(p * 4294967296.0);
+    }
+
+    Generator &ThreadGenerator() {
+        static thread_local Generator generator;
+        unsigned long long generation = generation_;
+        if (generator.generation != generation) {
+            uint64_t x = seed_ + 0x632BE59BD9B4E019ULL * ++streams_;
+            for (int l = 0; l < LANES; ++l) {
+                for (int i = 0; i < 4; i += 2) {
+                    uint64_t z = SplitMix(x);
+                    generator.s[i][l] = (uint32_t)z;
+                    generator.s[i + 1][l] = (uint32_t)(z >> 32);
+                }
+            }
+            generator.generation = generation;
+        }
+        return generator;
+    }
+
+    Dropout() = default;
+
+    uint64_t seed_ = 0;
+    std::atomic<unsigned long long> streams_ = {0};
+    std::atomic<unsigned long long> generation_ = {1};
+    bool exact_count_ = false;
+    bool inverted_ = false;
+};
+
+#endif
@@ -104,13 +104,24 @@ class FourNode : public Node {
     inline void init(int ndim, dtype dropout) {
         Node::init(ndim, dropout);
         ty.init(ndim);
-        lty.init(ndim);
+        if (!inference_only) {
+            lty.init(ndim);
+        }
     }
 
     inline void setParam(FourParams* paramInit) {
         param = paramInit;
     }
 
+    const void *paramKey() const override {
+        return param;
+    }
+
+    long long flops() const override {
+        return 2LL * param->W1.outDim() * (param->W1.inDim() +
+                param->W2.inDim() + param->W3.inDim() + param->W4.inDim());
+    }
+
     inline void clearValue() {
         Node::clearValue();
         in1 = in2 = in3 = in4 = NULL;
@@ -145,11 +156,13 @@ class FourNode : public Node {
         if (param->bUseB) {
             ty.vec() += param->b.val.vec();
         }
-        val.vec() = ty.vec().unaryExpr(ptr_fun(activate));
+        activateValues(activationKind(activate, derivate), activate, ty.v,
+                val.v, dim);
     }
 
     inline void backward() {
-        lty.vec() = loss.vec() * ty.vec().binaryExpr(val.vec(), ptr_fun(derivate));
+        derivateLosses(activationKind(activate, derivate), derivate, ty.v,
+                val.v, loss.v, lty.v, dim, false);
 
         param->W1.grad.mat() += lty.mat() * in1->val.tmat();
         param->W2.grad.mat() += lty.mat() * in2->val.tmat();
@@ -184,6 +197,13 @@ class FourNode : public Node {
         return true;
     }
 
+    size_t typeHashCode() const override {
+        void *act = reinterpret_cast<void*>(activate);
+        void *de = reinterpret_cast<void*>(derivate);
+        return Node::typeHashCode() ^ ::typeHashCode(param) ^
+            ::typeHashCode(act) ^ (::typeHashCode(de) << 1);
+    }
+
 };
 
 
@@ -207,6 +227,15 @@ class LinearFourNode : public Node {
         param = paramInit;
     }
 
+    const void *paramKey() const override {
+        return param;
+    }
+
+    long long flops() const override {
+        return 2LL * param->W1.outDim() * (param->W1.inDim() +
+                param->W2.inDim() + param->W3.inDim() + param->W4.inDim());
+    }
+
     inline void clearValue() {
         Node::clearValue();
         in1 = in2 = in3 = in4 = NULL;
@@ -268,12 +297,17 @@ class LinearFourNode : public Node {
         return true;
     }
 
+    size_t typeHashCode() const override {
+        return Node::typeHashCode() ^ ::typeHashCode(param);
+    }
+
 };
 
 
+#if USE_GPU
 class FourExecute :public Execute {
 public:
-    Tensor2D x1, x2, x3, x4, ty, y, b;
+    Tensor2D x1, x2, x3, x4, ty, y, b, lx1, lx2, lx3, lx4, lty, ly;
     Tensor2D drop_mask;
     int inDim1, inDim2, inDim3, inDim4, outDim;
     FourParams* param;
@@ -328,7 +362,6 @@ public:
 
     void backward() {
         int count = batch.size();
-        Tensor2D lx1, lx2, lx3, lx4, lty, ly;
         lx1.init(inDim1, count);
         lx2.init(inDim2, count);
         lx3.init(inDim3, count);
@@ -375,6 +408,89 @@ public:
         }
     }
 };
+#else
+class FourExecute :public Execute {
+public:
+    Tensor2D x1, x2, x3, x4, ty, y, lx1, lx2, lx3, lx4, lty, ly;
+    Tensor2D drop_y;
+    dtype *x1_rows, *x2_rows, *x3_rows, *x4_rows; // in place or copied
+    int inDim1, inDim2, inDim3, inDim4, outDim;
+    FourParams* param;
+    dtype(*activate)(const dtype&);   // activation function
+    dtype(*derivate)(const dtype&, const dtype&);  // derivation function of activation function
+    ActivationKind activation; // of activate and derivate
+public:
+
+    void  forward() {
+        int count = batch.size();
+        x1_rows = inputVals([this](int idx) {
+                return static_cast<FourNode*>(batch[idx])->in1;
+                }, inDim1, x1);
+        x2_rows = inputVals([this](int idx) {
+                return static_cast<FourNode*>(batch[idx])->in2;
+                }, inDim2, x2);
+        x3_rows = inputVals([this](int idx) {
+                return static_cast<FourNode*>(batch[idx])->in3;
+                }, inDim3, x3);
+        x4_rows = inputVals([this](int idx) {
+                return static_cast<FourNode*>(batch[idx])->in4;
+                }, inDim4, x4);
+        ty.init(count, outDim);
+        ty.mat() = Mat(x1_rows, count, inDim1) *
+            param->W1.val.mat().transpose() +
+            Mat(x2_rows, count, inDim2) * param->W2.val.mat().transpose() +
+            Mat(x3_rows, count, inDim3) * param->W3.val.mat().transpose() +
+            Mat(x4_rows, count, inDim4) * param->W4.val.mat().transpose();
+        if (param->bUseB) {
+            ty.mat().rowwise() += param->b.val.mat().col(0).transpose();
+        }
+        y.init(count, outDim);
+        activateValues(activation, activate, ty.v, y.v, ty.size);
+        outputVals(y, drop_y, ly);
+        forwardDrop(drop_factor / batch.at(0)->drop_value);
+    }
+
+    void backward() {
+        int count = batch.size();
+        outputLosses(ly, outDim);
+        lty.init(count, outDim);
+        derivateLosses(activation, derivate, ty.v, y.v, ly.v, lty.v, ty.size,
+                false);
+        param->W1.grad.mat() += lty.mat().transpose() *
+            Mat(x1_rows, count, inDim1);
+        param->W2.grad.mat() += lty.mat().transpose() *
+            Mat(x2_rows, count, inDim2);
+        param->W3.grad.mat() += lty.mat().transpose() *
+            Mat(x3_rows, count, inDim3);
+        param->W4.grad.mat() += lty.mat().transpose() *
+            Mat(x4_rows, count, inDim4);
+        if (param->bUseB) {
+            param->b.grad.mat().col(0) +=
+                lty.mat().colwise().sum().transpose();
+        }
+        lx1.init(count, inDim1);
+        lx1.mat() = lty.mat() * param->W1.val.mat();
+        addInputLosses([this](int idx) {
+                return static_cast<FourNode*>(batch[idx])->in1;
+                }, inDim1, lx1.v);
+        lx2.init(count, inDim2);
+        lx2.mat() = lty.mat() * param->W2.val.mat();
+        addInputLosses([this](int idx) {
+                return static_cast<FourNode*>(batch[idx])->in2;
+                }, inDim2, lx2.v);
+        lx3.init(count, inDim3);
+        lx3.mat() = lty.mat() * param->W3.val.mat();
+        addInputLosses([this](int idx) {
+                return static_cast<FourNode*>(batch[idx])->in3;
+                }, inDim3, lx3.v);
+        lx4.init(count, inDim4);
+        lx4.mat() = lty.mat() * param->W4.val.mat();
+        addInputLosses([this](int idx) {
+                return static_cast<FourNode*>(batch[idx])->in4;
+                }, inDim4, lx4.v);
+    }
+};
+#endif
 
 inline PExecute FourNode::generate(bool bTrain, dtype cur_drop_factor) {
     FourExecute* exec = new FourExecute();
@@ -389,12 +505,13 @@ inline PExecute FourNode::generate(bool bTrain, dtype cur_drop_factor) {
     exec->param = param;
     exec->activate = activate;
     exec->derivate = derivate;
+    exec->activation = activationKind(activate, derivate);
     return exec;
 };
 
 class LinearFourExecute :public Execute {
 public:
-    Tensor2D x1, x2, x3, x4, y, b;
+    Tensor2D x1, x2, x3, x4, y, b, lx1, lx2, lx3, lx4, ly;
     int inDim1, inDim2, inDim3, inDim4, outDim, count;
     FourParams* param;
 
@@ -446,7 +563,6 @@ public:
     }
 
     inline void backward() {
-        Tensor2D lx1, lx2, lx3, lx4, ly;
         lx1.init(inDim1, count);
         lx2.init(inDim2, count);
         lx3.init(inDim3, count);
@@ -17,29 +17,15 @@
 #include <map>
 #include <unordered_map>
 #include "profiler.h"
+#include "ThreadPool.h"
+#include "PerfCounters.h"
 #include <vector>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
 
 using namespace Eigen;
 
-int GetDegree(std::map<void*, int> &degree_map, PNode p) {
-    auto it = degree_map.find(p);
-    if (it == degree_map.end()) {
-        degree_map.insert(std::pair<void*, int>(p, p->degree));
-        return p->degree;
-    } else {
-        return it->second;
-    }
-}
-
-void DecreaseDegree(std::map<void*, int> &degree_map, PNode p) {
-    auto it = degree_map.find(p);
-    if (it == degree_map.end()) {
-        degree_map.insert(std::pair<void*, int>(p, p->degree - 1));
-    } else {
-        --(it->second);
-    }
-}
-
 struct SelfHash {
     size_t operator()(size_t hash) const {
         return hash;
@@ -67,15 +53,168 @@ int Size(const NodeMap &map) {
     return sum;
 }
 
+inline void HashCombine(size_t &seed, size_t value) {
+    seed ^= value + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+}
+
+// the schedule of one compute(): which nodes each Execute batches, in order
+// slots are node positions relative to the first node of that compute()
+struct ExecutePlan {
+    int node_count;
+    vector<size_t> type_hashes; // typeHashCode() of the nodes, by slot
+    vector<PExecute> execs;
+    vector<vector<int> > slots;
+    vector<int> wave_begins;
+    bool in_use;
+
+    ExecutePlan() {
+        node_count = 0;
+        in_use = false;
+    }
+
+    ~ExecutePlan() {
+        for (PExecute e : execs) {
+            delete e;
+        }
+    }
+};
+
+typedef std::unordered_map<size_t, ExecutePlan*, SelfHash> PlanMap;
+typedef std::unordered_map<size_t, vector<PExecute>, SelfHash> ExecutePool;
+
+enum BatchingStrategy {
+    // every free node runs at once, grouped by type
+    WAVEFRONT_BATCHING = 0,
+    // nodes of one type at the same depth are batched
+    DEPTH_BATCHING = 1,
+    // one type runs at a time, the one with the lowest average depth of the
+    // nodes not executed yet, so that ready nodes wait for deeper ones
+    AGENDA_BATCHING = 2
+};
+
+struct BatchStat {
+    std::string node_type;
+    int batch_count;
+    long long node_count;
+    int max_size;
+    // batch counts by size, bucket i counts sizes from 2^i to 2^(i+1) - 1
+    vector<int> size_buckets;
+
+    BatchStat() {
+        batch_count = 0;
+        node_count = 0;
+        max_size = 0;
+    }
+
+    void add(int size) {
+        batch_count++;
+        node_count += size;
+        max_size = std::max(max_size, size);
+        int bucket = 0;
+        while ((size >> (bucket + 1)) > 0) {
+            bucket++;
+        }
+        if (bucket >= (int)size_buckets.size()) {
+            size_buckets.resize(bucket + 1, 0);
+        }
+        size_buckets.at(bucket)++;
+    }
+};
+
+struct WaveStat {
+    long long wave_count;
+    long long exec_count;
+    int max_execs; // of one wave
+
+    WaveStat() {
+        wave_count = 0;
+        exec_count = 0;
+        max_execs = 0;
+    }
+};
+
+// batches of one node type and dim that ran in the same wave, but apart
+// because typeEqual tells their nodes apart
+struct NearMiss {
+    std::string node_type;
+    long long extra_batches; // one per batch beyond the first of a wave
+    bool param_differs; // by paramKey(), a different layer usually
+    // the same params but another field differs, e.g. activation functions
+    // or TransferNode::xid, restructuring the model may batch them
+    bool field_differs;
+
+    NearMiss() {
+        extra_batches = 0;
+        param_differs = false;
+        field_differs = false;
+    }
+};
+
+// wall time of the execs of one node type, see Graph::setProfilingEnabled
+struct ExecuteProfile {
+    long long forward_ns;
+    long long backward_ns;
+    int forward_batches;
+    int backward_batches;
+    long long node_count;
+    long long flops; // estimated forward flops, see Node::flops()
+    // by PerfCounter, see Graph::setPerfCountersEnabled
+    long long forward_counters[PERF_COUNTER_COUNT];
+    long long backward_counters[PERF_COUNTER_COUNT];
+
+    ExecuteProfile() {
+        forward_ns = 0;
+        backward_ns = 0;
+        forward_batches = 0;
+        backward_batches = 0;
+        node_count = 0;
+        flops = 0;
+        for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+            forward_counters[i] = 0;
+            backward_counters[i] = 0;
+        }
+    }
+};
+
 // one Node means a vector
 // the col should be 1, because we aimed for NLP only
 class Graph {
   protected:
     vector<PExecute> execs; //backward
+    vector<int> wave_begins; // where each wave of independent execs starts
+    vector<PExecute> owned_execs; // execs not kept by a plan, pooled in clearValue
+    ExecutePool exec_pool; // execs of earlier graphs by type hash
     vector<PNode> nodes; //forward
-    NodeMap free_nodes;
-    vector<PNode> finish_nodes;
-    vector<PNode> all_nodes;
+    int computed_count; // nodes before this position are computed already
+    bool parallel_execute;
+    bool single_computed; // compute() ran at most once since clearValue
+
+    bool plan_cache_enabled;
+    int max_plan_count;
+    PlanMap plans;
+    vector<size_t> type_hashes; // of the nodes of the current compute()
+
+    BatchingStrategy batching_strategy;
+    std::map<std::string, BatchStat> batch_stats;
+    std::map<size_t, BatchStat> type_batch_stats; // by typeHashCode()
+    WaveStat wave_stat;
+    std::map<std::string, NearMiss> near_misses;
+
+    bool profiling_enabled;
+    bool perf_counters_enabled;
+    std::map<std::string, ExecuteProfile> execute_profiles;
+    vector<long long> exec_times; // of the execs running at once
+    vector<long long> exec_counters; // PERF_COUNTER_COUNT per exec
+
+    bool memory_plan_enabled;
+    bool batch_views_enabled;
+    // val buffers shared by the nodes of non-train graphs, by dim
+    std::unordered_map<int, vector<dtype*> > val_slots;
+    std::unordered_map<int, vector<dtype*> > free_val_slots;
+
+    // nodes added by concurrent builders, by slot, see GraphStagingScope
+    std::map<int, vector<PNode> > staged_nodes;
+    std::mutex staging_mutex;
 
   public:
     bool train;
@@ -88,16 +227,42 @@ class Graph {
   public:
     Graph() {
         drop_factor = 1.0;
+        computed_count = 0;
+        parallel_execute = false;
+        single_computed = true;
+        plan_cache_enabled = false;
+        max_plan_count = 256;
+        batching_strategy = WAVEFRONT_BATCHING;
+        memory_plan_enabled = false;
+        batch_views_enabled = false;
+        profiling_enabled = false;
+        perf_counters_enabled = false;
     }
 
     virtual ~Graph() {
-        int count = execs.size();
+        int count = owned_execs.size();
         for (int idx = 0; idx < count; idx++) {
-            delete execs.at(idx);
+            delete owned_execs.at(idx);
+        }
+        owned_execs.clear();
+        for (auto &it : exec_pool) {
+            for (PExecute e : it.second) {
+                delete e;
+            }
         }
+        exec_pool.clear();
         execs.clear();
         nodes.clear();
-        free_nodes.clear();
+        for (auto &it : plans) {
+            delete it.second;
+        }
+        plans.clear();
+        for (auto &it : val_slots) {
+            for (dtype *slot : it.second) {
+                freeAligned(slot);
+            }
+        }
+        val_slots.clear();
     }
 
 
@@ -107,63 +272,361 @@ class Graph {
         if (drop_factor >= 1.0) drop_factor = 1.0;
     }
 
+    // graphs with the same structure as an earlier one replay its schedule
+    // instead of batching the nodes again
+    inline void setPlanCacheEnabled(bool enabled, int max_plans = 256) {
+#if USE_GPU
+        if (enabled) {
+            std::cout << "plan cache is not supported on gpu" << std::endl;
+            enabled = false;
+        }
+#endif
+        plan_cache_enabled = enabled;
+        max_plan_count = max_plans;
+        if (!enabled) {
+            clearPlanCache();
+        }
+    }
+
+    // only safe when no plan is replayed by the current graph
+    inline void clearPlanCache() {
+        for (auto &it : plans) {
+            if (it.second->in_use) {
+                std::cout << "clearPlanCache: a plan is still in use" << std::endl;
+                abort();
+            }
+            delete it.second;
+        }
+        plans.clear();
+    }
+
+    inline int planCount() const {
+        return plans.size();
+    }
+
+    // run the execs of one wave on ThreadPool::Ins() in forward and backward
+    inline void setParallelExecute(bool enabled) {
+#if USE_GPU
+        if (enabled) {
+            std::cout << "parallel execute is not supported on gpu" << std::endl;
+            enabled = false;
+        }
+#endif
+        parallel_execute = enabled;
+    }
+
+    // in non-train graphs, nodes whose lifetimes do not overlap share val
+    // buffers. The vals of nodes without consumers stay readable until
+    // clearValue(), a node consumed within its own compute() can not be
+    // consumed again by nodes of a later compute(), addParent() aborts.
+    inline void setMemoryPlanEnabled(bool enabled) {
+#if USE_GPU
+        if (enabled) {
+            std::cout << "memory plan is not supported on gpu" << std::endl;
+            enabled = false;
+        }
+#endif
+        memory_plan_enabled = enabled;
+    }
+
+    // the vals and losses of nodes whose execute supports it become views of
+    // its batch matrices, one row per node, so consumers batched the same
+    // way read and accumulate them in place. Such vals stay valid until
+    // clearValue().
+    inline void setBatchViewsEnabled(bool enabled) {
+#if USE_GPU
+        if (enabled) {
+            std::cout << "batch views are not supported on gpu" << std::endl;
+            enabled = false;
+        }
+#endif
+        batch_views_enabled = enabled;
+    }
+
+    inline void setBatchingStrategy(BatchingStrategy strategy) {
+        batching_strategy = strategy;
+    }
+
+    inline BatchingStrategy batchingStrategy() const {
+        return batching_strategy;
+    }
+
+    // batch sizes per node type, collected since the last resetBatchStats()
+    inline const std::map<std::string, BatchStat> &batchStats() const {
+        return batch_stats;
+    }
+
+    // batch sizes per typeHashCode(), types of one node type differ in
+    // params or fields of typeEqual
+    inline const std::map<size_t, BatchStat> &typeBatchStats() const {
+        return type_batch_stats;
+    }
+
+    inline const WaveStat &waveStats() const {
+        return wave_stat;
+    }
+
+    // node types split into several batches of one wave, by node type
+    inline const std::map<std::string, NearMiss> &nearMisses() const {
+        return near_misses;
+    }
+
+    inline void resetBatchStats() {
+        batch_stats.clear();
+        type_batch_stats.clear();
+        wave_stat = WaveStat();
+        near_misses.clear();
+    }
+
+    void printBatchStats() const {
+        for (auto &it : batch_stats) {
+            const BatchStat &stat = it.second;
+            std::cout << it.first << " batches:" << stat.batch_count <<
+                " nodes:" << stat.node_count << " average:" <<
+                (double)stat.node_count / stat.batch_count << std::endl;
+        }
+        std::cout << "waves:" << wave_stat.wave_count << " execs:" <<
+            wave_stat.exec_count << " average:" <<
+            (wave_stat.wave_count > 0 ?
+             (double)wave_stat.exec_count / wave_stat.wave_count : 0) <<
+            " max:" << wave_stat.max_execs << std::endl;
+        for (auto &it : type_batch_stats) {
+            const BatchStat &stat = it.second;
+            std::cout << stat.node_type << " " << std::hex << it.first <<
+                std::dec << " batches:" << stat.batch_count << " nodes:" <<
+                stat.node_count << " max:" << stat.max_size << " sizes:";
+            for (size_t i = 0; i < stat.size_buckets.size(); ++i) {
+                std::cout << " " << (1 << i) << "+:" << stat.size_buckets.at(i);
+            }
+            std::cout << std::endl;
+        }
+        for (auto &it : near_misses) {
+            const NearMiss &miss = it.second;
+            std::cout << "near miss " << miss.node_type << " extra batches:" <<
+                miss.extra_batches << (miss.param_differs ? " params" : "") <<
+                (miss.field_differs ? " fields" : "") << std::endl;
+        }
+    }
+
+    // times every exec in compute() and backward() and adds it to the
+    // profile of its node type. On gpu only the host side is timed.
+    inline void setProfilingEnabled(bool enabled) {
+        profiling_enabled = enabled;
+    }
+
+    // with profiling, also adds the hardware counters of the thread running
+    // an exec to its profile. Work an exec hands to idle pool threads is not
+    // counted, and counters read 0 where perf_event_open is not allowed.
+    inline void setPerfCountersEnabled(bool enabled) {
+        perf_counters_enabled = enabled;
+    }
+
+    // collected since the last resetExecuteProfiles()
+    inline const std::map<std::string, ExecuteProfile> &executeProfiles() const {
+        return execute_profiles;
+    }
+
+    inline void resetExecuteProfiles() {
+        execute_profiles.clear();
+    }
+
+    // node types by total time, with their share of the time of all execs
+    void printExecuteProfiles() const {
+        vector<std::pair<std::string, ExecuteProfile> > profiles(
+                execute_profiles.begin(), execute_profiles.end());
+        long long total = 0;
+        for (auto &it : profiles) {
+            total += it.second.forward_ns + it.second.backward_ns;
+        }
+        std::sort(profiles.begin(), profiles.end(), [](
+                    const std::pair<std::string, ExecuteProfile> &a,
+                    const std::pair<std::string, ExecuteProfile> &b) {
+                return a.second.forward_ns + a.second.backward_ns >
+                    b.second.forward_ns + b.second.backward_ns;
+                });
+        for (auto &it : profiles) {
+            const ExecuteProfile &profile = it.second;
+            long long time = profile.forward_ns + profile.backward_ns;
+            std::cout << it.first << " forward:" << profile.forward_ns / 1e6 <<
+                "ms backward:" << profile.backward_ns / 1e6 << "ms ratio:" <<
+                (total > 0 ? (double)time / total : 0) << " batches:" <<
+                profile.forward_batches << "/" << profile.backward_batches <<
+                " nodes:" << profile.node_count << " gflops:" <<
+                (profile.forward_ns > 0 ?
+                 (double)profile.flops / profile.forward_ns : 0);
+            if (perf_counters_enabled) {
+                for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+                    std::cout << " " << perfCounterName(i) << ":" <<
+                        profile.forward_counters[i] << "/" <<
+                        profile.backward_counters[i];
+                }
+            }
+            std::cout << std::endl;
+        }
+    }
+
   public:
     inline void clearValue(const bool& bTrain = false) {
-        int count = execs.size();
-        for (int idx = 0; idx < count; idx++) {
-            delete execs.at(idx);
+#if !USE_GPU
+        for (PExecute e : execs) {
+            e->releaseViews();
         }
+#endif
+        // pooled in reverse, so that the next graph takes them in the order
+        // they were used and a repeated structure finds tensors of its size
+        for (int idx = owned_execs.size() - 1; idx >= 0; idx--) {
+            PExecute e = owned_execs.at(idx);
+#if USE_GPU
+            delete e;
+#else
+            exec_pool[e->batch.at(0)->typeHashCode()].push_back(e);
+#endif
+        }
+        owned_execs.clear();
         execs.clear();
+        wave_begins.clear();
+        for (auto &it : plans) {
+            it.second->in_use = false;
+        }
 
-        std::set<PNode> uncleared_nodes;
+        // every node resets its own buffers, so one pass over the graph is
+        // enough and no executes have to be generated for it
         for (PNode p : nodes) {
-            uncleared_nodes.insert(p);
-        }
-        while (!uncleared_nodes.empty()) {
-            PNode p = NULL;
-            PExecute cur_exec;
-            for (PNode pp : nodes) {
-                auto find = uncleared_nodes.find(pp);
-                if (p == NULL && find != uncleared_nodes.end()) {
-                    p = pp;
-                    cur_exec = p->generate(bTrain, -1);
-                    cur_exec->addNode(*find);
-                    uncleared_nodes.erase(find);
-                } else if (p != NULL && find != uncleared_nodes.end()) {
-                    if (p->typeEqual(*find)) {
-                        cur_exec->addNode(*find);
-                        uncleared_nodes.erase(find);
-                    }
-                }
-            }
-            cur_exec->clearValue();
+            p->clearValue();
+            p->val_released = false;
+        }
+#if USE_GPU
+        clearNodes(nodes);
+#endif
+        for (auto &it : val_slots) {
+            free_val_slots[it.first].assign(it.second.begin(), it.second.end());
         }
 
         nodes.clear();
-        free_nodes.clear();
-        finish_nodes.clear();
-        all_nodes.clear();
-
+        computed_count = 0;
+        single_computed = true;
         train = bTrain;
     }
 
     inline void backward() {
-        int count = execs.size();
-        for (int idx = count - 1; idx >= 0; idx--) {
-            execs.at(idx)->backward();
+        static const int event = n3ldg_cuda::Profiler::Ins().EventId("backward");
+        n3ldg_cuda::ProfileScope scope(event);
+        n3ldg_cuda::Profiler::Ins().TraceBegin("backward", "graph");
+        // consumers added after their inputs were computed are not linked as
+        // parents, so conflicts can only be found for single compute() graphs
+        if (parallel_execute && ThreadPool::Ins().ThreadCount() > 1 &&
+                single_computed) {
+            parallelBackward();
+        } else {
+            int count = execs.size();
+            for (int idx = count - 1; idx >= 0; idx--) {
+                runExecutes(&execs.at(idx), 1, false, false);
+            }
         }
+        n3ldg_cuda::Profiler::Ins().TraceEnd("graph");
     }
 
     inline void addNode(PNode x) {
+        StagingTarget &staging = ActiveStaging();
+        if (staging.graph == this) {
+            staging.nodes->push_back(x);
+            return;
+        }
+        x->node_index = nodes.size();
         nodes.push_back(x);
-        if (x->degree == 0) {
-            Insert(x, free_nodes);
+    }
+
+    struct StagingTarget {
+        Graph *graph;
+        vector<PNode> *nodes;
+    };
+
+    // the staging list addNode() uses on this thread
+    static StagingTarget &ActiveStaging() {
+        static thread_local StagingTarget target = {NULL, NULL};
+        return target;
+    }
+
+    vector<PNode> *stagingList(int slot) {
+        std::lock_guard<std::mutex> lock(staging_mutex);
+        return &staged_nodes[slot];
+    }
+
+    // appends the staged nodes in slot order, call it when the builders
+    // finished and before compute(). Staged nodes survive clearValue(), so
+    // the next minibatch can be built while the current one computes.
+    void mergeStaged() {
+        std::lock_guard<std::mutex> lock(staging_mutex);
+        for (auto &it : staged_nodes) {
+            for (PNode x : it.second) {
+                x->node_index = nodes.size();
+                nodes.push_back(x);
+            }
+        }
+        staged_nodes.clear();
+    }
+
+    // hash of the node types and edges added since the last compute(), the
+    // typeHashCode() of every node goes to type_hashes
+    size_t structureSignature(vector<size_t> &type_hashes) const {
+        int count = nodes.size();
+        size_t signature = std::hash<int>{}(count - computed_count);
+        HashCombine(signature, std::hash<bool>{}(train));
+        HashCombine(signature, std::hash<dtype>{}(drop_factor));
+        HashCombine(signature, std::hash<int>{}(batching_strategy));
+        HashCombine(signature, std::hash<bool>{}(batch_views_enabled));
+        type_hashes.clear();
+        type_hashes.reserve(count - computed_count);
+        for (int idx = computed_count; idx < count; idx++) {
+            PNode p = nodes.at(idx);
+            type_hashes.push_back(p->typeHashCode());
+            HashCombine(signature, type_hashes.back());
+            HashCombine(signature, std::hash<int>{}(p->degree));
+            for (PNode parent : p->parents) {
+                HashCombine(signature,
+                        std::hash<int>{}(parent->node_index - computed_count));
+            }
         }
-        all_nodes.push_back(x);
+        return signature;
     }
 
     //real executation
     void compute() {
+        static const int event = n3ldg_cuda::Profiler::Ins().EventId("compute");
+        n3ldg_cuda::ProfileScope scope(event);
+        n3ldg_cuda::Profiler::Ins().TraceBegin("compute", "graph");
+        int count = nodes.size();
+        if (train) {
+            for (int idx = computed_count; idx < count; idx++) {
+                if (nodes.at(idx)->inference_only) {
+                    std::cout << "compute: a " << nodes.at(idx)->node_type <<
+                        " node initialized in inference mode can not be "
+                        "trained" << std::endl;
+                    abort();
+                }
+            }
+        }
+        size_t signature = 0;
+        if (plan_cache_enabled) {
+            signature = structureSignature(type_hashes);
+            auto it = plans.find(signature);
+            // a signature collision must not replay another structure
+            if (it != plans.end() && !it->second->in_use &&
+                    it->second->node_count == count - computed_count &&
+                    it->second->type_hashes == type_hashes) {
+                replay(*it->second);
+                n3ldg_cuda::Profiler::Ins().TraceEnd("graph");
+                return;
+            }
+        }
+
+        if (computed_count > 0) {
+            single_computed = false;
+        }
+        int exec_begin = execs.size();
+        vector<vector<PNode> > batches;
+        vector<int> batch_wave_begins;
+        schedule(batches, batch_wave_begins);
 #if USE_GPU
         if (host_memory == NULL) {
             host_memory = n3ldg_cuda::GraphHostAlloc();
@@ -172,143 +635,733 @@ class Graph {
             device_memory = n3ldg_cuda::Malloc(10000000);
         }
         std::vector<std::vector<NodeInfo>> graph_node_info;
-        computeNodeInfo(graph_node_info);
+        computeNodeInfo(batches, graph_node_info);
         std::vector<int> offsets;
         int actual_size = GraphToMemory(graph_node_info, host_memory, offsets,
                 10000000);
         n3ldg_cuda::Memcpy(device_memory, host_memory, actual_size,
                 cudaMemcpyHostToDevice);
 #endif
-        int step = 0;
 
-        while (Size(free_nodes) > 0) {
+        int batch_count = batches.size();
+        int wave_count = batch_wave_begins.size();
+        if (memory_plan_enabled && !train) {
+            vector<int> node_waves(count - computed_count, -1);
+            for (int wave = 0; wave < wave_count; wave++) {
+                int end = wave + 1 < wave_count ?
+                    batch_wave_begins.at(wave + 1) : batch_count;
+                for (int idx = batch_wave_begins.at(wave); idx < end; idx++) {
+                    for (PNode p : batches.at(idx)) {
+                        node_waves.at(p->node_index - computed_count) = wave;
+                    }
+                }
+            }
+            planVals(node_waves);
+        } else {
+            restoreVals();
+        }
+        int executed_count = 0;
+        for (int wave = 0; wave < wave_count; wave++) {
+            int begin = batch_wave_begins.at(wave);
+            int end = wave + 1 < wave_count ? batch_wave_begins.at(wave + 1) :
+                batch_count;
             vector<PExecute> cur_execs;
-            for (auto it : free_nodes) {
-                PExecute new_exec = it.second.at(0)->generate(train,
-                        drop_factor);
+            for (int idx = begin; idx < end; idx++) {
+                vector<PNode> &batch = batches.at(idx);
+                for (PNode p : batch) {
+                    p->degree = 0;
+                }
+                PExecute new_exec = takeExecute(batch.at(0));
 #if USE_GPU
-                new_exec->graph_info = (char*)device_memory +
-                    offsets.at(step++);
+                new_exec->graph_info = (char*)device_memory + offsets.at(idx);
 #endif
-                new_exec->batch = it.second;
+                new_exec->batch = std::move(batch);
+                countBatch(new_exec->batch);
+                executed_count += new_exec->batch.size();
                 cur_execs.push_back(new_exec);
             }
 
-            for (PExecute e : cur_execs) {
-                e->forward();
-                execs.push_back(e);
-            }
+            countWave(cur_execs.data(), cur_execs.size());
+            wave_begins.push_back(execs.size());
+            execs.insert(execs.end(), cur_execs.begin(), cur_execs.end());
+            forwardWave(cur_execs.data(), cur_execs.size());
+        }
 
-            //finished nodes
-            NodeMap new_free_nodes;
-            for (auto vec_it : free_nodes) {
-                for (auto free_node_it : vec_it.second) {
-                    finish_nodes.push_back(free_node_it);
-                    for (auto parent_it : free_node_it->parents) {
-                        if (parent_it->degree <= 0) {
-                            abort();
-                        }
-                        parent_it->degree--;
-                        if (parent_it->degree == 0) {
-                            Insert(parent_it, new_free_nodes);
+        if (executed_count != count - computed_count) {
+            std::cout << "error: several nodes are not executed, finished: " <<
+                executed_count << ", all: " << count - computed_count <<
+                std::endl;
+            abort();
+        }
+
+        if (plan_cache_enabled && (int)plans.size() < max_plan_count &&
+                plans.find(signature) == plans.end()) {
+            recordPlan(signature, exec_begin, type_hashes);
+        } else {
+            owned_execs.insert(owned_execs.end(), execs.begin() + exec_begin,
+                    execs.end());
+        }
+        computed_count = count;
+        n3ldg_cuda::Profiler::Ins().TraceEnd("graph");
+    }
+
+  protected:
+    void forwardWave(PExecute *wave, int count) {
+        runExecutes(wave, count, parallel_execute, true);
+    }
+
+    // runs forward or backward of the execs, on ThreadPool::Ins() when
+    // parallel, adds their times to the profiles when profiling and reports
+    // them to the Profiler when it traces or builds its call tree
+    void runExecutes(PExecute *group, int count, bool parallel, bool forward) {
+        n3ldg_cuda::Profiler &profiler = n3ldg_cuda::Profiler::Ins();
+        if (!profiling_enabled && !profiler.Tracing() &&
+                !profiler.TreeEnabled()) {
+            if (parallel) {
+                ThreadPool::Ins().Run(count, [group, forward](int i) {
+                        if (forward) {
+                            group[i]->forward();
+                        } else {
+                            group[i]->backward();
                         }
+                        });
+            } else {
+                for (int i = 0; i < count; i++) {
+                    if (forward) {
+                        group[i]->forward();
+                    } else {
+                        group[i]->backward();
                     }
                 }
             }
+            return;
+        }
 
-            // update free nodes
-            free_nodes = std::move(new_free_nodes);
+        exec_times.assign(count, 0);
+        long long *times = exec_times.data();
+        bool counting = profiling_enabled && perf_counters_enabled;
+        if (counting) {
+            exec_counters.assign(count * PERF_COUNTER_COUNT, 0);
         }
+        long long *counters = exec_counters.data();
+        const char *category = forward ? "forward" : "backward";
+        bool tree = profiler.TreeEnabled();
+        // execs on workers are under these instead of compute() or
+        // backward() in the call tree
+        static const int worker_forward = profiler.EventId("worker forward");
+        static const int worker_backward = profiler.EventId("worker backward");
+        int category_event = forward ? worker_forward : worker_backward;
+        auto timed = [group, forward, times, &profiler, category, tree,
+             category_event, counting, counters](int i) {
+            PExecute e = group[i];
+            bool in_worker = tree && ThreadPool::InWorker();
+            if (tree && e->profile_event < 0) {
+                e->profile_event = profiler.EventId(e->batch.at(0)->node_type);
+            }
+            if (in_worker) {
+                profiler.Begin(category_event);
+            }
+            profiler.Begin(e->profile_event);
+            profiler.TraceBegin(e->batch.at(0)->node_type, category);
+            long long counts[PERF_COUNTER_COUNT];
+            if (counting) {
+                PerfCounters::Thread().Read(counts);
+            }
+            auto begin = std::chrono::steady_clock::now();
+            if (forward) {
+                group[i]->forward();
+            } else {
+                group[i]->backward();
+            }
+            times[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - begin).count();
+            if (counting) {
+                long long *exec_counts = counters + i * PERF_COUNTER_COUNT;
+                PerfCounters::Thread().Read(exec_counts);
+                for (int c = 0; c < PERF_COUNTER_COUNT; ++c) {
+                    exec_counts[c] -= counts[c];
+                }
+            }
+            profiler.TraceEnd(category);
+            profiler.End();
+            if (in_worker) {
+                profiler.End();
+            }
+        };
+        if (parallel) {
+            ThreadPool::Ins().Run(count, timed);
+        } else {
+            for (int i = 0; i < count; i++) {
+                timed(i);
+            }
+        }
+        if (!profiling_enabled) {
+            return;
+        }
+        for (int i = 0; i < count; i++) {
+            const vector<PNode> &batch = group[i]->batch;
+            ExecuteProfile &profile =
+                execute_profiles[batch.at(0)->node_type];
+            if (forward) {
+                profile.forward_ns += times[i];
+                profile.forward_batches++;
+                profile.node_count += batch.size();
+                for (PNode p : batch) {
+                    profile.flops += p->flops();
+                }
+            } else {
+                profile.backward_ns += times[i];
+                profile.backward_batches++;
+            }
+            if (counting) {
+                long long *total = forward ? profile.forward_counters :
+                    profile.backward_counters;
+                for (int c = 0; c < PERF_COUNTER_COUNT; ++c) {
+                    total[c] += counters[i * PERF_COUNTER_COUNT + c];
+                }
+            }
+        }
+    }
 
-        if (finish_nodes.size() != all_nodes.size()) {
-            std::cout << "error: several nodes are not executed, finished: " << finish_nodes.size() << ", all: " << all_nodes.size() << std::endl;
-            int total_node_num = all_nodes.size();
-            int unprocessed = 0;
-            for (int idx = 0; idx < total_node_num; idx++) {
-                PNode curNode = all_nodes.at(idx);
-                if (curNode->degree >= 0) {
-                    curNode->typeEqual(all_nodes.at(0));
-                    unprocessed++;
+    // execs of a wave are split into groups that share neither an input node
+    // nor parameters, each group runs its backward concurrently
+    void parallelBackward() {
+        int exec_count = execs.size();
+        int node_count = nodes.size();
+        vector<int> exec_of(node_count, -1);
+        vector<int> wave_of(exec_count);
+        vector<vector<const void*> > keys(exec_count);
+        int wave_count = wave_begins.size();
+        for (int wave = 0; wave < wave_count; wave++) {
+            int end = wave + 1 < wave_count ? wave_begins.at(wave + 1) :
+                exec_count;
+            for (int idx = wave_begins.at(wave); idx < end; idx++) {
+                wave_of.at(idx) = wave;
+            }
+        }
+        for (int idx = 0; idx < exec_count; idx++) {
+            for (PNode p : execs.at(idx)->batch) {
+                exec_of.at(p->node_index) = idx;
+                const void *key = p->paramKey();
+                vector<const void*> &exec_keys = keys.at(idx);
+                if (key != NULL && std::find(exec_keys.begin(),
+                            exec_keys.end(), key) == exec_keys.end()) {
+                    exec_keys.push_back(key);
                 }
             }
-            std::cout << "unprocessed: " << unprocessed << std::endl;
-            abort();
+        }
+
+        vector<vector<int> > conflicts(exec_count);
+        vector<int> consumers;
+        for (PNode p : nodes) {
+            if (p->parents.size() < 2) {
+                continue;
+            }
+            consumers.clear();
+            for (PNode parent : p->parents) {
+                int idx = parent->node_index;
+                if (idx < 0 || idx >= node_count || nodes.at(idx) != parent) {
+                    continue;
+                }
+                int exec = exec_of.at(idx);
+                if (std::find(consumers.begin(), consumers.end(), exec) ==
+                        consumers.end()) {
+                    consumers.push_back(exec);
+                }
+            }
+            for (size_t i = 0; i < consumers.size(); i++) {
+                for (size_t j = i + 1; j < consumers.size(); j++) {
+                    int a = consumers.at(i), b = consumers.at(j);
+                    if (wave_of.at(a) == wave_of.at(b)) {
+                        conflicts.at(a).push_back(b);
+                        conflicts.at(b).push_back(a);
+                    }
+                }
+            }
+        }
+
+        vector<vector<PExecute> > groups;
+        vector<vector<int> > group_members;
+        for (int wave = wave_count - 1; wave >= 0; wave--) {
+            int begin = wave_begins.at(wave);
+            int end = wave + 1 < wave_count ? wave_begins.at(wave + 1) :
+                exec_count;
+            groups.clear();
+            group_members.clear();
+            for (int idx = end - 1; idx >= begin; idx--) {
+                int group = 0, group_count = groups.size();
+                for (; group < group_count; group++) {
+                    bool conflicted = false;
+                    for (int other : group_members.at(group)) {
+                        if (std::find(conflicts.at(idx).begin(),
+                                    conflicts.at(idx).end(), other) !=
+                                conflicts.at(idx).end() ||
+                                shareKey(keys.at(idx), keys.at(other))) {
+                            conflicted = true;
+                            break;
+                        }
+                    }
+                    if (!conflicted) {
+                        break;
+                    }
+                }
+                if (group == group_count) {
+                    groups.push_back(vector<PExecute>());
+                    group_members.push_back(vector<int>());
+                }
+                groups.at(group).push_back(execs.at(idx));
+                group_members.at(group).push_back(idx);
+            }
+            for (vector<PExecute> &group : groups) {
+                runExecutes(group.data(), group.size(), true, false);
+            }
         }
     }
 
-#if USE_GPU
-    void computeNodeInfo(std::vector<std::vector<NodeInfo>> &graph_node_info) const {
-        if (!graph_node_info.empty()) {
-            abort();
+    static bool shareKey(const vector<const void*> &a,
+            const vector<const void*> &b) {
+        for (const void *key : a) {
+            if (std::find(b.begin(), b.end(), key) != b.end()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // an exec pooled by an earlier graph is reused for nodes of the same type
+    // hash, batching already assumes such nodes share one execute, so its
+    // scratch tensors keep their high-water size across minibatches
+    PExecute takeExecute(PNode p) {
+        auto it = exec_pool.find(p->typeHashCode());
+        if (it != exec_pool.end() && !it->second.empty()) {
+            PExecute e = it->second.back();
+            it->second.pop_back();
+            e->bTrain = train;
+            e->drop_factor = drop_factor;
+            e->batch_views = batch_views_enabled;
+            return e;
         }
+        AllocationCounter::Ins().Add();
+        PExecute e = p->generate(train, drop_factor);
+        e->batch_views = batch_views_enabled;
+        return e;
+    }
 
-        std::map<void *, int> degree_map;
-        NodeMap copied_free_nodes = free_nodes;
-        std::vector<PNode> copied_finished_nodes = finish_nodes;
-        int free_count = Size(copied_free_nodes);
+    // a node with inputs among the new nodes gets a slot of val_slots, which
+    // is free again in the wave after its last consumer ran and the node is
+    // marked released, slots of nodes without consumers are kept until
+    // clearValue()
+    // node_waves holds the wave of every new node
+    void planVals(const vector<int> &node_waves) {
+#if !USE_GPU
+        int count = node_waves.size();
+        int wave_count = 0;
+        for (int wave : node_waves) {
+            wave_count = std::max(wave_count, wave + 1);
+        }
+        vector<vector<PNode> > births(wave_count), releases(wave_count + 1);
+        for (int idx = 0; idx < count; idx++) {
+            PNode p = nodes.at(computed_count + idx);
+            if (p->degree <= 0 || node_waves.at(idx) < 0) {
+                if (p->val.isView()) {
+                    p->val.init(p->dim);
+                }
+                continue;
+            }
+            births.at(node_waves.at(idx)).push_back(p);
+            if (p->parents.empty()) {
+                continue;
+            }
+            int last_wave = 0;
+            for (PNode parent : p->parents) {
+                last_wave = std::max(last_wave,
+                        node_waves.at(parent->node_index - computed_count));
+            }
+            releases.at(last_wave + 1).push_back(p);
+        }
 
-        while (Size(copied_free_nodes) > 0) {
-            vector<PExecute> cur_execs;
+        for (int wave = 0; wave < wave_count; wave++) {
+            for (PNode p : releases.at(wave)) {
+                free_val_slots[p->dim].push_back(p->val.v);
+                p->val_released = true;
+            }
+            for (PNode p : births.at(wave)) {
+                vector<dtype*> &free_slots = free_val_slots[p->dim];
+                dtype *slot;
+                if (free_slots.empty()) {
+                    slot = allocateAligned(p->dim);
+                    val_slots[p->dim].push_back(slot);
+                    AllocationCounter::Ins().Add();
+                } else {
+                    slot = free_slots.back();
+                    free_slots.pop_back();
+                }
+                p->val.attach(slot, p->dim);
+                p->val.zero();
+            }
+        }
+#endif
+    }
 
-            for (auto it : copied_free_nodes) {
-                PExecute new_exec = it.second.at(0)->generate(train,
-                        drop_factor);
-                new_exec->batch = it.second;
-                cur_execs.push_back(new_exec);
+    // nodes planned by a non-train graph own their vals again, batch views
+    // were released by clearValue() already
+    void restoreVals() {
+#if !USE_GPU
+        int count = nodes.size();
+        for (int idx = computed_count; idx < count; idx++) {
+            PNode p = nodes.at(idx);
+            if (p->val.isView()) {
+                p->val.init(p->dim);
             }
+            if (p->loss.isView()) {
+                p->loss.init(p->dim);
+            }
+        }
+#endif
+    }
 
-            for (PExecute e : cur_execs) {
-                std::vector<NodeInfo> node_info_vec;
-                for (PNode p : e->batch) {
-                    NodeInfo info;
-                    p->toNodeInfo(info);
-                    node_info_vec.push_back(info);
+    void countBatch(const vector<PNode> &batch) {
+        BatchStat &stat = batch_stats[batch.at(0)->node_type];
+        stat.node_type = batch.at(0)->node_type;
+        stat.add(batch.size());
+        BatchStat &type_stat = type_batch_stats[batch.at(0)->typeHashCode()];
+        type_stat.node_type = batch.at(0)->node_type;
+        type_stat.add(batch.size());
+    }
+
+    // batches of a wave whose nodes agree in node type, dim and dropout but
+    // not in their type hash are near misses
+    void countWave(PExecute *wave, int count) {
+        wave_stat.wave_count++;
+        wave_stat.exec_count += count;
+        wave_stat.max_execs = std::max(wave_stat.max_execs, count);
+        for (int i = 1; i < count; i++) {
+            PNode a = wave[i]->batch.at(0);
+            for (int j = 0; j < i; j++) {
+                PNode b = wave[j]->batch.at(0);
+                if (a->Node::typeHashCode() != b->Node::typeHashCode() ||
+                        a->node_type != b->node_type || a->dim != b->dim ||
+                        a->typeHashCode() == b->typeHashCode()) {
+                    continue;
+                }
+                NearMiss &miss = near_misses[a->node_type];
+                miss.node_type = a->node_type;
+                miss.extra_batches++;
+                if (a->paramKey() != b->paramKey()) {
+                    miss.param_differs = true;
+                } else {
+                    miss.field_differs = true;
                 }
-                graph_node_info.push_back(node_info_vec);
+                break;
             }
+        }
+    }
 
-            for (PExecute e : cur_execs) {
-                delete e;
+    // position of a consumer among the nodes added since the last compute()
+    int localIndex(PNode p) const {
+        int idx = p->node_index;
+        if (idx < computed_count || idx >= (int)nodes.size() ||
+                nodes.at(idx) != p) {
+            std::cout << "error: a " << p->node_type <<
+                " node consumes an uncomputed node but is not added to the graph" <<
+                std::endl;
+            abort();
+        }
+        return idx - computed_count;
+    }
+
+    // splits the nodes added since the last compute() into batches of one
+    // type hash, a batch only depends on batches of earlier waves
+    void schedule(vector<vector<PNode> > &batches,
+            vector<int> &batch_wave_begins) const {
+        int count = nodes.size() - computed_count;
+        vector<int> pending(count);
+        for (int idx = 0; idx < count; idx++) {
+            pending.at(idx) = nodes.at(computed_count + idx)->degree;
+        }
+        if (batching_strategy == WAVEFRONT_BATCHING) {
+            scheduleWavefront(pending, batches, batch_wave_begins);
+            return;
+        }
+
+        vector<int> order, depths, heights;
+        computeDepths(pending, order, depths, heights);
+        if (batching_strategy == DEPTH_BATCHING) {
+            int max_depth = 0;
+            for (int idx : order) {
+                max_depth = std::max(max_depth, depths.at(idx));
+            }
+            vector<NodeMap> levels(order.empty() ? 0 : max_depth + 1);
+            for (int idx : order) {
+                Insert(nodes.at(computed_count + idx), levels.at(depths.at(idx)));
             }
+            for (NodeMap &level : levels) {
+                batch_wave_begins.push_back(batches.size());
+                for (auto &it : level) {
+                    batches.push_back(std::move(it.second));
+                }
+            }
+        } else {
+            scheduleAgenda(pending, order, depths, heights, batches,
+                    batch_wave_begins);
+        }
+    }
 
-            //finished nodes
+    void scheduleWavefront(vector<int> &pending, vector<vector<PNode> > &batches,
+            vector<int> &batch_wave_begins) const {
+        NodeMap free_nodes;
+        int count = nodes.size();
+        for (int idx = computed_count; idx < count; idx++) {
+            if (pending.at(idx - computed_count) == 0) {
+                Insert(nodes.at(idx), free_nodes);
+            }
+        }
+        while (!free_nodes.empty()) {
+            batch_wave_begins.push_back(batches.size());
             NodeMap new_free_nodes;
-            for (auto vec_it : copied_free_nodes) {
-                for (auto free_node_it : vec_it.second) {
-                    copied_finished_nodes.push_back(free_node_it);
-                    for (auto parent_it : free_node_it->parents) {
-                        DecreaseDegree(degree_map, parent_it);
-                        int degree = GetDegree(degree_map, parent_it);
-                        if (degree < 0) {
+            for (auto &it : free_nodes) {
+                for (PNode p : it.second) {
+                    for (PNode parent : p->parents) {
+                        int &degree = pending.at(localIndex(parent));
+                        if (degree <= 0) {
                             abort();
                         }
-                        if (degree == 0) {
-                            Insert(parent_it, new_free_nodes);
+                        if (--degree == 0) {
+                            Insert(parent, new_free_nodes);
                         }
                     }
                 }
+                batches.push_back(std::move(it.second));
             }
+            free_nodes = std::move(new_free_nodes);
+        }
+    }
 
-            copied_free_nodes = std::move(new_free_nodes);
+    // order: a topological order of the reachable nodes
+    // depth: the longest path from a node without uncomputed inputs
+    // height: the longest path to a node without consumers
+    void computeDepths(vector<int> pending, vector<int> &order,
+            vector<int> &depths, vector<int> &heights) const {
+        int count = pending.size();
+        depths.assign(count, 0);
+        heights.assign(count, 0);
+        order.reserve(count);
+        for (int idx = 0; idx < count; idx++) {
+            if (pending.at(idx) == 0) {
+                order.push_back(idx);
+            }
         }
+        for (size_t i = 0; i < order.size(); i++) {
+            int idx = order.at(i);
+            for (PNode parent : nodes.at(computed_count + idx)->parents) {
+                int parent_idx = localIndex(parent);
+                int &degree = pending.at(parent_idx);
+                if (degree <= 0) {
+                    abort();
+                }
+                depths.at(parent_idx) = std::max(depths.at(parent_idx),
+                        depths.at(idx) + 1);
+                if (--degree == 0) {
+                    order.push_back(parent_idx);
+                }
+            }
+        }
+        for (int i = order.size() - 1; i >= 0; i--) {
+            int idx = order.at(i);
+            for (PNode parent : nodes.at(computed_count + idx)->parents) {
+                heights.at(idx) = std::max(heights.at(idx),
+                        heights.at(localIndex(parent)) + 1);
+            }
+        }
+    }
 
-        if (copied_finished_nodes.size() != all_nodes.size()) {
-            int total_node_num = all_nodes.size();
-            int unprocessed = 0;
-            for (int idx = 0; idx < total_node_num; idx++) {
-                PNode curNode = all_nodes.at(idx);
-                if (GetDegree(degree_map, curNode) >= 0) {
-                    curNode->typeEqual(all_nodes.at(0));
-                    unprocessed++;
+    // ties of the average depth go to the type whose ready nodes lie on the
+    // longest path to the outputs
+    void scheduleAgenda(vector<int> &pending, const vector<int> &order,
+            const vector<int> &depths, const vector<int> &heights,
+            vector<vector<PNode> > &batches,
+            vector<int> &batch_wave_begins) const {
+        struct TypeAgenda {
+            int remaining = 0;
+            long long depth_sum = 0;
+            int ready_height = -1;
+        };
+        std::unordered_map<size_t, TypeAgenda, SelfHash> agendas;
+        vector<size_t> hashes(pending.size());
+        for (int idx : order) {
+            hashes.at(idx) = nodes.at(computed_count + idx)->typeHashCode();
+            TypeAgenda &agenda = agendas[hashes.at(idx)];
+            agenda.remaining++;
+            agenda.depth_sum += depths.at(idx);
+        }
+
+        NodeMap ready;
+        for (int idx : order) {
+            if (pending.at(idx) == 0) {
+                ready[hashes.at(idx)].push_back(nodes.at(computed_count + idx));
+                TypeAgenda &agenda = agendas.at(hashes.at(idx));
+                agenda.ready_height = std::max(agenda.ready_height,
+                        heights.at(idx));
+            }
+        }
+
+        while (!ready.empty()) {
+            auto best = ready.end();
+            double best_depth = 0;
+            int best_height = 0;
+            for (auto it = ready.begin(); it != ready.end(); ++it) {
+                const TypeAgenda &agenda = agendas.at(it->first);
+                double depth = (double)agenda.depth_sum / agenda.remaining;
+                if (best == ready.end() || depth < best_depth ||
+                        (depth == best_depth &&
+                         agenda.ready_height > best_height)) {
+                    best = it;
+                    best_depth = depth;
+                    best_height = agenda.ready_height;
+                }
+            }
+
+            TypeAgenda &agenda = agendas.at(best->first);
+            agenda.ready_height = -1;
+            vector<PNode> batch = std::move(best->second);
+            ready.erase(best);
+            for (PNode p : batch) {
+                agenda.remaining--;
+                agenda.depth_sum -= depths.at(p->node_index - computed_count);
+            }
+            for (PNode p : batch) {
+                for (PNode parent : p->parents) {
+                    int parent_idx = localIndex(parent);
+                    if (--pending.at(parent_idx) == 0) {
+                        size_t hash = hashes.at(parent_idx);
+                        ready[hash].push_back(parent);
+                        TypeAgenda &parent_agenda = agendas.at(hash);
+                        parent_agenda.ready_height = std::max(
+                                parent_agenda.ready_height,
+                                heights.at(parent_idx));
+                    }
+                }
+            }
+            batch_wave_begins.push_back(batches.size());
+            batches.push_back(std::move(batch));
+        }
+    }
+
+    void recordPlan(size_t signature, int exec_begin,
+            vector<size_t> &type_hashes) {
+        ExecutePlan *plan = new ExecutePlan();
+        plan->node_count = nodes.size() - computed_count;
+        plan->type_hashes.swap(type_hashes);
+        int exec_count = execs.size();
+        for (int wave_begin : wave_begins) {
+            if (wave_begin >= exec_begin) {
+                plan->wave_begins.push_back(wave_begin - exec_begin);
+            }
+        }
+        for (int idx = exec_begin; idx < exec_count; idx++) {
+            PExecute e = execs.at(idx);
+            vector<int> slots;
+            slots.reserve(e->batch.size());
+            for (PNode p : e->batch) {
+                slots.push_back(p->node_index - computed_count);
+            }
+            plan->execs.push_back(e);
+            plan->slots.push_back(std::move(slots));
+        }
+        plan->in_use = true;
+        plans.insert(std::make_pair(signature, plan));
+    }
+
+    void replay(ExecutePlan &plan) {
+        if (computed_count > 0) {
+            single_computed = false;
+        }
+        plan.in_use = true;
+        int exec_count = plan.execs.size();
+        int wave_count = plan.wave_begins.size();
+        if (memory_plan_enabled && !train) {
+            vector<int> node_waves(plan.node_count, -1);
+            for (int wave = 0; wave < wave_count; wave++) {
+                int end = wave + 1 < wave_count ? plan.wave_begins.at(wave + 1) :
+                    exec_count;
+                for (int idx = plan.wave_begins.at(wave); idx < end; idx++) {
+                    for (int slot : plan.slots.at(idx)) {
+                        node_waves.at(slot) = wave;
+                    }
                 }
             }
+            planVals(node_waves);
+        } else {
+            restoreVals();
+        }
+        for (int wave = 0; wave < wave_count; wave++) {
+            int begin = plan.wave_begins.at(wave);
+            int end = wave + 1 < wave_count ? plan.wave_begins.at(wave + 1) :
+                exec_count;
+            for (int idx = begin; idx < end; idx++) {
+                PExecute e = plan.execs.at(idx);
+                const vector<int> &slots = plan.slots.at(idx);
+                int batch_size = slots.size();
+                e->batch.resize(batch_size);
+                for (int idy = 0; idy < batch_size; idy++) {
+                    PNode p = nodes.at(computed_count + slots.at(idy));
+                    p->degree = 0;
+                    e->batch.at(idy) = p;
+                }
+                countBatch(e->batch);
+            }
+            countWave(plan.execs.data() + begin, end - begin);
+            wave_begins.push_back(execs.size());
+            execs.insert(execs.end(), plan.execs.begin() + begin,
+                    plan.execs.begin() + end);
+            forwardWave(plan.execs.data() + begin, end - begin);
+        }
+        computed_count = nodes.size();
+    }
+
+  public:
+
+#if USE_GPU
+    void computeNodeInfo(const vector<vector<PNode> > &batches,
+            std::vector<std::vector<NodeInfo>> &graph_node_info) const {
+        if (!graph_node_info.empty()) {
             abort();
         }
+
+        for (const vector<PNode> &batch : batches) {
+            std::vector<NodeInfo> node_info_vec;
+            for (PNode p : batch) {
+                NodeInfo info;
+                p->toNodeInfo(info);
+                node_info_vec.push_back(info);
+            }
+            graph_node_info.push_back(node_info_vec);
+        }
     }
 #endif
 };
 
 
+// nodes added to graph on this thread while the scope is alive go to its
+// staging list slot instead, so that threads can build different instances
+// at once. Builders must not share input nodes across threads, and the
+// alphabets they look up must be fixed.
+class GraphStagingScope {
+public:
+    GraphStagingScope(Graph &graph, int slot) {
+        previous = Graph::ActiveStaging();
+        Graph::ActiveStaging().graph = &graph;
+        Graph::ActiveStaging().nodes = graph.stagingList(slot);
+    }
+
+    ~GraphStagingScope() {
+        Graph::ActiveStaging() = previous;
+    }
+
+private:
+    Graph::StagingTarget previous;
+};
+
 // one very useful function to collect pointers of derived nodes
 template<typename DerivedNode>
 inline vector<PNode> getPNodes(vector<DerivedNode>& inputs, int size) {
@@ -17,12 +17,20 @@
 #include "PMultiOP.h"
 #include "PAddOP.h"
 #include "BucketOP.h"
+#include "LSTMCellOP.h"
 
 struct LSTM1Params {
     BiParams input;
     BiParams output;
     BiParams forget;
     BiParams cell;
+#if !USE_GPU
+    // the gate params are views of these, gate after gate in the order
+    // input, output, forget, cell, see stack()
+    Tensor2D hidden_w, hidden_w_grad;
+    Tensor2D input_w, input_w_grad;
+    Tensor2D bias, bias_grad;
+#endif
 
     LSTM1Params() {
     }
@@ -39,7 +47,35 @@ struct LSTM1Params {
         output.initial(nOSize, nOSize, nISize, true);
         forget.initial(nOSize, nOSize, nISize, true);
         cell.initial(nOSize, nOSize, nISize, true);
+        stack();
+    }
 
+#if !USE_GPU
+    // whether every kind of gate param is the rows of one matrix
+    inline bool stacked() {
+        return paramsContiguous({&input.W1, &output.W1, &forget.W1, &cell.W1}) &&
+            paramsContiguous({&input.W2, &output.W2, &forget.W2, &cell.W2}) &&
+            input.bUseB && output.bUseB && forget.bUseB && cell.bUseB &&
+            paramsContiguous({&input.b, &output.b, &forget.b, &cell.b});
+    }
+#endif
+
+    // moves the gate params into stacked storage, so that LSTMCellExecute
+    // computes all gates with one product, call it again after loading
+    inline void stack() {
+#if !USE_GPU
+        if (stacked()) {
+            return;
+        }
+        stackParams({&input.W1, &output.W1, &forget.W1, &cell.W1}, hidden_w,
+                hidden_w_grad);
+        stackParams({&input.W2, &output.W2, &forget.W2, &cell.W2}, input_w,
+                input_w_grad);
+        if (input.bUseB && output.bUseB && forget.bUseB && cell.bUseB) {
+            stackParams({&input.b, &output.b, &forget.b, &cell.b}, bias,
+                    bias_grad);
+        }
+#endif
     }
 
     inline int inDim() {
@@ -62,10 +98,249 @@ struct LSTM1Params {
         output.load(is);
         forget.load(is);
         cell.load(is);
+        stack();
     }
 
 };
 
+#if !USE_GPU
+// one step of LSTM1, the gate inputs are products of the input and the
+// previous hidden state
+class LSTMCellNode : public LSTMCellBase {
+  public:
+    PNode in;
+    LSTM1Params *param;
+
+  public:
+    LSTMCellNode() : LSTMCellBase() {
+        in = NULL;
+        param = NULL;
+        node_type = "lstm-cell";
+    }
+
+    inline void setParam(LSTM1Params *paramInit) {
+        param = paramInit;
+    }
+
+    const void *paramKey() const override {
+        return param;
+    }
+
+    long long flops() const override {
+        return 8LL * dim * (param->inDim() + dim) + 10LL * dim;
+    }
+
+    inline void clearValue() {
+        LSTMCellBase::clearValue();
+        in = NULL;
+    }
+
+  public:
+    void forward(Graph *cg, PNode x, LSTMCellNode *previous) {
+        in = x;
+        prev = previous;
+        degree = 0;
+        in->addParent(this);
+        if (prev != NULL) {
+            prev->addParent(this);
+        }
+        cg->addNode(this);
+    }
+
+    void computePre(dtype *pre) override {
+        BiParams *gates[4] = {&param->input, &param->output, &param->forget,
+            &param->cell};
+        for (int i = 0; i < 4; ++i) {
+            Mat out(pre + i * dim, dim, 1);
+            out.noalias() = gates[i]->W2.val.mat() * in->val.mat();
+            if (prev != NULL) {
+                out.noalias() += gates[i]->W1.val.mat() * prev->val.mat();
+            }
+            if (gates[i]->bUseB) {
+                out += gates[i]->b.val.mat();
+            }
+        }
+    }
+
+  public:
+    inline PExecute generate(bool bTrain, dtype cur_drop_factor);
+
+    bool typeEqual(PNode other) override {
+        bool result = Node::typeEqual(other);
+        if (!result) return false;
+        return param == static_cast<LSTMCellNode*>(other)->param;
+    }
+
+    size_t typeHashCode() const override {
+        return Node::typeHashCode() ^ ::typeHashCode(param);
+    }
+};
+
+// rows of x, h and pre are the cells of the batch, the gate inputs of all
+// cells are two products with the stacked gate params. x and h are gathered
+// again in backward, so that checkpointed cells free the buffers in between.
+class LSTMCellExecute : public Execute {
+  public:
+    Tensor2D x, h, pre, lx, lh, lpre, lcell;
+    int inDim, outDim;
+    LSTM1Params *param;
+
+  private:
+    struct GateSpan {
+        BiParams *gate;
+        int offset;
+        int rows;
+    };
+
+    // one span over all gates when the params are stacked, else one per gate
+    vector<GateSpan> spans() {
+        vector<GateSpan> result;
+        if (param->stacked()) {
+            result.push_back({&param->input, 0, 4 * outDim});
+        } else {
+            BiParams *gates[4] = {&param->input, &param->output,
+                &param->forget, &param->cell};
+            for (int i = 0; i < 4; ++i) {
+                result.push_back({gates[i], i * outDim, outDim});
+            }
+        }
+        return result;
+    }
+
+    bool checkpointed() {
+        for (PNode node : batch) {
+            if (static_cast<LSTMCellNode*>(node)->checkpoint != NULL) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void gather() {
+        int count = batch.size();
+        x.init(count, inDim);
+        h.init(count, outDim);
+        forEachNode([this](int idx) {
+            LSTMCellNode *ptr = static_cast<LSTMCellNode*>(batch[idx]);
+            memcpy(x[idx], ptr->in->val.v, inDim * sizeof(dtype));
+            if (ptr->prev != NULL) {
+                memcpy(h[idx], ptr->prev->val.v, outDim * sizeof(dtype));
+            }
+        });
+    }
+
+  public:
+    void forward() {
+        int count = batch.size();
+        gather();
+        pre.init(count, 4 * outDim);
+        vector<GateSpan> gate_spans = spans();
+
+        forEachNode([&](int idx) {
+            for (const GateSpan &span : gate_spans) {
+                if (span.gate->bUseB) {
+                    memcpy(pre[idx] + span.offset, span.gate->b.val.v,
+                            span.rows * sizeof(dtype));
+                }
+            }
+        });
+
+        Mat pre_mat = pre.mat();
+        for (const GateSpan &span : gate_spans) {
+            Mat wx(span.gate->W2.val.v, span.rows, inDim);
+            Mat wh(span.gate->W1.val.v, span.rows, outDim);
+            pre_mat.middleCols(span.offset, span.rows).noalias() +=
+                x.mat() * wx.transpose();
+            pre_mat.middleCols(span.offset, span.rows).noalias() +=
+                h.mat() * wh.transpose();
+        }
+
+        forEachNode([this](int idx) {
+            LSTMCellNode *ptr = static_cast<LSTMCellNode*>(batch[idx]);
+            ptr->activate(pre[idx]);
+            ptr->forward_drop(bTrain, drop_factor);
+        });
+
+        if (checkpointed()) {
+            x.release();
+            h.release();
+            pre.release();
+        }
+    }
+
+    void backward() {
+        int count = batch.size();
+        gather();
+        lpre.init(count, 4 * outDim);
+        lcell.init(count, outDim);
+        lx.init(count, inDim);
+        lh.init(count, outDim);
+
+        forEachNode([this](int idx) {
+            LSTMCellNode *ptr = static_cast<LSTMCellNode*>(batch[idx]);
+            ptr->backward_drop();
+            ptr->derive(lpre[idx], lcell[idx]);
+        });
+
+        Mat lpre_mat = lpre.mat();
+        for (const GateSpan &span : spans()) {
+            auto lp = lpre_mat.middleCols(span.offset, span.rows);
+            Mat wx(span.gate->W2.val.v, span.rows, inDim);
+            Mat wh(span.gate->W1.val.v, span.rows, outDim);
+            Mat wx_grad(span.gate->W2.grad.v, span.rows, inDim);
+            Mat wh_grad(span.gate->W1.grad.v, span.rows, outDim);
+            wx_grad.noalias() += lp.transpose() * x.mat();
+            wh_grad.noalias() += lp.transpose() * h.mat();
+            if (span.gate->bUseB) {
+                Mat b_grad(span.gate->b.grad.v, span.rows, 1);
+                b_grad.noalias() += lp.colwise().sum().transpose();
+            }
+            lx.mat().noalias() += lp * wx;
+            lh.mat().noalias() += lp * wh;
+        }
+
+        forEachNodeExclusively([this](int idx, vector<const void*> &keys) {
+            LSTMCellNode *ptr = static_cast<LSTMCellNode*>(batch[idx]);
+            keys.push_back(ptr->in);
+            if (ptr->prev != NULL) {
+                keys.push_back(ptr->prev);
+            }
+        }, [this](int idx) {
+            LSTMCellNode *ptr = static_cast<LSTMCellNode*>(batch[idx]);
+            for (int idy = 0; idy < inDim; idy++) {
+                ptr->in->loss[idy] += lx[idx][idy];
+            }
+            if (ptr->prev != NULL) {
+                for (int idy = 0; idy < outDim; idy++) {
+                    ptr->prev->loss[idy] += lh[idx][idy];
+                    ptr->prev->cell_loss[idy] += lcell[idx][idy];
+                }
+            }
+        });
+
+        if (checkpointed()) {
+            x.release();
+            h.release();
+            lx.release();
+            lh.release();
+            lpre.release();
+            lcell.release();
+        }
+    }
+};
+
+inline PExecute LSTMCellNode::generate(bool bTrain, dtype cur_drop_factor) {
+    LSTMCellExecute* exec = new LSTMCellExecute();
+    exec->batch.push_back(this);
+    exec->bTrain = bTrain;
+    exec->drop_factor = cur_drop_factor;
+    exec->inDim = param->inDim();
+    exec->outDim = param->outDim();
+    exec->param = param;
+    return exec;
+}
+#endif
+
 // standard LSTM1 using tanh as activation function
 // other conditions are not implemented unless they are clear
 class LSTM1Builder {
@@ -74,6 +349,7 @@ class LSTM1Builder {
     int _inDim;
     int _outDim;
 
+#if USE_GPU
     vector<BiNode> _inputgates;
     vector<BiNode> _forgetgates;
     vector<BiNode> _halfcells;
@@ -87,6 +363,11 @@ class LSTM1Builder {
     vector<PMultiNode> _hiddens;  // intermediate result without dropout
 
     BucketNode _bucket;
+#else
+    vector<LSTMCellNode> _hiddens; // one fused node per step
+    LSTMCheckpoint _checkpoint;
+    int _segment; // steps per checkpoint segment, 0 for no checkpoints
+#endif
 
     LSTM1Params* _param;
 
@@ -106,6 +387,8 @@ class LSTM1Builder {
         _param = paramInit;
         _inDim = _param->input.W2.inDim();
         _outDim = _param->input.W2.outDim();
+        _left2right = left2right;
+#if USE_GPU
         int maxsize = _inputgates.size();
         for (int idx = 0; idx < maxsize; idx++) {
             _inputgates[idx].setParam(&_param->input);
@@ -117,7 +400,6 @@ class LSTM1Builder {
             _outputgates[idx].setFunctions(&fsigmoid, &dsigmoid);
             _halfcells[idx].setFunctions(&ftanh, &dtanh);
         }
-        _left2right = left2right;
 
         for (int idx = 0; idx < maxsize; idx++) {
             _inputgates[idx].init(_outDim, -1);
@@ -132,10 +414,31 @@ class LSTM1Builder {
         }
 
         _bucket.init(_outDim, -1);
+#else
+        if (_segment > 0) {
+            _checkpoint.init(_segment, _hiddens.size(), _outDim);
+        }
+        for (LSTMCellNode &hidden : _hiddens) {
+            hidden.setParam(_param);
+            hidden.checkpoint = _segment > 0 ? &_checkpoint : NULL;
+            hidden.init(_outDim, dropout);
+        }
+#endif
+    }
 
+    // call it before init(): the steps keep their gates and cells in buffers
+    // of one segment and only the last cell of every segment, backward
+    // recomputes a segment once, so a segment of about the square root of
+    // the sequence length trades one more forward pass of the recurrence for
+    // memory. Ignored on gpu.
+    inline void setCheckpointSegment(int segment) {
+#if !USE_GPU
+        _segment = segment;
+#endif
     }
 
     inline void resize(int maxsize) {
+#if USE_GPU
         _inputgates.resize(maxsize);
         _forgetgates.resize(maxsize);
         _halfcells.resize(maxsize);
@@ -144,6 +447,7 @@ class LSTM1Builder {
         _cells.resize(maxsize);
         _outputgates.resize(maxsize);
         _halfhiddens.resize(maxsize);
+#endif
         _hiddens.resize(maxsize);
     }
 
@@ -152,7 +456,30 @@ class LSTM1Builder {
         return _hiddens.empty();
     }
 
+    // the members differ between cpu and gpu builds, these do not
+
+    // the hidden state of step idx, with dropout
+    inline PNode hidden(int idx) {
+        return &_hiddens[idx];
+    }
+
+    // the hidden states of the last forward()
+    inline vector<PNode> hiddens() {
+        return getPNodes(_hiddens, _nSize);
+    }
+
+    // the cell state of step idx, with checkpoints only valid for the last
+    // step of a segment
+    inline const Tensor1D &cell(int idx) {
+#if USE_GPU
+        return _cells[idx].val;
+#else
+        return _hiddens[idx].cell;
+#endif
+    }
+
     inline void clear() {
+#if USE_GPU
         _inputgates.clear();
         _forgetgates.clear();
         _halfcells.clear();
@@ -161,6 +488,7 @@ class LSTM1Builder {
         _cells.clear();
         _outputgates.clear();
         _halfhiddens.clear();
+#endif
         _hiddens.clear();
 
         _left2right = true;
@@ -168,6 +496,9 @@ class LSTM1Builder {
         _nSize = 0;
         _inDim = 0;
         _outDim = 0;
+#if !USE_GPU
+        _segment = 0;
+#endif
     }
 
   public:
@@ -182,6 +513,9 @@ class LSTM1Builder {
             return;
         }
 
+#if !USE_GPU
+        _checkpoint.begin();
+#endif
         if (_left2right) {
             left2right_forward(cg, x);
         } else {
@@ -191,6 +525,14 @@ class LSTM1Builder {
 
   protected:
     inline void left2right_forward(Graph *cg, const vector<PNode>& x) {
+#if !USE_GPU
+        for (int idx = 0; idx < _nSize; idx++) {
+            if (_segment > 0) {
+                _checkpoint.add(&_hiddens[idx]);
+            }
+            _hiddens[idx].forward(cg, x[idx], idx == 0 ? NULL : &_hiddens[idx - 1]);
+        }
+#else
         for (int idx = 0; idx < _nSize; idx++) {
             if (idx == 0) {
                 _bucket.forward(cg, 0);
@@ -229,9 +571,19 @@ class LSTM1Builder {
                 _hiddens[idx].forward(cg, &_halfhiddens[idx], &_outputgates[idx]);
             }
         }
+#endif
     }
 
     inline void right2left_forward(Graph *cg, const vector<PNode>& x) {
+#if !USE_GPU
+        for (int idx = _nSize - 1; idx >= 0; idx--) {
+            if (_segment > 0) {
+                _checkpoint.add(&_hiddens[idx]);
+            }
+            _hiddens[idx].forward(cg, x[idx],
+                    idx == _nSize - 1 ? NULL : &_hiddens[idx + 1]);
+        }
+#else
         for (int idx = _nSize - 1; idx >= 0; idx--) {
             if (idx == _nSize - 1) {
                 _bucket.forward(cg, 0);
@@ -270,6 +622,7 @@ class LSTM1Builder {
             }
 
         }
+#endif
     }
 };
 
@@ -282,6 +635,7 @@ class IncLSTM1Builder {
 
     IncLSTM1Builder* _pPrev;
 
+#if USE_GPU
     BiNode _inputgate;
     BiNode _forgetgate;
     BiNode _halfcell;
@@ -298,6 +652,9 @@ class IncLSTM1Builder {
     PMultiNode _hidden;  // intermediate result without dropout
 
     BucketNode _bucket;
+#else
+    LSTMCellNode _hidden; // the fused step
+#endif
 
     LSTM1Params* _param;
 
@@ -318,12 +675,28 @@ class IncLSTM1Builder {
         _pPrev = NULL;
     }
 
+    // the members differ between cpu and gpu builds, these do not
+
+    // the hidden state, with dropout
+    inline PNode hidden() {
+        return &_hidden;
+    }
+
+    inline const Tensor1D &cell() {
+#if USE_GPU
+        return _cell.val;
+#else
+        return _hidden.cell;
+#endif
+    }
+
   public:
     inline void init(LSTM1Params* paramInit, dtype dropout) {
         _param = paramInit;
         _inDim = _param->input.W2.inDim();
         _outDim = _param->input.W2.outDim();
 
+#if USE_GPU
         _inputgate.setParam(&_param->input);
         _forgetgate.setParam(&_param->forget);
         _outputgate.setParam(&_param->output);
@@ -344,11 +717,19 @@ class IncLSTM1Builder {
         _hidden.init(_outDim, dropout);
 
         _bucket.init(_outDim, -1);
+#else
+        _hidden.setParam(_param);
+        _hidden.init(_outDim, dropout);
+#endif
     }
 
 
   public:
     inline void forward(Graph *cg, PNode x, IncLSTM1Builder* prev = NULL) {
+#if !USE_GPU
+        _hidden.forward(cg, x, prev == NULL ? NULL : &prev->_hidden);
+        _nSize = prev == NULL ? 1 : prev->_nSize + 1;
+#else
         if (prev == NULL) {
             _bucket.forward(cg, 0);
 
@@ -388,6 +769,7 @@ class IncLSTM1Builder {
 
             _nSize = prev->_nSize + 1;
         }
+#endif
 
         _pPrev = prev;
     }
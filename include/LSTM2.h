@@ -17,6 +17,8 @@
 #include "PMultiOP.h"
 #include "PAddOP.h"
 #include "BucketOP.h"
+#include "UniOP.h"
+#include "LSTMCellOP.h"
 
 struct LSTM2Params {
     /*   BiParams input;
@@ -32,8 +34,12 @@ struct LSTM2Params {
     UniParams forget_input;
     UniParams cell_hidden;
     UniParams cell_input;
-
-
+#if !USE_GPU
+    // the gate weights are views of these, gate after gate in the order
+    // input, output, forget, cell, see stack()
+    Tensor2D hidden_w, hidden_w_grad;
+    Tensor2D input_w, input_w_grad;
+#endif
 
     LSTM2Params() {
     }
@@ -49,15 +55,52 @@ struct LSTM2Params {
         cell_input.exportAdaParams(ada);
     }
 
+    // both halves of every gate have a bias, as the gpu graph adds them.
+    // The cpu steps add the two biases of a gate with its input half, see
+    // LSTM2InputExecute.
     inline void initial(int nOSize, int nISize) {
-        input_hidden.initial(nOSize, nOSize, nISize);
-        input_input.initial(nOSize, nOSize, nISize);
-        output_hidden.initial(nOSize, nOSize, nISize);
-        output_input.initial(nOSize, nOSize, nISize);
-        forget_hidden.initial(nOSize, nOSize, nISize);
-        forget_input.initial(nOSize, nOSize, nISize);
-        cell_hidden.initial(nOSize, nOSize, nISize);
-        cell_input.initial(nOSize, nOSize, nISize);
+        input_hidden.initial(nOSize, nOSize);
+        input_input.initial(nOSize, nISize);
+        output_hidden.initial(nOSize, nOSize);
+        output_input.initial(nOSize, nISize);
+        forget_hidden.initial(nOSize, nOSize);
+        forget_input.initial(nOSize, nISize);
+        cell_hidden.initial(nOSize, nOSize);
+        cell_input.initial(nOSize, nISize);
+        stack();
+    }
+
+#if !USE_GPU
+    inline vector<Param*> hiddenWeights() {
+        return {&input_hidden.W, &output_hidden.W, &forget_hidden.W,
+            &cell_hidden.W};
+    }
+
+    inline vector<Param*> inputWeights() {
+        return {&input_input.W, &output_input.W, &forget_input.W,
+            &cell_input.W};
+    }
+
+    // the input and the hidden half of every gate, in the gate order of
+    // stack()
+    inline vector<UniParams*> gateHalves() {
+        return {&input_input, &input_hidden, &output_input, &output_hidden,
+            &forget_input, &forget_hidden, &cell_input, &cell_hidden};
+    }
+#endif
+
+    // moves the gate weights into stacked storage, so that the input and
+    // the hidden halves of all gates are one product each, call it again
+    // after loading
+    inline void stack() {
+#if !USE_GPU
+        if (!paramsContiguous(hiddenWeights())) {
+            stackParams(hiddenWeights(), hidden_w, hidden_w_grad);
+        }
+        if (!paramsContiguous(inputWeights())) {
+            stackParams(inputWeights(), input_w, input_w_grad);
+        }
+#endif
     }
 
     inline int inDim() {
@@ -89,10 +132,366 @@ struct LSTM2Params {
         forget_input.load(is);
         cell_hidden.load(is);
         cell_input.load(is);
+        stack();
+    }
+
+};
+
+#if !USE_GPU
+struct LSTM2GateSpan {
+    Param *w;
+    int offset;
+    int rows;
+};
+
+// one span over the four gate weights when they are stacked, else one per
+// gate
+inline vector<LSTM2GateSpan> lstm2GateSpans(const vector<Param*> &weights) {
+    vector<LSTM2GateSpan> spans;
+    int rows = weights.at(0)->val.row;
+    if (paramsContiguous(weights)) {
+        spans.push_back({weights.at(0), 0, 4 * rows});
+    } else {
+        for (int i = 0; i < 4; ++i) {
+            spans.push_back({weights.at(i), i * rows, rows});
+        }
+    }
+    return spans;
+}
+
+// the input halves of the four gates of one step. They do not depend on
+// the recurrence, so the steps of all sentences whose inputs are ready are
+// one product, and only the hidden halves stay on the recurrent path. The
+// biases of both halves are added here.
+class LSTM2InputNode : public Node {
+  public:
+    PNode in;
+    LSTM2Params *param;
+
+  public:
+    LSTM2InputNode() : Node() {
+        in = NULL;
+        param = NULL;
+        node_type = "lstm2-input";
+    }
+
+    inline void setParam(LSTM2Params *paramInit) {
+        param = paramInit;
+    }
+
+    const void *paramKey() const override {
+        return param;
+    }
+
+    long long flops() const override {
+        return 2LL * dim * param->inDim();
+    }
+
+    inline void clearValue() {
+        Node::clearValue();
+        in = NULL;
+    }
+
+  public:
+    void forward(Graph *cg, PNode x) {
+        in = x;
+        degree = 0;
+        in->addParent(this);
+        cg->addNode(this);
+    }
+
+    // computed in batches, see LSTM2InputExecute
+    inline void compute() {
+    }
+
+    inline void backward() {
+    }
+
+  public:
+    inline PExecute generate(bool bTrain, dtype cur_drop_factor);
+
+    bool typeEqual(PNode other) override {
+        bool result = Node::typeEqual(other);
+        if (!result) return false;
+        return param == static_cast<LSTM2InputNode*>(other)->param;
+    }
+
+    size_t typeHashCode() const override {
+        return Node::typeHashCode() ^ ::typeHashCode(param);
+    }
+};
+
+class LSTM2InputExecute : public Execute {
+  public:
+    Tensor2D x, y, lx, ly;
+    int inDim, outDim;
+    LSTM2Params *param;
+
+  public:
+    void forward() {
+        int count = batch.size();
+        x.init(count, inDim);
+        y.init(count, 4 * outDim);
+        forEachNode([this](int idx) {
+            LSTM2InputNode *ptr = static_cast<LSTM2InputNode*>(batch[idx]);
+            memcpy(x[idx], ptr->in->val.v, inDim * sizeof(dtype));
+        });
+
+        Mat y_mat = y.mat();
+        for (const LSTM2GateSpan &span : lstm2GateSpans(param->inputWeights())) {
+            Mat w(span.w->val.v, span.rows, inDim);
+            y_mat.middleCols(span.offset, span.rows).noalias() =
+                x.mat() * w.transpose();
+        }
+        vector<UniParams*> halves = param->gateHalves();
+        for (int i = 0; i < 8; ++i) {
+            if (halves.at(i)->bUseB) {
+                y_mat.middleCols(i / 2 * outDim, outDim).rowwise() +=
+                    halves.at(i)->b.val.mat().col(0).transpose();
+            }
+        }
+
+        forEachNode([this](int idx) {
+            LSTM2InputNode *ptr = static_cast<LSTM2InputNode*>(batch[idx]);
+            memcpy(ptr->val.v, y[idx], 4 * outDim * sizeof(dtype));
+            ptr->forward_drop(bTrain, drop_factor);
+        });
+    }
+
+    void backward() {
+        int count = batch.size();
+        ly.init(count, 4 * outDim);
+        lx.init(count, inDim);
+        forEachNode([this](int idx) {
+            LSTM2InputNode *ptr = static_cast<LSTM2InputNode*>(batch[idx]);
+            ptr->backward_drop();
+            memcpy(ly[idx], ptr->loss.v, 4 * outDim * sizeof(dtype));
+        });
+
+        Mat ly_mat = ly.mat();
+        for (const LSTM2GateSpan &span : lstm2GateSpans(param->inputWeights())) {
+            auto l = ly_mat.middleCols(span.offset, span.rows);
+            Mat w(span.w->val.v, span.rows, inDim);
+            Mat w_grad(span.w->grad.v, span.rows, inDim);
+            w_grad.noalias() += l.transpose() * x.mat();
+            lx.mat().noalias() += l * w;
+        }
+        vector<UniParams*> halves = param->gateHalves();
+        for (int i = 0; i < 8; ++i) {
+            if (halves.at(i)->bUseB) {
+                halves.at(i)->b.grad.mat().col(0) += ly_mat.middleCols(
+                        i / 2 * outDim, outDim).colwise().sum().transpose();
+            }
+        }
+
+        forEachNodeExclusively([this](int idx, vector<const void*> &keys) {
+            keys.push_back(static_cast<LSTM2InputNode*>(batch[idx])->in);
+        }, [this](int idx) {
+            LSTM2InputNode *ptr = static_cast<LSTM2InputNode*>(batch[idx]);
+            for (int idy = 0; idy < inDim; idy++) {
+                ptr->in->loss[idy] += lx[idx][idy];
+            }
+        });
+    }
+};
+
+inline PExecute LSTM2InputNode::generate(bool bTrain, dtype cur_drop_factor) {
+    LSTM2InputExecute* exec = new LSTM2InputExecute();
+    exec->batch.push_back(this);
+    exec->bTrain = bTrain;
+    exec->drop_factor = cur_drop_factor;
+    exec->inDim = param->inDim();
+    exec->outDim = param->outDim();
+    exec->param = param;
+    return exec;
+}
+
+// one step of LSTM2, the gate inputs are the precomputed input halves plus
+// the product of the previous hidden state
+class LSTM2CellNode : public LSTMCellBase {
+  public:
+    LSTM2InputNode *in;
+    LSTM2Params *param;
+
+  public:
+    LSTM2CellNode() : LSTMCellBase() {
+        in = NULL;
+        param = NULL;
+        node_type = "lstm2-cell";
+    }
+
+    inline void setParam(LSTM2Params *paramInit) {
+        param = paramInit;
+    }
+
+    const void *paramKey() const override {
+        return param;
+    }
+
+    long long flops() const override {
+        return 8LL * dim * dim + 10LL * dim;
+    }
+
+    inline void clearValue() {
+        LSTMCellBase::clearValue();
+        in = NULL;
+    }
+
+  public:
+    void forward(Graph *cg, LSTM2InputNode *x, LSTM2CellNode *previous) {
+        in = x;
+        prev = previous;
+        degree = 0;
+        in->addParent(this);
+        if (prev != NULL) {
+            prev->addParent(this);
+        }
+        cg->addNode(this);
+    }
+
+    void computePre(dtype *pre) override {
+        memcpy(pre, in->val.v, 4 * dim * sizeof(dtype));
+        if (prev == NULL) {
+            return;
+        }
+        vector<Param*> weights = param->hiddenWeights();
+        for (int i = 0; i < 4; ++i) {
+            Mat out(pre + i * dim, dim, 1);
+            out.noalias() += weights.at(i)->val.mat() * prev->val.mat();
+        }
+    }
+
+  public:
+    inline PExecute generate(bool bTrain, dtype cur_drop_factor);
+
+    bool typeEqual(PNode other) override {
+        bool result = Node::typeEqual(other);
+        if (!result) return false;
+        return param == static_cast<LSTM2CellNode*>(other)->param;
+    }
+
+    size_t typeHashCode() const override {
+        return Node::typeHashCode() ^ ::typeHashCode(param);
+    }
+};
+
+// h is gathered again in backward, so that checkpointed cells free the
+// buffers in between
+class LSTM2CellExecute : public Execute {
+  public:
+    Tensor2D h, pre, lh, lpre, lcell;
+    int outDim;
+    LSTM2Params *param;
+
+  private:
+    bool checkpointed() {
+        for (PNode node : batch) {
+            if (static_cast<LSTM2CellNode*>(node)->checkpoint != NULL) {
+                return true;
+            }
+        }
+        return false;
     }
 
+    void gather() {
+        h.init(batch.size(), outDim);
+        forEachNode([this](int idx) {
+            LSTM2CellNode *ptr = static_cast<LSTM2CellNode*>(batch[idx]);
+            if (ptr->prev != NULL) {
+                memcpy(h[idx], ptr->prev->val.v, outDim * sizeof(dtype));
+            }
+        });
+    }
+
+  public:
+    void forward() {
+        int count = batch.size();
+        gather();
+        pre.init(count, 4 * outDim);
+        forEachNode([this](int idx) {
+            LSTM2CellNode *ptr = static_cast<LSTM2CellNode*>(batch[idx]);
+            memcpy(pre[idx], ptr->in->val.v, 4 * outDim * sizeof(dtype));
+        });
+
+        Mat pre_mat = pre.mat();
+        for (const LSTM2GateSpan &span : lstm2GateSpans(param->hiddenWeights())) {
+            Mat w(span.w->val.v, span.rows, outDim);
+            pre_mat.middleCols(span.offset, span.rows).noalias() +=
+                h.mat() * w.transpose();
+        }
+
+        forEachNode([this](int idx) {
+            LSTM2CellNode *ptr = static_cast<LSTM2CellNode*>(batch[idx]);
+            ptr->activate(pre[idx]);
+            ptr->forward_drop(bTrain, drop_factor);
+        });
+
+        if (checkpointed()) {
+            h.release();
+            pre.release();
+        }
+    }
+
+    void backward() {
+        int count = batch.size();
+        gather();
+        lpre.init(count, 4 * outDim);
+        lcell.init(count, outDim);
+        lh.init(count, outDim);
+        forEachNode([this](int idx) {
+            LSTM2CellNode *ptr = static_cast<LSTM2CellNode*>(batch[idx]);
+            ptr->backward_drop();
+            ptr->derive(lpre[idx], lcell[idx]);
+        });
+
+        Mat lpre_mat = lpre.mat();
+        for (const LSTM2GateSpan &span : lstm2GateSpans(param->hiddenWeights())) {
+            auto lp = lpre_mat.middleCols(span.offset, span.rows);
+            Mat w(span.w->val.v, span.rows, outDim);
+            Mat w_grad(span.w->grad.v, span.rows, outDim);
+            w_grad.noalias() += lp.transpose() * h.mat();
+            lh.mat().noalias() += lp * w;
+        }
+
+        forEachNodeExclusively([this](int idx, vector<const void*> &keys) {
+            LSTM2CellNode *ptr = static_cast<LSTM2CellNode*>(batch[idx]);
+            if (ptr->prev != NULL) {
+                keys.push_back(ptr->prev);
+            }
+        }, [this](int idx) {
+            LSTM2CellNode *ptr = static_cast<LSTM2CellNode*>(batch[idx]);
+            int size = 4 * outDim;
+            for (int idy = 0; idy < size; idy++) {
+                ptr->in->loss[idy] += lpre[idx][idy];
+            }
+            if (ptr->prev != NULL) {
+                for (int idy = 0; idy < outDim; idy++) {
+                    ptr->prev->loss[idy] += lh[idx][idy];
+                    ptr->prev->cell_loss[idy] += lcell[idx][idy];
+                }
+            }
+        });
+
+        if (checkpointed()) {
+            h.release();
+            lh.release();
+            lpre.release();
+            lcell.release();
+        }
+    }
 };
 
+inline PExecute LSTM2CellNode::generate(bool bTrain, dtype cur_drop_factor) {
+    LSTM2CellExecute* exec = new LSTM2CellExecute();
+    exec->batch.push_back(this);
+    exec->bTrain = bTrain;
+    exec->drop_factor = cur_drop_factor;
+    exec->outDim = param->outDim();
+    exec->param = param;
+    return exec;
+}
+#endif
+
 // standard LSTM2 using tanh as activation function
 // other conditions are not implemented unless they are clear
 class LSTM2Builder {
@@ -101,6 +500,7 @@ public:
     int _inDim;
     int _outDim;
 
+#if USE_GPU
     vector<LinearNode> _inputgates_hidden;
     vector<LinearNode> _inputgates_input;
     vector<PAddNode> _inputgates_add;
@@ -130,6 +530,12 @@ public:
     vector<PMultiNode> _hiddens;  // intermediate result without dropout
 
     BucketNode _bucket;
+#else
+    vector<LSTM2InputNode> _inputs; // the input halves of the gates
+    vector<LSTM2CellNode> _hiddens; // one fused node per step
+    LSTMCheckpoint _checkpoint;
+    int _segment; // steps per checkpoint segment, 0 for no checkpoints
+#endif
 
     LSTM2Params* _param;
 
@@ -149,6 +555,8 @@ public:
         _param = paramInit;
         _inDim = _param->input_input.W.inDim();
         _outDim = _param->input_input.W.outDim();
+        _left2right = left2right;
+#if USE_GPU
         int maxsize = _inputgates_hidden.size();
 
         for (int idx = 0; idx < maxsize; idx++) {
@@ -162,7 +570,6 @@ public:
             _forgetgates_hidden.at(idx).setParam(&_param->forget_hidden);
             _halfcells_hidden.at(idx).setParam(&_param->cell_hidden);
         }
-        _left2right = left2right;
 
         for (int idx = 0; idx < maxsize; idx++) {
             _inputgates_hidden.at(idx).init(_outDim, -1);
@@ -192,10 +599,32 @@ public:
             _outputgates.at(idx).init(_outDim, -1);
         }
         _bucket.init(_outDim, -1);
+#else
+        int maxsize = _hiddens.size();
+        if (_segment > 0) {
+            _checkpoint.init(_segment, maxsize, _outDim);
+        }
+        for (int idx = 0; idx < maxsize; idx++) {
+            _inputs.at(idx).setParam(_param);
+            _inputs.at(idx).init(4 * _outDim, -1);
+            _hiddens.at(idx).setParam(_param);
+            _hiddens.at(idx).checkpoint = _segment > 0 ? &_checkpoint : NULL;
+            _hiddens.at(idx).init(_outDim, dropout);
+        }
+#endif
+    }
 
+    // call it before init(), see LSTM1Builder::setCheckpointSegment. The
+    // input halves of the gates are kept for every step, only the gates and
+    // cells are recomputed. Ignored on gpu.
+    inline void setCheckpointSegment(int segment) {
+#if !USE_GPU
+        _segment = segment;
+#endif
     }
 
     inline void resize(int maxsize) {
+#if USE_GPU
         _inputgates_hidden.resize(maxsize);
         _inputgates_input.resize(maxsize);
         _inputgates_add.resize(maxsize);
@@ -217,6 +646,9 @@ public:
         _forgetfilters.resize(maxsize);
         _cells.resize(maxsize);
         _halfhiddens.resize(maxsize);
+#else
+        _inputs.resize(maxsize);
+#endif
         _hiddens.resize(maxsize);
     }
 
@@ -225,7 +657,25 @@ public:
         return _hiddens.empty();
     }
 
+    // the members differ between cpu and gpu builds, these do not
+
+    // the hidden state of step idx, with dropout
+    inline PNode hidden(int idx) {
+        return &_hiddens[idx];
+    }
+
+    // the cell state of step idx, with checkpoints only valid for the last
+    // step of a segment
+    inline const Tensor1D &cell(int idx) {
+#if USE_GPU
+        return _cells[idx].val;
+#else
+        return _hiddens[idx].cell;
+#endif
+    }
+
     inline void clear() {
+#if USE_GPU
         _inputgates_hidden.clear();
         _inputgates_input.clear();
         _inputgates_add.clear();
@@ -247,6 +697,9 @@ public:
         _forgetfilters.clear();
         _cells.clear();
         _halfhiddens.clear();
+#else
+        _inputs.clear();
+#endif
         _hiddens.clear();
 
         _left2right = true;
@@ -254,6 +707,9 @@ public:
         _nSize = 0;
         _inDim = 0;
         _outDim = 0;
+#if !USE_GPU
+        _segment = 0;
+#endif
     }
 
 public:
@@ -268,6 +724,9 @@ public:
             return;
         }
 
+#if !USE_GPU
+        _checkpoint.begin();
+#endif
         if (_left2right) {
             left2right_forward(cg, x);
         }
@@ -278,6 +737,18 @@ public:
 
 protected:
     inline void left2right_forward(Graph *cg, const vector<PNode>& x) {
+#if !USE_GPU
+        for (int idx = 0; idx < _nSize; idx++) {
+            _inputs[idx].forward(cg, x[idx]);
+        }
+        for (int idx = 0; idx < _nSize; idx++) {
+            if (_segment > 0) {
+                _checkpoint.add(&_hiddens[idx]);
+            }
+            _hiddens[idx].forward(cg, &_inputs[idx],
+                    idx == 0 ? NULL : &_hiddens[idx - 1]);
+        }
+#else
         for (int idx = 0; idx < _nSize; idx++) {
             if (idx == 0) {
                 _bucket.forward(cg, 0);
@@ -366,9 +837,22 @@ protected:
                 _hiddens[idx].forward(cg, &_halfhiddens[idx], &_outputgates[idx]);
             }
         }
+#endif
     }
 
     inline void right2left_forward(Graph *cg, const vector<PNode>& x) {
+#if !USE_GPU
+        for (int idx = 0; idx < _nSize; idx++) {
+            _inputs[idx].forward(cg, x[idx]);
+        }
+        for (int idx = _nSize - 1; idx >= 0; idx--) {
+            if (_segment > 0) {
+                _checkpoint.add(&_hiddens[idx]);
+            }
+            _hiddens[idx].forward(cg, &_inputs[idx],
+                    idx == _nSize - 1 ? NULL : &_hiddens[idx + 1]);
+        }
+#else
         for (int idx = _nSize - 1; idx >= 0; idx--) {
             if (idx == _nSize - 1) {
                 _bucket.forward(cg, 0);
@@ -457,6 +941,7 @@ protected:
                 _hiddens[idx].forward(cg, &_halfhiddens[idx], &_outputgates[idx]);
             }
         }
+#endif
     }
 };
 
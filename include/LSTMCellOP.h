@@ -0,0 +1,178 @@
+#ifndef LSTMCellOP
+#define LSTMCellOP
+
+/*
+*  LSTMCellOP.h:
+*  the gates, cell and hidden state of one lstm step in one node, the
+*  executes of the lstm builders compute the gate inputs of a whole batch
+*  and call activate() and derive() for every step
+*  With an LSTMCheckpoint the gates and cells of a sequence only keep one
+*  segment of steps plus the last cell of every segment, backward recomputes
+*  the segment it reaches from the kept cell before it.
+*/
+
+#include "MyLib.h"
+#include "Node.h"
+
+#if !USE_GPU
+class LSTMCellBase;
+
+class LSTMCheckpoint {
+  public:
+    int segment_size;
+    int live_segment; // the segment the step buffers hold, -1 for none
+    vector<LSTMCellBase*> steps; // in the order they are computed
+    Tensor2D gates, cells, cell_tanhs; // one row per step of a segment
+    Tensor2D kept_cells; // the last cell of every segment
+    Tensor1D pre;
+
+  public:
+    LSTMCheckpoint() {
+        segment_size = 0;
+        live_segment = -1;
+    }
+
+    inline void init(int segment, int max_size, int dim) {
+        segment_size = segment;
+        gates.init(segment, 4 * dim);
+        cells.init(segment, dim);
+        cell_tanhs.init(segment, dim);
+        kept_cells.init((max_size + segment - 1) / segment, dim);
+        pre.init(4 * dim);
+        begin();
+    }
+
+    inline void begin() {
+        steps.clear();
+        live_segment = -1;
+    }
+
+    // makes the step buffers of node views of the segment buffers
+    inline void add(LSTMCellBase *node);
+
+    // recomputes the segment of step unless the buffers hold it
+    inline void materialize(int step);
+};
+
+// val is the hidden state and gets the dropout
+class LSTMCellBase : public Node {
+  public:
+    LSTMCellBase *prev; // NULL at the first step
+    Tensor1D gates; // activated input, output, forget and cell gates
+    Tensor1D cell, cell_tanh;
+    Tensor1D cell_loss;
+    LSTMCheckpoint *checkpoint; // set before init(), NULL for no checkpoints
+    int step; // position in the checkpoint
+
+  public:
+    LSTMCellBase() : Node() {
+        prev = NULL;
+        checkpoint = NULL;
+        step = 0;
+    }
+
+    inline void init(int ndim, dtype dropout) {
+        Node::init(ndim, dropout);
+        if (checkpoint == NULL) {
+            gates.init(4 * ndim);
+            cell.init(ndim);
+            cell_tanh.init(ndim);
+        }
+        if (!inference_only) {
+            cell_loss.init(ndim);
+        }
+    }
+
+    inline void clearValue() {
+        Node::clearValue();
+        cell_loss.zero();
+        prev = NULL;
+    }
+
+    // the gate inputs of this step, for recomputation
+    virtual void computePre(dtype *pre) = 0;
+
+    // pre are the gate inputs, in the order of gates
+    inline void activate(const dtype *pre) {
+        activateGates(pre);
+        for (int idx = 0; idx < dim; idx++) {
+            val[idx] = cell_tanh[idx] * gates[dim + idx];
+        }
+        if (checkpoint != NULL) {
+            checkpoint->live_segment = step / checkpoint->segment_size;
+        }
+    }
+
+    inline void activateGates(const dtype *pre) {
+        dtype *i = gates.v, *o = i + dim, *f = o + dim, *g = f + dim;
+        for (int idx = 0; idx < dim; idx++) {
+            i[idx] = fsigmoid(pre[idx]);
+            o[idx] = fsigmoid(pre[dim + idx]);
+            f[idx] = fsigmoid(pre[2 * dim + idx]);
+            g[idx] = ftanh(pre[3 * dim + idx]);
+            cell[idx] = i[idx] * g[idx];
+            if (prev != NULL) {
+                cell[idx] += f[idx] * prev->cell[idx];
+            }
+            cell_tanh[idx] = ftanh(cell[idx]);
+        }
+    }
+
+    // lpre gets the losses of the gate inputs, lprev_cell the loss of the
+    // previous cell
+    inline void derive(dtype *lpre, dtype *lprev_cell) {
+        if (checkpoint != NULL) {
+            checkpoint->materialize(step);
+        }
+        const dtype *i = gates.v, *o = i + dim, *f = o + dim, *g = f + dim;
+        for (int idx = 0; idx < dim; idx++) {
+            dtype lc = cell_loss[idx] + loss[idx] * o[idx] *
+                (1 - cell_tanh[idx] * cell_tanh[idx]);
+            lpre[idx] = lc * g[idx] * (1 - i[idx]) * i[idx];
+            lpre[dim + idx] = loss[idx] * cell_tanh[idx] * (1 - o[idx]) * o[idx];
+            lpre[2 * dim + idx] = prev == NULL ? 0 :
+                lc * prev->cell[idx] * (1 - f[idx]) * f[idx];
+            lpre[3 * dim + idx] = lc * i[idx] * (1 - g[idx] * g[idx]);
+            lprev_cell[idx] = lc * f[idx];
+        }
+    }
+
+    // cells are only computed in batches
+    inline void compute() {
+    }
+
+    inline void backward() {
+    }
+};
+
+inline void LSTMCheckpoint::add(LSTMCellBase *node) {
+    int step = steps.size();
+    int offset = step % segment_size;
+    int dim = cells.col;
+    node->step = step;
+    node->gates.attach(gates[offset], 4 * dim);
+    node->cell_tanh.attach(cell_tanhs[offset], dim);
+    if (offset == segment_size - 1) {
+        node->cell.attach(kept_cells[step / segment_size], dim);
+    } else {
+        node->cell.attach(cells[offset], dim);
+    }
+    steps.push_back(node);
+}
+
+inline void LSTMCheckpoint::materialize(int step) {
+    int segment = step / segment_size;
+    if (segment == live_segment) {
+        return;
+    }
+    int begin = segment * segment_size;
+    int end = std::min<int>(steps.size(), begin + segment_size);
+    for (int idx = begin; idx < end; idx++) {
+        steps.at(idx)->computePre(pre.v);
+        steps.at(idx)->activateGates(pre.v);
+    }
+    live_segment = segment;
+}
+#endif
+
+#endif
@@ -228,6 +228,10 @@ public:
         param = paramInit;
     }
 
+    const void *paramKey() const override {
+        return param;
+    }
+
     inline void clearValue() {
         Node::clearValue();
         xid = -1;
@@ -317,7 +321,7 @@ public:
                     for (int j = 0; j < dim; ++j) {
                         dtype v = drop_mask[j][i];
                         batch[i]->drop_mask[j] = v <= dynamicDropValue() ?
-                            0 : 1;
+                            0 : Dropout::Ins().KeepValue(dynamicDropValue());
                     }
                 }
             }
@@ -361,21 +365,28 @@ public:
 class LookupExecute :public Execute {
     public:
         inline void  forward() {
-            int count = batch.size();
-            //#pragma omp parallel for
-            for (int idx = 0; idx < count; idx++) {
+            forEachNode([this](int idx) {
                 batch[idx]->compute();
                 batch[idx]->forward_drop(bTrain, drop_factor);
-            }
+            });
         }
 
         inline void backward() {
-            int count = batch.size();
-            //#pragma omp parallel for
-            for (int idx = 0; idx < count; idx++) {
+            forEachNodeExclusively([this](int idx, vector<const void*> &keys) {
+                LookupNode *ptr = static_cast<LookupNode*>(batch[idx]);
+                if (ptr->xid >= 0) {
+                    keys.push_back(ptr->param->E.grad[ptr->xid]);
+                    // touched serially here, so parallel backwards never
+                    // append to touched_rows
+                    if (ptr->xid == ptr->param->nUNKId ||
+                            ptr->param->bFineTune) {
+                        ptr->param->E.touchRow(ptr->xid);
+                    }
+                }
+            }, [this](int idx) {
                 batch[idx]->backward_drop();
                 batch[idx]->backward();
-            }
+            });
         }
 };
 #endif
@@ -6,42 +6,278 @@
 #include "Eigen/Dense"
 #include <unsupported/Eigen/CXX11/Tensor>
 #include "MyLib.h"
+#include <atomic>
+#include <mutex>
+#include <vector>
 
 using namespace Eigen;
 
+// counts heap buffers taken by tensors and graphs, a warmed-up training step
+// should leave it unchanged
+class AllocationCounter {
+public:
+    static AllocationCounter &Ins() {
+        static AllocationCounter ins;
+        return ins;
+    }
+
+    void Add() {
+        ++count_;
+    }
+
+    long long Count() const {
+        return count_;
+    }
+
+    void Reset() {
+        count_ = 0;
+    }
+
+private:
+    AllocationCounter() = default;
+
+    std::atomic<long long> count_ = {0};
+};
+
+// hands out 64-byte aligned pieces of big slabs, which are all freed when
+// the arena is destroyed, so tensors taken from it must not outlive it
+class TensorArena {
+public:
+    static const int ALIGNMENT = 64;
+
+    explicit TensorArena(size_t slab_size = 1 << 20) {
+        slab_size_ = slab_size;
+        offset_ = slab_size;
+        current_ = NULL;
+    }
+
+    ~TensorArena() {
+        for (char *slab : slabs_) {
+            delete[] slab;
+        }
+    }
+
+    dtype *Allocate(int count) {
+        size_t size = (count * sizeof(dtype) + ALIGNMENT - 1) / ALIGNMENT *
+            ALIGNMENT;
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (offset_ + size > slab_size_) {
+            if (size > slab_size_) {
+                return (dtype*)newSlab(size);
+            }
+            current_ = newSlab(slab_size_);
+            offset_ = 0;
+        }
+        dtype *p = (dtype*)(current_ + offset_);
+        offset_ += size;
+        return p;
+    }
+
+    // the arena tensors of this thread use in init(), NULL means heap
+    static TensorArena *&Active() {
+        static thread_local TensorArena *active = NULL;
+        return active;
+    }
+
+private:
+    char *newSlab(size_t size) {
+        char *slab = new char[size + ALIGNMENT];
+        slabs_.push_back(slab);
+        AllocationCounter::Ins().Add();
+        size_t address = (size_t)slab;
+        return slab + (ALIGNMENT - address % ALIGNMENT) % ALIGNMENT;
+    }
+
+    TensorArena(const TensorArena &) = delete;
+    TensorArena &operator=(const TensorArena &) = delete;
+
+    std::vector<char*> slabs_;
+    std::mutex mutex_;
+    size_t slab_size_;
+    size_t offset_;
+    char *current_;
+};
+
+// tensors initialized on this thread while a scope is alive, e.g. when a
+// builder is resized, take their buffers from the arena
+class TensorArenaScope {
+public:
+    explicit TensorArenaScope(TensorArena &arena) {
+        previous_ = TensorArena::Active();
+        TensorArena::Active() = &arena;
+    }
+
+    ~TensorArenaScope() {
+        TensorArena::Active() = previous_;
+    }
+
+private:
+    TensorArena *previous_;
+};
+
+// heap buffers of tensors start at a cache line like arena buffers, so that
+// vectorized loops need no peeling, see Tensor2D::alignedVec()
+inline dtype *allocateAligned(int count) {
+    const int alignment = TensorArena::ALIGNMENT;
+    char *raw = new char[count * sizeof(dtype) + alignment + sizeof(char*)];
+    size_t address = (size_t)(raw + sizeof(char*));
+    char *aligned = raw + sizeof(char*) +
+        (alignment - address % alignment) % alignment;
+    ((char**)aligned)[-1] = raw;
+    return (dtype*)aligned;
+}
+
+inline void freeAligned(dtype *p) {
+    delete[] ((char**)p)[-1];
+}
+
+inline bool isAligned(const dtype *p) {
+    return (size_t)p % TensorArena::ALIGNMENT == 0;
+}
+
 namespace n3ldg_cpu {
 
 struct Tensor1D {
   private:
     size_t memsize;
+    int capacity;
+    bool view; // v is owned by someone else, see attach()
+    bool owned; // v is a heap buffer of this tensor
+    // the buffer put aside by borrow()
+    bool borrowed;
+    dtype *kept;
+    int kept_capacity;
+    bool kept_owned;
+    bool kept_view;
+
+    void freeKept() {
+        if (kept && kept_owned) {
+            freeAligned(kept);
+        }
+        kept = NULL;
+        borrowed = false;
+    }
+
   public:
     dtype *v;
     int dim;
 
     Tensor1D() {
         memsize = 0;
+        capacity = 0;
+        view = false;
+        owned = false;
+        borrowed = false;
+        kept = NULL;
+        kept_capacity = 0;
+        kept_owned = false;
+        kept_view = false;
         dim = 0;
         v = NULL;
     }
 
     ~Tensor1D() {
-        if (v) {
-            delete[] v;
+        if (v && owned) {
+            freeAligned(v);
         }
+        freeKept();
         v = NULL;
         memsize = 0;
+        capacity = 0;
         dim = 0;
     }
 
     //please call this function before using it really. must! must! must!
-    //only this function allocates memories
+    //only this function allocates memories, calling it again keeps the
+    //buffer when it is large enough
     inline void init(int ndim) {
         dim = ndim;
-        v = new dtype[dim];
         memsize = dim * sizeof(dtype);
+        if (borrowed) {
+            if (kept != NULL && !kept_view && dim <= kept_capacity) {
+                v = kept;
+                owned = kept_owned;
+                capacity = kept_capacity;
+                view = false;
+                kept = NULL;
+                borrowed = false;
+            } else {
+                freeKept();
+            }
+        }
+        if (v == NULL || view || dim > capacity) {
+            if (v && owned) {
+                freeAligned(v);
+            }
+            TensorArena *arena = TensorArena::Active();
+            if (arena != NULL) {
+                v = arena->Allocate(dim);
+                owned = false;
+            } else {
+                v = allocateAligned(dim);
+                owned = true;
+                AllocationCounter::Ins().Add();
+            }
+            capacity = dim;
+            view = false;
+        }
         zero();
     }
 
+    // frees the own buffer and uses p instead, the next init() allocates
+    // again
+    inline void attach(dtype *p, int ndim) {
+        if (v && owned) {
+            freeAligned(v);
+        }
+        freeKept();
+        owned = false;
+        v = p;
+        dim = ndim;
+        memsize = dim * sizeof(dtype);
+        capacity = 0;
+        view = true;
+    }
+
+    // like attach(), but the own buffer, or the attached one, is put aside,
+    // unborrow() returns to it and the next init() to an own one without
+    // allocating
+    inline void borrow(dtype *p, int ndim) {
+        if (!borrowed) {
+            kept = v;
+            kept_capacity = capacity;
+            kept_owned = owned;
+            kept_view = view;
+            borrowed = true;
+        }
+        owned = false;
+        v = p;
+        dim = ndim;
+        memsize = dim * sizeof(dtype);
+        capacity = 0;
+        view = true;
+    }
+
+    inline bool isView() const {
+        return view;
+    }
+
+    inline bool isBorrowed() const {
+        return borrowed;
+    }
+
+    inline void unborrow() {
+        if (!borrowed) {
+            return;
+        }
+        v = kept;
+        owned = kept_owned;
+        capacity = kept_capacity;
+        view = kept_view;
+        kept = NULL;
+        borrowed = false;
+    }
+
     inline void zero() {
         if(v)memset((void*)v, 0, memsize);;
     }
@@ -70,6 +306,16 @@ struct Tensor1D {
         return Vec(v, dim);
     }
 
+    // buffers of init() are aligned, views may not be
+    inline bool aligned() const {
+        return isAligned(v);
+    }
+
+    // only when aligned()
+    AlignedVec alignedVec() {
+        return AlignedVec(v, dim);
+    }
+
     inline dtype& operator[](const int i) {
         assert(i < dim);
         return v[i];  // no boundary check?
@@ -135,38 +381,95 @@ struct Tensor1D {
 struct Tensor2D {
   private:
     size_t memsize;
+    int capacity;
+    bool view; // v is owned by someone else, see attach()
+    bool owned; // v is a heap buffer of this tensor
   public:
     dtype *v;
     int col, row, size;
 
     Tensor2D() {
         memsize = 0;
+        capacity = 0;
+        view = false;
+        owned = false;
         col = row = 0;
         size = 0;
         v = NULL;
     }
 
     ~Tensor2D() {
-        if (v) {
-            delete[] v;
+        if (v && owned) {
+            freeAligned(v);
         }
         v = NULL;
         memsize = 0;
+        capacity = 0;
         col = row = 0;
         size = 0;
     }
 
     //please call this function before using it really. must! must! must!
-    //only this function allocates memories
+    //only this function allocates memories, calling it again keeps the
+    //buffer when it is large enough
     inline void init(int nrow, int ncol) {
         row = nrow;
         col = ncol;
         size = col * row;
-        v = new dtype[size];
         memsize = size * sizeof(dtype);
+        if (v == NULL || view || size > capacity) {
+            if (v && owned) {
+                freeAligned(v);
+            }
+            TensorArena *arena = TensorArena::Active();
+            if (arena != NULL) {
+                v = arena->Allocate(size);
+                owned = false;
+            } else {
+                v = allocateAligned(size);
+                owned = true;
+                AllocationCounter::Ins().Add();
+            }
+            capacity = size;
+            view = false;
+        }
         zero();
     }
 
+    // frees the own buffer and uses p instead, the next init() allocates
+    // again
+    inline void attach(dtype *p, int nrow, int ncol) {
+        if (v && owned) {
+            freeAligned(v);
+        }
+        owned = false;
+        v = p;
+        row = nrow;
+        col = ncol;
+        size = col * row;
+        memsize = size * sizeof(dtype);
+        capacity = 0;
+        view = true;
+    }
+
+    inline bool isView() const {
+        return view;
+    }
+
+    // frees the own buffer, the next init() allocates again
+    inline void release() {
+        if (v && owned) {
+            freeAligned(v);
+        }
+        v = NULL;
+        owned = false;
+        view = false;
+        memsize = 0;
+        capacity = 0;
+        col = row = 0;
+        size = 0;
+    }
+
     inline void zero() {
         if(v)memset((void*)v, 0, memsize);
     }
@@ -187,6 +490,16 @@ struct Tensor2D {
         return Vec(v, size);
     }
 
+    // buffers of init() are aligned, views may not be
+    inline bool aligned() const {
+        return isAligned(v);
+    }
+
+    // only when aligned()
+    AlignedVec alignedVec() {
+        return AlignedVec(v, size);
+    }
+
 
     //use it carefully, first col, then row, because rows are allocated successively
     inline dtype* operator[](const int irow) {
@@ -16,6 +16,7 @@
 #include "SparseParam.h"
 #include "APParam.h"
 #include "ModelUpdate.h"
+#include "DataParallel.h"
 #include "CheckGrad.h"
 #include "Pooling.h"
 #include "Concat.h"
@@ -16,6 +16,11 @@
 #include <functional>
 #include <string>
 #include "MyTensor.h"
+#include "Activation.h"
+#include "Dropout.h"
+#include "ThreadPool.h"
+#include <unordered_map>
+#include <map>
 #if USE_GPU
 #include "n3ldg_cuda.h"
 using n3ldg_cuda::Tensor1D;
@@ -181,6 +186,36 @@ int GraphToMemory(const std::vector<std::vector<NodeInfo>> &graph,
 
 #endif
 
+// nodes initialized while it is enabled own no loss or drop_mask buffers,
+// so they can only run in non-train graphs, set it before building a model
+// which is only used for prediction and reset it to build models to train
+class InferenceMode {
+public:
+    static InferenceMode &Ins() {
+        static InferenceMode ins;
+        return ins;
+    }
+
+    void SetEnabled(bool enabled) {
+#if USE_GPU
+        if (enabled) {
+            std::cout << "inference mode is not supported on gpu" << std::endl;
+            enabled = false;
+        }
+#endif
+        enabled_ = enabled;
+    }
+
+    bool Enabled() const {
+        return enabled_;
+    }
+
+private:
+    InferenceMode() = default;
+
+    bool enabled_ = false;
+};
+
 // one Node means a vector
 // the col should be 1, because we aimed for NLP only
 class Node {
@@ -192,6 +227,13 @@ class Node {
   public:
     int dim;
     int degree;
+    int node_index; // position in the graph, set by Graph::addNode
+    // Graph::planVals() gave the val slot to later nodes after the last
+    // consumer of its compute()
+    bool val_released;
+    // initialized in InferenceMode, so it owns no loss buffers and can not
+    // be trained
+    bool inference_only;
     string node_type;
 
   public:
@@ -202,6 +244,9 @@ class Node {
     Node() {
         dim = 0;
         degree = 0;
+        node_index = -1;
+        val_released = false;
+        inference_only = false;
         parents.clear();
         node_type = "interface";
         drop_value = -1;
@@ -212,8 +257,11 @@ class Node {
   public:
     virtual inline void clearValue() {
 #if !USE_GPU || TEST_CUDA
-        val = 0;
-        loss = 0;
+        val.zero();
+        loss.zero();
+#endif
+#if TEST_CUDA
+        // executes without a mask copy from the gpu keep every value
         if (drop_value > 0) drop_mask = 1;
 #endif
         degree = 0;
@@ -223,8 +271,11 @@ class Node {
     virtual inline void init(int ndim, dtype dropout) {
         dim = ndim;
         val.init(dim);
-        loss.init(dim);
-        drop_mask.init(dim);
+        inference_only = InferenceMode::Ins().Enabled();
+        if (!inference_only) {
+            loss.init(dim);
+            drop_mask.init(dim);
+        }
 #if USE_GPU
         n3ldg_cuda::Memset(val.value, dim, 0.0f);
         n3ldg_cuda::Memset(loss.value, dim, 0.0f);
@@ -238,27 +289,33 @@ class Node {
     }
 
     virtual void generate_dropmask(dtype drop_factor) {
-        int dropNum = (int)(dim * drop_value * drop_factor);
-        vector<int> tmp_masks(dim);
-        for (int idx = 0; idx < dim; idx++) {
-            tmp_masks[idx] = idx < dropNum ? 0 : 1;
-        }
-        random_shuffle(tmp_masks.begin(), tmp_masks.end());
-        for (int idx = 0; idx < dim; idx++) {
-            drop_mask[idx] = tmp_masks[idx];
+        Dropout &dropout = Dropout::Ins();
+        if (dropout.ExactCount()) {
+            dropout.ExactMask(drop_mask.v, dim,
+                    (int)(dim * drop_value * drop_factor));
+        } else {
+            dropout.Mask(drop_mask.v, dim, drop_value * drop_factor);
         }
     }
 
     void forward_drop(bool bTrain, dtype drop_factor) {
-        if (drop_value > 0) {
-            if (bTrain) {
 #if !TEST_CUDA
-                generate_dropmask(drop_factor);
+        if (drop_value > 0 && bTrain) {
+            generate_dropmask(drop_factor);
+        }
 #endif
-            } else {
-                drop_mask = 1 - drop_value * drop_factor;
+        apply_drop(bTrain, drop_factor);
+    }
+
+    // forward_drop() with drop_mask generated already, inverted masks are
+    // scaled in training already so inference leaves val as it is
+    void apply_drop(bool bTrain, dtype drop_factor) {
+        if (drop_value > 0) {
+            if (bTrain) {
+                val.vec() = val.vec() * drop_mask.vec();
+            } else if (!Dropout::Ins().Inverted()) {
+                val.vec() = val.vec() * (1 - drop_value * drop_factor);
             }
-            val.vec() = val.vec() * drop_mask.vec();
         }
         degree = -1;
     }
@@ -295,8 +352,26 @@ class Node {
             (std::hash<int>{}((int)(10000 * drop_value)) << 1);
     }
 
+    // the parameters backward() accumulates gradients into, nodes owning
+    // parameters must override it so that graphs never update one
+    // gradient from two threads
+    virtual const void *paramKey() const {
+        return NULL;
+    }
+
+    // rough floating point operations of compute(), for profiling
+    virtual long long flops() const {
+        return dim;
+    }
+
   public:
     virtual inline void addParent(Node* parent) {
+        if (val_released) {
+            std::cout << "addParent: the val of this " << node_type <<
+                " node was reused by the memory plan, its consumers must be"
+                " computed with it" << std::endl;
+            abort();
+        }
         if (degree >= 0) {
             parents.push_back(parent);
             parent->degree++;
@@ -325,6 +400,19 @@ void clearNodes(std::vector<Node*> &nodes, int dim) {
     n3ldg_cuda::BatchMemset(val_and_losses, val_and_losses.size(), dim,
             0.0f);
 }
+
+// nodes of any types, one memset launch per dim
+void clearNodes(std::vector<Node*> &nodes) {
+    std::map<int, std::vector<dtype*>> val_and_losses;
+    for (Node *n : nodes) {
+        std::vector<dtype*> &ptrs = val_and_losses[n->dim];
+        ptrs.push_back(n->val.value);
+        ptrs.push_back(n->loss.value);
+    }
+    for (auto &it : val_and_losses) {
+        n3ldg_cuda::BatchMemset(it.second, it.second.size(), it.first, 0.0f);
+    }
+}
 #endif
 
 class Execute {
@@ -332,6 +420,8 @@ public:
     bool bTrain;
     vector<PNode> batch;
     dtype drop_factor;
+    int profile_event = -1; // the Profiler event id of the node type
+    bool batch_views = false; // see Graph::setBatchViewsEnabled()
 #if USE_GPU
     void *graph_info;
 #endif
@@ -371,6 +461,210 @@ public:
         return batch.at(0)->drop_value;
     }
 
+    // calls func(idx) for every node of the batch, big batches are split
+    // over ThreadPool::Ins()
+    void forEachNode(const std::function<void(int)> &func) {
+        ThreadPool::Ins().ParallelFor(batch.size(), func);
+    }
+
+    // like forEachNode, but nodes sharing a key (an input node, a gradient
+    // row...) are never processed at the same time, and are processed in
+    // batch order, so accumulated losses come out as in a serial loop
+    void forEachNodeExclusively(
+            const std::function<void(int, vector<const void*>&)> &keys_of,
+            const std::function<void(int)> &func) {
+        int count = batch.size();
+        ThreadPool &pool = ThreadPool::Ins();
+        if (count < pool.ParallelThreshold() || pool.ThreadCount() == 1 ||
+                ThreadPool::InWorker()) {
+            for (int idx = 0; idx < count; idx++) {
+                func(idx);
+            }
+            return;
+        }
+        std::unordered_map<const void*, int> next_rounds;
+        vector<int> rounds(count);
+        vector<const void*> keys;
+        int round_count = 0;
+        for (int idx = 0; idx < count; idx++) {
+            keys.clear();
+            keys_of(idx, keys);
+            int round = 0;
+            for (const void *key : keys) {
+                auto it = next_rounds.find(key);
+                if (it != next_rounds.end() && it->second > round) {
+                    round = it->second;
+                }
+            }
+            for (const void *key : keys) {
+                next_rounds[key] = round + 1;
+            }
+            rounds.at(idx) = round;
+            if (round + 1 > round_count) {
+                round_count = round + 1;
+            }
+        }
+        vector<int> begins(round_count + 1, 0);
+        for (int round : rounds) {
+            begins.at(round + 1)++;
+        }
+        for (int round = 0; round < round_count; round++) {
+            begins.at(round + 1) += begins.at(round);
+        }
+        vector<int> order(count);
+        vector<int> filled(begins.begin(), begins.end() - 1);
+        for (int idx = 0; idx < count; idx++) {
+            order.at(filled.at(rounds.at(idx))++) = idx;
+        }
+        for (int round = 0; round < round_count; round++) {
+            const int *round_order = order.data() + begins.at(round);
+            pool.ParallelFor(begins.at(round + 1) - begins.at(round),
+                    [&func, round_order](int i) {
+                        func(round_order[i]);
+                    });
+        }
+    }
+
+#if !USE_GPU
+    // the vals of input(0) ... input(count - 1) as the rows of a count x dim
+    // matrix. Vals that are consecutive rows of one buffer already, like the
+    // batch views of one producer, are used in place, others are copied into
+    // rows.
+    dtype *inputVals(const std::function<PNode(int)> &input, int dim,
+            Tensor2D &rows) {
+        int count = batch.size();
+        if (consecutive(input, dim, true)) {
+            return input(0)->val.v;
+        }
+        rows.init(count, dim);
+        for (int idx = 0; idx < count; idx++) {
+            memcpy(rows[idx], input(idx)->val.v, dim * sizeof(dtype));
+        }
+        return rows.v;
+    }
+
+    // adds the rows of the count x dim matrix losses to the losses of the
+    // inputs, at once when those are consecutive rows of one buffer
+    void addInputLosses(const std::function<PNode(int)> &input, int dim,
+            dtype *losses) {
+        int count = batch.size();
+        if (consecutive(input, dim, false)) {
+            Mat(input(0)->loss.v, count, dim) += Mat(losses, count, dim);
+            return;
+        }
+        for (int idx = 0; idx < count; idx++) {
+            input(idx)->loss.vec() += Vec(losses + idx * dim, dim);
+        }
+    }
+
+    // makes the rows of vals the vals of the batch. With batch views the
+    // nodes borrow them, and in training their losses borrow the rows of
+    // losses, so that consumers read and accumulate in place, otherwise the
+    // rows are copied. In training a batch with dropout borrows drop_vals, a
+    // copy of vals, as forward_drop() works in place and backward needs vals.
+    void outputVals(Tensor2D &vals, Tensor2D &drop_vals, Tensor2D &losses) {
+        int count = batch.size();
+        int dim = vals.col;
+        viewed = batch_views;
+        if (!viewed) {
+            for (int idx = 0; idx < count; idx++) {
+                memcpy(batch[idx]->val.v, vals[idx], dim * sizeof(dtype));
+            }
+            return;
+        }
+        dtype *rows = vals.v;
+        if (bTrain && initialDropValue() > 0) {
+            drop_vals.init(count, dim);
+            memcpy(drop_vals.v, vals.v, count * dim * sizeof(dtype));
+            rows = drop_vals.v;
+        }
+        if (bTrain) {
+            losses.init(count, dim);
+        }
+        for (int idx = 0; idx < count; idx++) {
+            batch[idx]->val.borrow(rows + idx * dim, dim);
+            if (bTrain) {
+                batch[idx]->loss.borrow(losses[idx], dim);
+            }
+        }
+    }
+
+    // forward_drop() of the batch, in training the masks of all its nodes are
+    // drawn at once
+    void forwardDrop(dtype factor) {
+        Dropout &dropout = Dropout::Ins();
+        if (!bTrain || initialDropValue() <= 0 || dropout.ExactCount()) {
+            for (PNode p : batch) {
+                p->forward_drop(bTrain, factor);
+            }
+            return;
+        }
+        int total = 0;
+        for (PNode p : batch) {
+            total += p->dim;
+        }
+        static thread_local vector<uint32_t> draws;
+        draws.resize(total);
+        dropout.Draw(draws.data(), total);
+        int offset = 0;
+        for (PNode p : batch) {
+            if (p->drop_value > 0) {
+                dtype drop = p->drop_value * factor;
+                Dropout::ToMask(draws.data() + offset, p->drop_mask.v, p->dim,
+                        drop, dropout.KeepValue(drop));
+            }
+            p->apply_drop(bTrain, factor);
+            offset += p->dim;
+        }
+    }
+
+    // applies dropout to the losses of the batch and makes them the rows of
+    // losses, which they are already when outputVals() viewed them
+    void outputLosses(Tensor2D &losses, int dim) {
+        int count = batch.size();
+        for (PNode p : batch) {
+            p->backward_drop();
+        }
+        if (!viewed) {
+            losses.init(count, dim);
+            for (int idx = 0; idx < count; idx++) {
+                memcpy(losses[idx], batch[idx]->loss.v, dim * sizeof(dtype));
+            }
+        }
+    }
+
+    // the nodes of the batch return to their own buffers, before the exec
+    // is reused and its rows may be freed
+    void releaseViews() {
+        if (!viewed) {
+            return;
+        }
+        for (PNode p : batch) {
+            p->val.unborrow();
+            p->loss.unborrow();
+        }
+        viewed = false;
+    }
+
+private:
+    bool consecutive(const std::function<PNode(int)> &input, int dim,
+            bool vals) {
+        int count = batch.size();
+        const dtype *first = vals ? input(0)->val.v : input(0)->loss.v;
+        for (int idx = 1; idx < count; idx++) {
+            const dtype *v = vals ? input(idx)->val.v : input(idx)->loss.v;
+            if (v != first + idx * dim) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool viewed = false; // outputVals() made the batch views of its buffers
+
+public:
+#endif
+
 #if USE_GPU
     void CalculateDropMask(int count, int dim,
             const Tensor2D &mask) {
@@ -305,7 +305,6 @@ public:
 public:
     Tensor1D x, y;
     int sumDim;
-    bool bTrain;
 
 
 #if USE_GPU
@@ -339,7 +338,8 @@ public:
         for (int i = 0; i < count; ++i) {
             for (int j = 0; j < dim; ++j) {
                 dtype v = drop_mask[j][i];
-                batch[i]->drop_mask[j] = v <= drop_factor ? 0 : 1;
+                batch[i]->drop_mask[j] = v <= drop_factor ? 0 :
+                    Dropout::Ins().KeepValue(drop_factor);
             }
         }
         for (int idx = 0; idx < count; idx++) {
@@ -67,9 +67,8 @@ public:
     std::vector<dtype*> vals;
     int dim;
 public:
-    Tensor1D y, x1, x2;
+    Tensor1D y, x1, x2, ly, lx1, lx2;
     int sumDim;
-    bool bTrain;
 
 public:
 #if USE_GPU
@@ -90,7 +89,8 @@ public:
         for (int i = 0; i < count; ++i) {
             for (int j = 0; j < dim; ++j) {
                 dtype v = drop_mask[j][i];
-                batch[i]->drop_mask[j] = v <= dynamicDropValue() ? 0 : 1;
+                batch[i]->drop_mask[j] = v <= dynamicDropValue() ? 0 :
+                    Dropout::Ins().KeepValue(dynamicDropValue());
             }
         }
         for (int idx = 0; idx < count; idx++) {
@@ -172,7 +172,6 @@ public:
     void backward() {
         int count = batch.size();
         //#pragma omp parallel for
-        Tensor1D ly, lx1, lx2;
         ly.init(sumDim);
         lx1.init(sumDim);
         lx2.init(sumDim);
@@ -73,9 +73,13 @@ class Param : public BaseParam {
         n3ldg_cuda::Assert(val.verify("Param adagrad"));
 #endif
 #else
-        if (val.col > 1 && val.row > 1)grad.vec() = grad.vec() + val.vec() * reg;
-        aux_square.vec() = aux_square.vec() + grad.vec().square();
-        val.vec() = val.vec() - grad.vec() * alpha / (aux_square.vec() + eps).sqrt();
+        if (val.aligned() && grad.aligned() && aux_square.aligned()) {
+            adagradStep(val.alignedVec(), grad.alignedVec(),
+                    aux_square.alignedVec(), alpha, reg, eps);
+        } else {
+            adagradStep(val.vec(), grad.vec(), aux_square.vec(), alpha, reg,
+                    eps);
+        }
 #endif
     }
 
@@ -105,15 +109,39 @@ class Param : public BaseParam {
         n3ldg_cuda::Assert(val.verify("Param adam"));
 #endif
 #else
-        if (val.col > 1 && val.row > 1)grad.vec() = grad.vec() + val.vec() * reg;
-        aux_mean.vec() = belta1 * aux_mean.vec() + (1 - belta1) * grad.vec();
-        aux_square.vec() = belta2 * aux_square.vec() + (1 - belta2) * grad.vec().square();
         dtype lr_t = alpha * sqrt(1 - pow(belta2, iter + 1)) / (1 - pow(belta1, iter + 1));
-        val.vec() = val.vec() - aux_mean.vec() * lr_t / (aux_square.vec() + eps).sqrt();
+        if (val.aligned() && grad.aligned() && aux_mean.aligned() &&
+                aux_square.aligned()) {
+            adamStep(val.alignedVec(), grad.alignedVec(), aux_mean.alignedVec(),
+                    aux_square.alignedVec(), belta1, belta2, lr_t, reg, eps);
+        } else {
+            adamStep(val.vec(), grad.vec(), aux_mean.vec(), aux_square.vec(),
+                    belta1, belta2, lr_t, reg, eps);
+        }
 #endif
         iter++;
     }
 
+#if !USE_GPU
+    // V is AlignedVec when all buffers are aligned, else Vec
+    template <typename V>
+    void adagradStep(V val_vec, V grad_vec, V square_vec, dtype alpha,
+            dtype reg, dtype eps) {
+        if (val.col > 1 && val.row > 1)grad_vec = grad_vec + val_vec * reg;
+        square_vec = square_vec + grad_vec.square();
+        val_vec = val_vec - grad_vec * alpha / (square_vec + eps).sqrt();
+    }
+
+    template <typename V>
+    void adamStep(V val_vec, V grad_vec, V mean_vec, V square_vec,
+            dtype belta1, dtype belta2, dtype lr_t, dtype reg, dtype eps) {
+        if (val.col > 1 && val.row > 1)grad_vec = grad_vec + val_vec * reg;
+        mean_vec = belta1 * mean_vec + (1 - belta1) * grad_vec;
+        square_vec = belta2 * square_vec + (1 - belta2) * grad_vec.square();
+        val_vec = val_vec - mean_vec * lr_t / (square_vec + eps).sqrt();
+    }
+#endif
+
     inline void randpoint(int& idx, int &idy) {
         //select indexes randomly
         std::vector<int> idRows, idCols;
@@ -162,7 +190,11 @@ class Param : public BaseParam {
         n3ldg_cuda::Assert(grad.verify("Param rescaleGrad"));
 #endif
 #else
-        grad.vec() = grad.vec() * scale;
+        if (grad.aligned()) {
+            grad.alignedVec() = grad.alignedVec() * scale;
+        } else {
+            grad.vec() = grad.vec() * scale;
+        }
 #endif
     }
 
@@ -181,4 +213,42 @@ class Param : public BaseParam {
     }
 };
 
+#if !USE_GPU
+// whether the val and grad of every param directly follow those of the
+// previous one
+inline bool paramsContiguous(const vector<Param*> &params) {
+    for (size_t i = 1; i < params.size(); ++i) {
+        const Param *last = params.at(i - 1);
+        if (params.at(i)->val.v != last->val.v + last->val.size ||
+                params.at(i)->grad.v != last->grad.v + last->grad.size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// copies params with the same column count into val and grad, one after
+// another, and makes them views of the copies, so that the params can be
+// multiplied as one matrix
+inline void stackParams(const vector<Param*> &params, Tensor2D &val,
+        Tensor2D &grad) {
+    int row = 0;
+    for (Param *p : params) {
+        row += p->val.row;
+    }
+    int col = params.at(0)->val.col;
+    val.init(row, col);
+    grad.init(row, col);
+    int offset = 0;
+    for (Param *p : params) {
+        int size = p->val.size;
+        memcpy(val.v + offset, p->val.v, size * sizeof(dtype));
+        memcpy(grad.v + offset, p->grad.v, size * sizeof(dtype));
+        p->val.attach(val.v + offset, p->val.row, col);
+        p->grad.attach(grad.v + offset, p->grad.row, col);
+        offset += size;
+    }
+}
+#endif
+
 #endif /* PARAM_H_ */
@@ -0,0 +1,119 @@
+#ifndef N3LDG_PERF_COUNTERS_H
+#define N3LDG_PERF_COUNTERS_H
+
+/*
+*  PerfCounters.h:
+*  hardware counters of the calling thread via perf_event_open, linux only.
+*  Counters the kernel or the cpu does not allow read as 0, and everything
+*  reads as 0 elsewhere, so callers never need to check Available().
+*/
+
+#include <cstring>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+enum PerfCounter {
+    PERF_CYCLES = 0,
+    PERF_INSTRUCTIONS = 1,
+    PERF_CACHE_MISSES = 2,
+    PERF_BRANCH_MISSES = 3,
+    PERF_LLC_LOADS = 4,
+    PERF_COUNTER_COUNT = 5
+};
+
+inline const char *perfCounterName(int counter) {
+    static const char *names[PERF_COUNTER_COUNT] = {"cycles", "instructions",
+        "cache-misses", "branch-misses", "llc-loads"};
+    return names[counter];
+}
+
+class PerfCounters {
+public:
+    // the counters of the calling thread, opened on first use
+    static PerfCounters &Thread() {
+        thread_local PerfCounters counters;
+        return counters;
+    }
+
+    bool Available() const {
+        return leader_ >= 0;
+    }
+
+    // the current counts since the counters were opened
+    void Read(long long *values) {
+        memset(values, 0, PERF_COUNTER_COUNT * sizeof(long long));
+#ifdef __linux__
+        if (leader_ < 0) {
+            return;
+        }
+        // the group format: the number of counters, then their counts in the
+        // order they were opened
+        unsigned long long buffer[PERF_COUNTER_COUNT + 1];
+        if (read(leader_, buffer, sizeof(buffer)) <= 0) {
+            return;
+        }
+        unsigned long long opened = 0;
+        for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+            if (fds_[i] >= 0 && opened < buffer[0]) {
+                values[i] = buffer[1 + opened++];
+            }
+        }
+#endif
+    }
+
+    ~PerfCounters() {
+#ifdef __linux__
+        for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+            if (fds_[i] >= 0) {
+                close(fds_[i]);
+            }
+        }
+#endif
+    }
+
+private:
+    PerfCounters() {
+        leader_ = -1;
+        for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+            fds_[i] = -1;
+        }
+#ifdef __linux__
+        const unsigned int types[PERF_COUNTER_COUNT] = {PERF_TYPE_HARDWARE,
+            PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+            PERF_TYPE_HW_CACHE};
+        const unsigned long long configs[PERF_COUNTER_COUNT] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+            PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16)};
+        for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[i];
+            attr.config = configs[i];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+            fds_[i] = syscall(__NR_perf_event_open, &attr, 0, -1, leader_, 0);
+            if (i == 0) {
+                leader_ = fds_[0];
+                if (leader_ < 0) {
+                    return;
+                }
+            }
+        }
+#endif
+    }
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    int leader_; // cycles, the others are read with it
+    int fds_[PERF_COUNTER_COUNT];
+};
+
+#endif
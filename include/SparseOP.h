@@ -85,6 +85,10 @@ class SparseNode : public Node {
         param = paramInit;
     }
 
+    const void *paramKey() const override {
+        return param;
+    }
+
     inline void clearValue() {
         Node::clearValue();
         ins.clear();
@@ -132,27 +136,35 @@ class SparseNode : public Node {
         return true;
     }
 
+    size_t typeHashCode() const override {
+        return Node::typeHashCode() ^ ::typeHashCode(param);
+    }
+
 };
 
 
 class SparseExecute :public Execute {
   public:
     inline void  forward() {
-        int count = batch.size();
-        //#pragma omp parallel for
-        for (int idx = 0; idx < count; idx++) {
+        forEachNode([this](int idx) {
             batch[idx]->compute();
             batch[idx]->forward_drop(bTrain, drop_factor);
-        }
+        });
     }
 
     inline void backward() {
-        int count = batch.size();
-        //#pragma omp parallel for
-        for (int idx = 0; idx < count; idx++) {
+        forEachNodeExclusively([this](int idx, vector<const void*> &keys) {
+            SparseNode *ptr = static_cast<SparseNode*>(batch[idx]);
+            for (int featId : ptr->ins) {
+                keys.push_back(ptr->param->W.grad[featId]);
+                // touched serially here, so parallel backwards never
+                // append to touched_rows
+                ptr->param->W.touchRow(featId);
+            }
+        }, [this](int idx) {
             batch[idx]->backward_drop();
             batch[idx]->backward();
-        }
+        });
     }
 };
 
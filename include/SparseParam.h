@@ -17,6 +17,7 @@ class SparseParam : public BaseParam {
     Tensor2D aux_square;
     Tensor2D aux_mean;
     NRVec<bool> indexers;
+    vector<int> touched_rows; // rows set in indexers, see touchRow()
     NRVec<int> last_update;
 #if USE_GPU
     n3ldg_cuda::BoolArray dIndexers;
@@ -49,6 +50,7 @@ class SparseParam : public BaseParam {
         aux_mean.init(inDim, outDim);
         indexers.resize(inDim);
         indexers = false;
+        touched_rows.clear();
         last_update.resize(inDim);
         last_update = 0;
 #if USE_GPU
@@ -73,22 +75,31 @@ class SparseParam : public BaseParam {
             }
         }
         indexers = false;
+        touched_rows.clear();
         n3ldg_cuda::Assert(grad.verify("SparseParam clearGrad"));
         n3ldg_cuda::Assert(n3ldg_cuda::Verify(indexers.c_buf(),
                     dIndexers.value, grad.row, "SparseParam indexers"));
 #endif
 #else
-        int inDim = indexers.size();
-        for (int index = 0; index < inDim; index++) {
-            if (!indexers[index]) continue;
+        for (int index : touched_rows) {
             for (int idx = 0; idx < grad.col; idx++) {
                 grad[index][idx] = 0;
             }
+            indexers[index] = false;
         }
-        indexers = false;
+        touched_rows.clear();
 #endif
     }
 
+    // marks a row whose grad is about to change, so that clearing and
+    // updating only visit the touched rows
+    inline void touchRow(int index) {
+        if (!indexers[index]) {
+            indexers[index] = true;
+            touched_rows.push_back(index);
+        }
+    }
+
     inline int outDim() {
         return val.col;
     }
@@ -115,18 +126,23 @@ class SparseParam : public BaseParam {
         n3ldg_cuda::Assert(val.verify("SparseParam updateAdagrad"));
 #endif
 #else
-        int inDim = indexers.size();
-        for (int index = 0; index < inDim; index++) {
-            if (!indexers[index]) continue;
-            for (int idx = 0; idx < grad.col; idx++) {
-                grad[index][idx] = grad[index][idx] + val[index][idx] * reg;
-                aux_square[index][idx] = aux_square[index][idx] + grad[index][idx] * grad[index][idx];
-                val[index][idx] = val[index][idx] - grad[index][idx] * alpha / sqrt(aux_square[index][idx] + eps);
-            }
+        for (int index : touched_rows) {
+            updateRowAdagrad(index, grad[index], alpha, reg, eps);
         }
 #endif
     }
 
+    // updates one row with its grad g, which is modified in place. Rows are
+    // independent, so workers may update different rows concurrently.
+    inline void updateRowAdagrad(int index, dtype *g, dtype alpha, dtype reg,
+            dtype eps) {
+        for (int idx = 0; idx < val.col; idx++) {
+            g[idx] = g[idx] + val[index][idx] * reg;
+            aux_square[index][idx] = aux_square[index][idx] + g[idx] * g[idx];
+            val[index][idx] = val[index][idx] - g[idx] * alpha / sqrt(aux_square[index][idx] + eps);
+        }
+    }
+
     inline void updateAdam(dtype belta1, dtype belta2, dtype alpha, dtype reg, dtype eps) {
 #if USE_GPU
         n3ldg_cuda::UpdateAdam(val.value, grad.value, indexers.size(),
@@ -158,22 +174,25 @@ class SparseParam : public BaseParam {
         n3ldg_cuda::Assert(val.verify("SparseParam updateAdam"));
 #endif
 #else
-        dtype lr_t;
-        int inDim = indexers.size();
-        for (int index = 0; index < inDim; index++) {
-            if (!indexers[index]) continue;
-            for (int idx = 0; idx < grad.col; idx++) {
-                grad[index][idx] = grad[index][idx] + val[index][idx] * reg;
-                aux_mean[index][idx] = belta1 * aux_mean[index][idx] + (1 - belta1) * grad[index][idx];
-                aux_square[index][idx] = belta2 * aux_square[index][idx] + (1 - belta2) * grad[index][idx] * grad[index][idx];
-                lr_t = alpha * sqrt(1 - pow(belta2, last_update[index] + 1)) / (1 - pow(belta1, last_update[index] + 1));
-                val[index][idx] = val[index][idx] - aux_mean[index][idx] * lr_t / sqrt(aux_square[index][idx] + eps);
-            }
-            last_update[index]++;
+        for (int index : touched_rows) {
+            updateRowAdam(index, grad[index], belta1, belta2, alpha, reg, eps);
         }
 #endif
     }
 
+    inline void updateRowAdam(int index, dtype *g, dtype belta1, dtype belta2,
+            dtype alpha, dtype reg, dtype eps) {
+        int iter = last_update[index];
+        dtype lr_t = alpha * sqrt(1 - pow(belta2, iter + 1)) / (1 - pow(belta1, iter + 1));
+        for (int idx = 0; idx < val.col; idx++) {
+            g[idx] = g[idx] + val[index][idx] * reg;
+            aux_mean[index][idx] = belta1 * aux_mean[index][idx] + (1 - belta1) * g[idx];
+            aux_square[index][idx] = belta2 * aux_square[index][idx] + (1 - belta2) * g[idx] * g[idx];
+            val[index][idx] = val[index][idx] - aux_mean[index][idx] * lr_t / sqrt(aux_square[index][idx] + eps);
+        }
+        last_update[index] = iter + 1;
+    }
+
     inline void randpoint(int& idx, int &idy) {
         //select indexes randomly
         std::vector<int> idRows, idCols;
@@ -222,9 +241,7 @@ class SparseParam : public BaseParam {
         return sumNorm;
 #else
         dtype sumNorm = 0.0;
-        int inDim = indexers.size();
-        for (int index = 0; index < inDim; index++) {
-            if (!indexers[index]) continue;
+        for (int index : touched_rows) {
             for (int idx = 0; idx < val.col; idx++) {
                 sumNorm += grad[index][idx] * grad[index][idx];
             }
@@ -247,9 +264,7 @@ class SparseParam : public BaseParam {
         n3ldg_cuda::Assert(grad.verify("SparseParam rescaleGrad"));
 #endif
 #else
-        int inDim = indexers.size();
-        for (int index = 0; index < inDim; index++) {
-            if (!indexers[index]) continue;
+        for (int index : touched_rows) {
             for (int idx = 0; idx < val.col; idx++) {
                 grad[index][idx] = grad[index][idx] * scale;
             }
@@ -284,7 +299,7 @@ class SparseParam : public BaseParam {
         if (loss.dim != val.col) {
             std::cout << "warning: loss dim not equal lookup param dim." << std::endl;
         }
-        indexers[featId] = true;
+        touchRow(featId);
         for (int idx = 0; idx < val.col; idx++) {
             grad[featId][idx] += loss[idx];
         }
@@ -298,7 +313,7 @@ class SparseParam : public BaseParam {
         int featId;
         for (int i = 0; i < featNum; i++) {
             featId = featIds[i];
-            indexers[featId] = true;
+            touchRow(featId);
             for (int idx = 0; idx < val.col; idx++) {
                 grad[featId][idx] += loss[idx];
             }
@@ -0,0 +1,181 @@
+#ifndef N3LDG_THREAD_POOL_H
+#define N3LDG_THREAD_POOL_H
+
+/*
+*  ThreadPool.h:
+*  a fixed set of worker threads shared by graph executions.
+*  Run(count, task) calls task(0) ... task(count - 1) and returns when all
+*  of them finished, the calling thread takes part in the work.
+*  ParallelFor(count, func) splits a loop into chunks which idle threads
+*  keep grabbing until none is left, short loops run inline.
+*/
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+
+class ThreadPool {
+public:
+    static ThreadPool &Ins() {
+        static ThreadPool ins;
+        return ins;
+    }
+
+    // thread_count includes the calling thread, 1 means run everything inline
+    void SetThreadCount(int thread_count) {
+        if (thread_count < 1) thread_count = 1;
+        stopWorkers();
+        stop_ = false;
+        for (int i = 1; i < thread_count; ++i) {
+            workers_.push_back(std::thread(&ThreadPool::workerLoop, this));
+        }
+    }
+
+    int ThreadCount() const {
+        return workers_.size() + 1;
+    }
+
+    // tasks started from a worker, or while another Run is in flight, are
+    // executed inline by the caller
+    void Run(int task_count, const std::function<void(int)> &task) {
+        if (task_count <= 0) return;
+        if (workers_.empty() || task_count == 1 || InWorker() ||
+                !run_mutex_.try_lock()) {
+            for (int i = 0; i < task_count; ++i) {
+                task(i);
+            }
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            task_ = &task;
+            task_count_ = task_count;
+            next_task_ = 0;
+            unfinished_ = task_count;
+            ++generation_;
+        }
+        wake_.notify_all();
+
+        InWorker() = true;
+        drain(task);
+        InWorker() = false;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            done_.wait(lock, [this]() {
+                    return unfinished_ == 0 && active_workers_ == 0;});
+            task_ = NULL;
+        }
+        run_mutex_.unlock();
+    }
+
+    // loops shorter than this are not split
+    void SetParallelThreshold(int threshold) {
+        parallel_threshold_ = threshold;
+    }
+
+    int ParallelThreshold() const {
+        return parallel_threshold_;
+    }
+
+    void ParallelFor(int count, const std::function<void(int)> &func) {
+        if (count < parallel_threshold_ || workers_.empty() || InWorker()) {
+            for (int i = 0; i < count; ++i) {
+                func(i);
+            }
+            return;
+        }
+        int chunk_size = std::max(16, count / (ThreadCount() * 8));
+        int chunk_count = (count + chunk_size - 1) / chunk_size;
+        Run(chunk_count, [&](int chunk) {
+                int end = std::min(count, (chunk + 1) * chunk_size);
+                for (int i = chunk * chunk_size; i < end; ++i) {
+                    func(i);
+                }
+                });
+    }
+
+    static bool &InWorker() {
+        static thread_local bool in_worker = false;
+        return in_worker;
+    }
+
+    ~ThreadPool() {
+        stopWorkers();
+    }
+
+private:
+    ThreadPool() = default;
+
+    void drain(const std::function<void(int)> &task) {
+        while (true) {
+            int i = next_task_.fetch_add(1);
+            if (i >= task_count_) {
+                break;
+            }
+            task(i);
+            if (unfinished_.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                done_.notify_all();
+            }
+        }
+    }
+
+    void workerLoop() {
+        InWorker() = true;
+        long long seen_generation = 0;
+        while (true) {
+            const std::function<void(int)> *task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [this, seen_generation]() {
+                        return stop_ || (task_ != NULL &&
+                            generation_ != seen_generation);});
+                if (stop_) {
+                    return;
+                }
+                seen_generation = generation_;
+                task = task_;
+                ++active_workers_;
+            }
+            drain(*task);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                --active_workers_;
+            }
+            done_.notify_all();
+        }
+    }
+
+    void stopWorkers() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (std::thread &worker : workers_) {
+            worker.join();
+        }
+        workers_.clear();
+    }
+
+    std::vector<std::thread> workers_;
+    std::mutex run_mutex_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    const std::function<void(int)> *task_ = NULL;
+    int task_count_ = 0;
+    std::atomic<int> next_task_ = {0};
+    std::atomic<int> unfinished_ = {0};
+    int active_workers_ = 0;
+    long long generation_ = 0;
+    bool stop_ = false;
+    int parallel_threshold_ = 256;
+};
+
+#endif
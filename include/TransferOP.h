@@ -80,6 +80,10 @@ class TransferNode : public Node {
         param = paramInit;
     }
 
+    const void *paramKey() const override {
+        return param;
+    }
+
     inline void clearValue() {
         Node::clearValue();
         in = NULL;
@@ -130,27 +134,34 @@ class TransferNode : public Node {
         return true;
     }
 
+    size_t typeHashCode() const override {
+        return Node::typeHashCode() ^ ::typeHashCode(param) ^
+            (std::hash<int>{}(xid) << 1);
+    }
+
 };
 
 
 class TransferExecute :public Execute {
   public:
     inline void  forward() {
-        int count = batch.size();
-        //#pragma omp parallel for
-        for (int idx = 0; idx < count; idx++) {
+        forEachNode([this](int idx) {
             batch[idx]->compute();
             batch[idx]->forward_drop(bTrain, drop_factor);
-        }
+        });
     }
 
     inline void backward() {
-        int count = batch.size();
-        //#pragma omp parallel for
-        for (int idx = 0; idx < count; idx++) {
+        forEachNodeExclusively([this](int idx, vector<const void*> &keys) {
+            TransferNode *ptr = static_cast<TransferNode*>(batch[idx]);
+            keys.push_back(ptr->in);
+            if (ptr->xid >= 0) {
+                keys.push_back(&ptr->param->W[ptr->xid]);
+            }
+        }, [this](int idx) {
             batch[idx]->backward_drop();
             batch[idx]->backward();
-        }
+        });
     }
 };
 
@@ -101,6 +101,15 @@ public:
         param = paramInit;
     }
 
+    const void *paramKey() const override {
+        return param;
+    }
+
+    long long flops() const override {
+        return 2LL * param->W1.outDim() * (param->W1.inDim() +
+                param->W2.inDim() + param->W3.inDim());
+    }
+
     inline void clearValue() {
         Node::clearValue();
         in1 = in2 = in3 = NULL;
@@ -130,11 +139,13 @@ public:
         if (param->bUseB) {
             ty.vec() += param->b.val.vec();
         }
-        val.vec() = ty.vec().unaryExpr(ptr_fun(activate));
+        activateValues(activationKind(activate, derivate), activate, ty.v,
+                val.v, dim);
     }
 
     inline void backward(Tensor1D& ty, Tensor1D& lty) {
-        lty.vec() = loss.vec() * ty.vec().binaryExpr(val.vec(), ptr_fun(derivate));
+        derivateLosses(activationKind(activate, derivate), derivate, ty.v,
+                val.v, loss.v, lty.v, dim, false);
 
         param->W1.grad.mat() += lty.mat() * in1->val.tmat();
         param->W2.grad.mat() += lty.mat() * in2->val.tmat();
@@ -168,6 +179,13 @@ public:
         return true;
     }
 
+    size_t typeHashCode() const override {
+        void *act = reinterpret_cast<void*>(activate);
+        void *de = reinterpret_cast<void*>(derivate);
+        return Node::typeHashCode() ^ ::typeHashCode(param) ^
+            ::typeHashCode(act) ^ (::typeHashCode(de) << 1);
+    }
+
 };
 
 
@@ -191,6 +209,15 @@ public:
         param = paramInit;
     }
 
+    const void *paramKey() const override {
+        return param;
+    }
+
+    long long flops() const override {
+        return 2LL * param->W1.outDim() * (param->W1.inDim() +
+                param->W2.inDim() + param->W3.inDim());
+    }
+
     inline void clearValue() {
         Node::clearValue();
         in1 = in2 = in3 = NULL;
@@ -247,6 +274,10 @@ public:
         return true;
     }
 
+    size_t typeHashCode() const override {
+        return Node::typeHashCode() ^ ::typeHashCode(param);
+    }
+
 };
 
 
@@ -498,23 +529,22 @@ public:
         int count = batch.size();
         tys.resize(count);
         for (int idx = 0; idx < count; idx++) {
-            tys[idx].init(dim, NULL);
+            tys[idx].init(dim);
         }
-        //#pragma omp parallel for schedule(static,1)
-        for (int idx = 0; idx < count; idx++) {
+        forEachNode([this](int idx) {
             TriNode* ptr = (TriNode*)batch[idx];
             ptr->compute(tys[idx]);
-            ptr->forward_drop(bTrain);
-        }
+            ptr->forward_drop(bTrain, drop_factor);
+        });
     }
 
     inline void backward() {
         int count = batch.size();
         ltys.resize(count);
         for (int idx = 0; idx < count; idx++) {
-            ltys[idx].init(dim, NULL);
+            ltys[idx].init(dim);
         }
-        //#pragma omp parallel for schedule(static,1)
+        // every node accumulates into the same weight gradients
         for (int idx = 0; idx < count; idx++) {
             TriNode* ptr = (TriNode*)batch[idx];
             ptr->backward_drop();
@@ -540,7 +570,7 @@ public:
         for (int idx = 0; idx < count; idx++) {
             LinearTriNode* ptr = (LinearTriNode*)batch[idx];
             ptr->compute();
-            ptr->forward_drop(bTrain);
+            ptr->forward_drop(bTrain, drop_factor);
         }
     }
 
@@ -565,11 +595,14 @@ inline PExecute LinearTriNode::generate(bool bTrain, dtype drop_factor) {
 #else
 class TriExecute :public Execute {
 public:
-    Tensor2D x1, x2, x3, ty, y, b;
+    Tensor2D x1, x2, x3, ty, y, lx1, lx2, lx3, lty, ly;
+    Tensor2D drop_y;
+    dtype *x1_rows, *x2_rows, *x3_rows; // the inputs in place or copied
     int inDim1, inDim2, inDim3, outDim;
     TriParams* param;
     dtype(*activate)(const dtype&);   // activation function
     dtype(*derivate)(const dtype&, const dtype&);  // derivation function of activation function
+    ActivationKind activation; // of activate and derivate
 
 public:
     ~TriExecute() {
@@ -583,101 +616,71 @@ public:
 public:
     inline void  forward() {
         int count = batch.size();
-        x1.init(inDim1, count);
-        x2.init(inDim2, count);
-        x3.init(inDim3, count);
-        b.init(outDim, count);
-        ty.init(outDim, count);
-        y.init(outDim, count);
-
-        for (int idx = 0; idx < count; idx++) {
-            TriNode* ptr = (TriNode*)batch[idx];
-            for (int idy = 0; idy < inDim1; idy++) {
-                x1[idx][idy] = ptr->in1->val[idy];
-            }
-            for (int idy = 0; idy < inDim2; idy++) {
-                x2[idx][idy] = ptr->in2->val[idy];
-            }
-            for (int idy = 0; idy < inDim3; idy++) {
-                x3[idx][idy] = ptr->in3->val[idy];
-            }
-            if (param->bUseB) {
-                for (int idy = 0; idy < outDim; idy++) {
-                    b[idx][idy] = param->b.val.v[idy];
-                }
-            }
-        }
-
-        ty.mat() = param->W1.val.mat() * x1.mat() + param->W2.val.mat() * x2.mat() + param->W3.val.mat() * x3.mat();
+        x1_rows = inputVals([this](int idx) {
+                return static_cast<TriNode*>(batch[idx])->in1;
+                }, inDim1, x1);
+        x2_rows = inputVals([this](int idx) {
+                return static_cast<TriNode*>(batch[idx])->in2;
+                }, inDim2, x2);
+        x3_rows = inputVals([this](int idx) {
+                return static_cast<TriNode*>(batch[idx])->in3;
+                }, inDim3, x3);
+        ty.init(count, outDim);
+        ty.mat() = Mat(x1_rows, count, inDim1) *
+            param->W1.val.mat().transpose() +
+            Mat(x2_rows, count, inDim2) * param->W2.val.mat().transpose() +
+            Mat(x3_rows, count, inDim3) * param->W3.val.mat().transpose();
 
         if (param->bUseB) {
-            ty.vec() = ty.vec() + b.vec();
+            ty.mat().rowwise() += param->b.val.mat().col(0).transpose();
         }
 
-        y.vec() = ty.vec().unaryExpr(ptr_fun(activate));
-
-        for (int idx = 0; idx < count; idx++) {
-            TriNode* ptr = (TriNode*)batch[idx];
-            for (int idy = 0; idy < outDim; idy++) {
-                ptr->val[idy] = y[idx][idy];
-            }
-            ptr->forward_drop(bTrain, drop_factor);
-        }
+        y.init(count, outDim);
+        activateValues(activation, activate, ty.v, y.v, ty.size);
+        outputVals(y, drop_y, ly);
+        forwardDrop(drop_factor);
     }
 
     inline void backward() {
         int count = batch.size();
-        Tensor2D lx1, lx2, lx3, lty, ly;
-        lx1.init(inDim1, count);
-        lx2.init(inDim2, count);
-        lx3.init(inDim3, count);
-        lty.init(outDim, count);
-        ly.init(outDim, count);
-
-        for (int idx = 0; idx < count; idx++) {
-            TriNode* ptr = (TriNode*)batch[idx];
-            ptr->backward_drop();
-            for (int idy = 0; idy < outDim; idy++) {
-                ly[idx][idy] = ptr->loss[idy];
-            }
-        }
-
-        lty.vec() = ly.vec() * ty.vec().binaryExpr(y.vec(), ptr_fun(derivate));
-
-        param->W1.grad.mat() += lty.mat() * x1.mat().transpose();
-        param->W2.grad.mat() += lty.mat() * x2.mat().transpose();
-        param->W3.grad.mat() += lty.mat() * x3.mat().transpose();
+        outputLosses(ly, outDim);
+        lty.init(count, outDim);
+        derivateLosses(activation, derivate, ty.v, y.v, ly.v, lty.v, ty.size,
+                false);
+
+        param->W1.grad.mat() += lty.mat().transpose() *
+            Mat(x1_rows, count, inDim1);
+        param->W2.grad.mat() += lty.mat().transpose() *
+            Mat(x2_rows, count, inDim2);
+        param->W3.grad.mat() += lty.mat().transpose() *
+            Mat(x3_rows, count, inDim3);
 
         if (param->bUseB) {
-            for (int idx = 0; idx < count; idx++) {
-                for (int idy = 0; idy < outDim; idy++) {
-                    param->b.grad.v[idy] += lty[idx][idy];
-                }
-            }
-        }
-
-        lx1.mat() += param->W1.val.mat().transpose() * lty.mat();
-        lx2.mat() += param->W2.val.mat().transpose() * lty.mat();
-        lx3.mat() += param->W3.val.mat().transpose() * lty.mat();
-
-        for (int idx = 0; idx < count; idx++) {
-            TriNode* ptr = (TriNode*)batch[idx];
-            for (int idy = 0; idy < inDim1; idy++) {
-                ptr->in1->loss[idy] += lx1[idx][idy];
-            }
-            for (int idy = 0; idy < inDim2; idy++) {
-                ptr->in2->loss[idy] += lx2[idx][idy];
-            }
-            for (int idy = 0; idy < inDim3; idy++) {
-                ptr->in3->loss[idy] += lx3[idx][idy];
-            }
-        }
+            param->b.grad.mat().col(0) +=
+                lty.mat().colwise().sum().transpose();
+        }
+
+        lx1.init(count, inDim1);
+        lx1.mat() = lty.mat() * param->W1.val.mat();
+        addInputLosses([this](int idx) {
+                return static_cast<TriNode*>(batch[idx])->in1;
+                }, inDim1, lx1.v);
+        lx2.init(count, inDim2);
+        lx2.mat() = lty.mat() * param->W2.val.mat();
+        addInputLosses([this](int idx) {
+                return static_cast<TriNode*>(batch[idx])->in2;
+                }, inDim2, lx2.v);
+        lx3.init(count, inDim3);
+        lx3.mat() = lty.mat() * param->W3.val.mat();
+        addInputLosses([this](int idx) {
+                return static_cast<TriNode*>(batch[idx])->in3;
+                }, inDim3, lx3.v);
     }
 };
 
 class LinearTriExecute :public Execute {
 public:
-    Tensor2D x1, x2, x3, y, b;
+    Tensor2D x1, x2, x3, y, b, lx1, lx2, lx3, ly;
     int inDim1, inDim2, inDim3, outDim, count;
     TriParams* param;
 
@@ -725,7 +728,6 @@ public:
     }
 
     inline void backward() {
-        Tensor2D lx1, lx2, lx3, ly;
         lx1.init(inDim1, count);
         lx2.init(inDim2, count);
         lx3.init(inDim3, count);
@@ -782,6 +784,7 @@ inline PExecute TriNode::generate(bool bTrain, dtype drop_factor) {
     exec->param = param;
     exec->activate = activate;
     exec->derivate = derivate;
+    exec->activation = activationKind(activate, derivate);
     exec->bTrain = bTrain;
     exec->drop_factor = drop_factor;
     return exec;
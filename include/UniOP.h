@@ -93,7 +93,9 @@ class UniNode : public Node {
     inline void init(int ndim, dtype dropout) {
         Node::init(ndim, dropout);
         ty.init(ndim);
-        lty.init(ndim);
+        if (!inference_only) {
+            lty.init(ndim);
+        }
     }
 
 
@@ -101,6 +103,14 @@ class UniNode : public Node {
         param = paramInit;
     }
 
+    const void *paramKey() const override {
+        return param;
+    }
+
+    long long flops() const override {
+        return 2LL * param->W.outDim() * param->W.inDim();
+    }
+
     inline void clearValue() {
         Node::clearValue();
         in = NULL;
@@ -124,11 +134,13 @@ class UniNode : public Node {
         if (param->bUseB) {
             ty.vec() += param->b.val.vec();
         }
-        val.vec() = ty.vec().unaryExpr(ptr_fun(activate));
+        activateValues(activationKind(activate, derivate), activate, ty.v,
+                val.v, dim);
     }
 
     inline void backward() {
-        lty.vec() = loss.vec() * ty.vec().binaryExpr(val.vec(), ptr_fun(derivate));
+        derivateLosses(activationKind(activate, derivate), derivate, ty.v,
+                val.v, loss.v, lty.v, dim, false);
         param->W.grad.mat() += lty.mat() * in->val.tmat();
         if (param->bUseB) {
             param->b.grad.vec() += lty.vec();
@@ -191,6 +203,14 @@ class LinearUniNode : public Node {
         param = paramInit;
     }
 
+    const void *paramKey() const override {
+        return param;
+    }
+
+    long long flops() const override {
+        return 2LL * param->W.outDim() * param->W.inDim();
+    }
+
     inline void clearValue() {
         Node::clearValue();
         in = NULL;
@@ -237,6 +257,10 @@ class LinearUniNode : public Node {
         return true;
     }
 
+    size_t typeHashCode() const override {
+        return Node::typeHashCode() ^ ::typeHashCode(param);
+    }
+
 };
 
 
@@ -262,6 +286,14 @@ class LinearNode : public Node {
         param = paramInit;
     }
 
+    const void *paramKey() const override {
+        return param;
+    }
+
+    long long flops() const override {
+        return 2LL * param->W.outDim() * param->W.inDim();
+    }
+
     inline void clearValue() {
         Node::clearValue();
         in = NULL;
@@ -317,24 +349,29 @@ class LinearNode : public Node {
 
 class UniExecute :public Execute {
   public:
-    Tensor2D x, ty, y, b;
+    Tensor2D x, ty, y, b, lx, lty, ly;
+#if !USE_GPU
+    Tensor2D drop_y;
+    dtype *x_rows; // count x inDim, x or the vals of the inputs in place
+#endif
     int inDim, outDim;
     UniParams* param;
     dtype(*activate)(const dtype&);   // activation function
     dtype(*derivate)(const dtype&, const dtype&);  // derivation function of activation function
+    ActivationKind activation; // of activate and derivate
     Tensor2D drop_mask;
 
     inline void  forward() {
         int count = batch.size();
+#if USE_GPU
         ty.init(outDim, count);
         x.init(inDim, count);
         y.init(outDim, count);
         drop_mask.init(outDim, count);
-#if TEST_CUDA || !USE_GPU
+#if TEST_CUDA
         b.init(outDim, count);
 #endif
 
-#if USE_GPU
         std::vector<dtype*> xs, ys;
         xs.reserve(batch.size());
         ys.reserve(batch.size());
@@ -396,7 +433,8 @@ class UniExecute :public Execute {
         for (int i = 0; i < count; ++i) {
             for (int j = 0; j < outDim; ++j) {
                 dtype v = drop_mask[j][i];
-                batch[i]->drop_mask[j] = v <= dynamicDropValue() ? 0 : 1;
+                batch[i]->drop_mask[j] = v <= dynamicDropValue() ? 0 :
+                    Dropout::Ins().KeepValue(dynamicDropValue());
             }
         }
 
@@ -409,43 +447,27 @@ class UniExecute :public Execute {
         n3ldg_cuda::Assert(y.verify("forward y"));
 #endif
 #else
-        for (int idx = 0; idx < count; idx++) {
-            UniNode* ptr = (UniNode*)batch[idx];
-            for (int idy = 0; idy < inDim; idy++) {
-                x[idy][idx] = ptr->in->val[idy];
-            }
-            if (param->bUseB) {
-                for (int idy = 0; idy < outDim; idy++) {
-                    b[idy][idx] = param->b.val.v[idy];
-                }
-            }
-        }
-
-        ty.mat() = param->W.val.mat() * x.mat();
+        // one row per node, so inputs and outputs move as whole rows
+        x_rows = inputVals([this](int idx) {
+                return static_cast<UniNode*>(batch[idx])->in;
+                }, inDim, x);
+        ty.init(count, outDim);
+        ty.mat() = Mat(x_rows, count, inDim) *
+            param->W.val.mat().transpose();
 
         if (param->bUseB) {
-            ty.vec() = ty.vec() + b.vec();
-        }
-
-        y.vec() = ty.vec().unaryExpr(ptr_fun(activate));
-
-        for (int idx = 0; idx < count; idx++) {
-            UniNode* ptr = (UniNode*)batch[idx];
-            for (int idy = 0; idy < outDim; idy++) {
-                ptr->val[idy] = y[idy][idx];
-            }
+            ty.mat().rowwise() += param->b.val.mat().col(0).transpose();
         }
 
-        for (int i = 0; i < count; ++i) {
-            dtype drop_value = batch[0]->drop_value;
-            batch[i]->forward_drop(bTrain, drop_factor);
-        }
+        y.init(count, outDim);
+        activateValues(activation, activate, ty.v, y.v, ty.size);
+        outputVals(y, drop_y, ly);
+        forwardDrop(drop_factor);
 #endif
     }
 
     void backward() {
         int count = batch.size();
-        Tensor2D lx, lty, ly;
 #if USE_GPU
         lx.init(inDim, count);
         lty.init(outDim, count);
@@ -528,36 +550,23 @@ class UniExecute :public Execute {
         }
 #endif
 #else
-        lx.init(inDim, count);
-        lty.init(outDim, count);
-        ly.init(outDim, count);
-        for (int idx = 0; idx < count; idx++) {
-            UniNode* ptr = (UniNode*)batch[idx];
-            ptr->backward_drop();
-            for (int idy = 0; idy < outDim; idy++) {
-                ly[idy][idx] = ptr->loss[idy];
-            }
-        }
-
-        lty.vec() = ly.vec() * ty.vec().binaryExpr(y.vec(), ptr_fun(derivate));
-        param->W.grad.mat() += lty.mat() * x.mat().transpose();
+        outputLosses(ly, outDim);
+        lty.init(count, outDim);
+        derivateLosses(activation, derivate, ty.v, y.v, ly.v, lty.v, ty.size,
+                false);
+        param->W.grad.mat() += lty.mat().transpose() *
+            Mat(x_rows, count, inDim);
 
         if (param->bUseB) {
-            for (int idx = 0; idx < count; idx++) {
-                for (int idy = 0; idy < outDim; idy++) {
-                    param->b.grad.v[idy] += lty[idy][idx];
-                }
-            }
+            param->b.grad.mat().col(0) +=
+                lty.mat().colwise().sum().transpose();
         }
 
-        lx.mat() += param->W.val.mat().transpose() * lty.mat();
-
-        for (int idx = 0; idx < count; idx++) {
-            UniNode* ptr = (UniNode*)batch[idx];
-            for (int idy = 0; idy < inDim; idy++) {
-                ptr->in->loss[idy] += lx[idy][idx];
-            }
-        }
+        lx.init(count, inDim);
+        lx.mat() = lty.mat() * param->W.val.mat();
+        addInputLosses([this](int idx) {
+                return static_cast<UniNode*>(batch[idx])->in;
+                }, inDim, lx.v);
 #endif
     }
 };
@@ -572,6 +581,7 @@ inline PExecute UniNode::generate(bool bTrain, dtype cur_drop_factor) {
     exec->param = param;
     exec->activate = activate;
     exec->derivate = derivate;
+    exec->activation = activationKind(activate, derivate);
     return exec;
 };
 
@@ -733,56 +743,32 @@ public:
 #else
 class LinearExecute :public Execute {
   public:
-    Tensor2D x, y;
+    Tensor2D x, y, drop_y, lx, ly;
+    dtype *x_rows; // count x inDim, x or the vals of the inputs in place
     int inDim, outDim, count;
     UniParams* param;
 
     inline void  forward() {
         count = batch.size();
-        x.init(inDim, count);
-        y.init(outDim, count);
-
-        for (int idx = 0; idx < count; idx++) {
-            LinearNode* ptr = (LinearNode*)batch[idx];
-            for (int idy = 0; idy < inDim; idy++) {
-                x[idy][idx] = ptr->in->val[idy];
-            }
-        }
-
-        y.mat() = param->W.val.mat() * x.mat();
-
-        for (int idx = 0; idx < count; idx++) {
-            LinearNode* ptr = (LinearNode*)batch[idx];
-            for (int idy = 0; idy < outDim; idy++) {
-                ptr->val[idy] = y[idy][idx];
-            }
-            ptr->forward_drop(bTrain, drop_factor);
-        }
+        x_rows = inputVals([this](int idx) {
+                return static_cast<LinearNode*>(batch[idx])->in;
+                }, inDim, x);
+        y.init(count, outDim);
+        y.mat() = Mat(x_rows, count, inDim) * param->W.val.mat().transpose();
+        outputVals(y, drop_y, ly);
+        forwardDrop(drop_factor);
     }
 
     inline void backward() {
-        Tensor2D lx, ly;
-        lx.init(inDim, count);
-        ly.init(outDim, count);
-
-        for (int idx = 0; idx < count; idx++) {
-            LinearNode* ptr = (LinearNode*)batch[idx];
-            ptr->backward_drop();
-            for (int idy = 0; idy < outDim; idy++) {
-                ly[idy][idx] = ptr->loss[idy];
-            }
-        }
-
-        param->W.grad.mat() += ly.mat() * x.mat().transpose();
-
-        lx.mat() += param->W.val.mat().transpose() * ly.mat();
-
-        for (int idx = 0; idx < count; idx++) {
-            LinearNode* ptr = (LinearNode*)batch[idx];
-            for (int idy = 0; idy < inDim; idy++) {
-                ptr->in->loss[idy] += lx[idy][idx];
-            }
-        }
+        outputLosses(ly, outDim);
+        param->W.grad.mat() += ly.mat().transpose() *
+            Mat(x_rows, count, inDim);
+
+        lx.init(count, inDim);
+        lx.mat() = ly.mat() * param->W.val.mat();
+        addInputLosses([this](int idx) {
+                return static_cast<LinearNode*>(batch[idx])->in;
+                }, inDim, lx.v);
     }
 };
 #endif
@@ -7,6 +7,13 @@
 #include <utility>
 #include <iostream>
 #include <stack>
+#include <vector>
+#include <atomic>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
 
 
 namespace n3ldg_cuda {
@@ -34,6 +41,28 @@ struct Elapsed {
     std::string name;
 };
 
+// one begin or end of a trace, names are cut to fit
+struct TraceEvent {
+    const char *category; // a string literal
+    char name[48];
+    char phase; // 'B' or 'E'
+    int thread;
+    long long time_in_nanoseconds; // since the trace started
+};
+
+// one node of the call tree of Profiler::Begin() and End(), merged over
+// threads, times in nanoseconds
+struct ProfileStat {
+    std::string name;
+    int depth;
+    long long count;
+    long long inclusive_time;
+    long long exclusive_time;
+    long long p50;
+    long long p95;
+    long long p99;
+};
+
 enum ProfilerMode {
     ANALYSIS = 0,
     METRIC = 1
@@ -50,6 +79,7 @@ public:
     }
 
     void BeginEvent(const std::string &name) {
+        TraceBegin(name);
         if (!enabled_) return;
         Elapsed elapsed;
         elapsed.name = name;
@@ -59,6 +89,7 @@ public:
     }
 
     void EndEvent() {
+        TraceEnd();
         if (!enabled_) return;
         if (running_events_.empty()) {
             std::cout << "running_events_ empty" << std::endl;
@@ -121,12 +152,340 @@ public:
         enabled_ = enabled;
     }
 
+    // the call tree mode: every thread accumulates its own tree of Begin()
+    // and End() pairs, with a latency histogram per tree node, so it stays
+    // cheap enough for serving. Toggle it between graphs only.
+    void SetTreeEnabled(bool enabled) {
+        tree_enabled_ = enabled;
+    }
+
+    bool TreeEnabled() const {
+        return tree_enabled_;
+    }
+
+    // the id of name for Begin(), keep it in a static
+    int EventId(const std::string &name) {
+        std::lock_guard<std::mutex> lock(tree_mutex_);
+        auto it = event_ids_.find(name);
+        if (it != event_ids_.end()) {
+            return it->second;
+        }
+        int id = event_names_.size();
+        event_names_.push_back(name);
+        event_ids_.insert(std::make_pair(name, id));
+        return id;
+    }
+
+    void Begin(int event) {
+        if (!tree_enabled_) return;
+        ThreadTree &tree = CurrentTree();
+        int node = tree.Child(tree.current, event);
+        tree.stack.push_back(std::make_pair(node,
+                    std::chrono::steady_clock::now()));
+        tree.current = node;
+    }
+
+    void End() {
+        if (!tree_enabled_) return;
+        ThreadTree &tree = CurrentTree();
+        if (tree.stack.empty()) return;
+        long long time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() -
+                tree.stack.back().second).count();
+        TreeNode &node = tree.nodes.at(tree.stack.back().first);
+        tree.stack.pop_back();
+        node.count++;
+        node.inclusive_time += time;
+        node.histogram.at(HistogramBucket(time))++;
+        tree.nodes.at(node.parent).child_time += time;
+        tree.current = node.parent;
+    }
+
+    // the trees of all threads merged by call path, depth first with the
+    // most expensive children first. Call it while no thread records.
+    std::vector<ProfileStat> TreeReport() {
+        std::lock_guard<std::mutex> lock(tree_mutex_);
+        ThreadTree merged;
+        for (ThreadTree *tree : trees_) {
+            MergeTree(*tree, 0, merged, 0);
+        }
+        std::vector<ProfileStat> report;
+        ReportTree(merged, 0, -1, report);
+        return report;
+    }
+
+    void PrintTree() {
+        for (const ProfileStat &stat : TreeReport()) {
+            std::cout << std::string(2 * stat.depth, ' ') << stat.name <<
+                " count:" << stat.count << " inclusive:" <<
+                stat.inclusive_time / 1e6 << "ms exclusive:" <<
+                stat.exclusive_time / 1e6 << "ms p50:" << stat.p50 / 1e3 <<
+                "us p95:" << stat.p95 / 1e3 << "us p99:" << stat.p99 / 1e3 <<
+                "us" << std::endl;
+        }
+    }
+
+    // call it while no thread records
+    void ResetTree() {
+        std::lock_guard<std::mutex> lock(tree_mutex_);
+        for (ThreadTree *tree : trees_) {
+            tree->Clear();
+        }
+    }
+
+    // keeps the last capacity begins and ends of any thread for
+    // ExportTrace(), 0 stops tracing. Do not call it while events are
+    // recorded.
+    void SetTraceCapacity(int capacity) {
+        tracing_ = false;
+        trace_events_.assign(capacity, TraceEvent());
+        trace_next_ = 0;
+        trace_start_ = std::chrono::steady_clock::now();
+        tracing_ = capacity > 0;
+    }
+
+    bool Tracing() const {
+        return tracing_;
+    }
+
+    // safe to call from several threads
+    void TraceBegin(const std::string &name, const char *category = "") {
+        if (!tracing_) return;
+        RecordTrace(name.c_str(), category, 'B');
+    }
+
+    void TraceEnd(const char *category = "") {
+        if (!tracing_) return;
+        RecordTrace("", category, 'E');
+    }
+
+    // writes the kept events in chrome trace event format, for
+    // chrome://tracing or Perfetto. Ends whose begin was overwritten are
+    // left out. Call it while no thread records.
+    bool ExportTrace(const std::string &path) const {
+        std::ofstream out(path);
+        if (!out) {
+            std::cout << "ExportTrace: can not open " << path << std::endl;
+            return false;
+        }
+        long long count = std::min<long long>(trace_next_,
+                trace_events_.size());
+        long long first = trace_next_ - count;
+        std::vector<int> depths;
+        bool separated = false;
+        out.setf(std::ios::fixed);
+        out.precision(3);
+        out << "{\"traceEvents\":[";
+        for (long long i = first; i < first + count; ++i) {
+            const TraceEvent &event =
+                trace_events_.at(i % trace_events_.size());
+            if (event.thread >= (int)depths.size()) {
+                depths.resize(event.thread + 1, 0);
+            }
+            if (event.phase == 'E') {
+                if (depths.at(event.thread) == 0) continue;
+                depths.at(event.thread)--;
+            } else {
+                depths.at(event.thread)++;
+            }
+            out << (separated ? ",\n" : "\n") << "{\"name\":\"";
+            for (const char *c = event.name; *c != 0; ++c) {
+                if (*c == '"' || *c == '\\') out << '\\';
+                out << *c;
+            }
+            out << "\",\"cat\":\"" << event.category << "\",\"ph\":\"" <<
+                event.phase << "\",\"ts\":" <<
+                event.time_in_nanoseconds / 1000.0 <<
+                ",\"pid\":0,\"tid\":" << event.thread << "}";
+            separated = true;
+        }
+        out << "\n],\"displayTimeUnit\":\"ms\"}" << std::endl;
+        return true;
+    }
+
 private:
     Profiler() = default;
+
+    // latencies in buckets of a quarter of a power of two
+    static const int HISTOGRAM_SIZE = 256;
+
+    struct TreeNode {
+        int event;
+        int parent;
+        std::vector<std::pair<int, int> > children; // event and node
+        long long count = 0;
+        long long inclusive_time = 0;
+        long long child_time = 0;
+        std::vector<long long> histogram;
+
+        TreeNode(int event, int parent) : event(event), parent(parent),
+            histogram(HISTOGRAM_SIZE, 0) {}
+    };
+
+    struct ThreadTree {
+        std::vector<TreeNode> nodes; // nodes[0] is the root
+        std::vector<std::pair<int, std::chrono::steady_clock::time_point> >
+            stack;
+        int current;
+
+        ThreadTree() {
+            Clear();
+        }
+
+        void Clear() {
+            nodes.clear();
+            nodes.push_back(TreeNode(-1, 0));
+            stack.clear();
+            current = 0;
+        }
+
+        int Child(int parent, int event) {
+            for (const std::pair<int, int> &child : nodes.at(parent).children) {
+                if (child.first == event) {
+                    return child.second;
+                }
+            }
+            int node = nodes.size();
+            nodes.push_back(TreeNode(event, parent));
+            nodes.at(parent).children.push_back(std::make_pair(event, node));
+            return node;
+        }
+    };
+
+    // trees are never freed, so that reports survive their threads
+    ThreadTree &CurrentTree() {
+        thread_local ThreadTree *tree = NULL;
+        if (tree == NULL) {
+            tree = new ThreadTree;
+            std::lock_guard<std::mutex> lock(tree_mutex_);
+            trees_.push_back(tree);
+        }
+        return *tree;
+    }
+
+    static int HistogramBucket(long long time) {
+        if (time < 4) {
+            return time < 0 ? 0 : time;
+        }
+        int exponent = 2;
+        while (time >= 8) {
+            time >>= 1;
+            exponent++;
+        }
+        return std::min<int>(exponent * 4 + time - 4, HISTOGRAM_SIZE - 1);
+    }
+
+    static long long BucketMiddle(int bucket) {
+        if (bucket < 4) {
+            return bucket;
+        }
+        int exponent = bucket / 4;
+        long long width = 1LL << (exponent - 2);
+        return (4 + bucket % 4) * width + width / 2;
+    }
+
+    static long long Percentile(const TreeNode &node, double ratio) {
+        long long rank = std::max<long long>(1, node.count * ratio + 0.5);
+        long long sum = 0;
+        for (int i = 0; i < HISTOGRAM_SIZE; ++i) {
+            sum += node.histogram.at(i);
+            if (sum >= rank) {
+                return BucketMiddle(i);
+            }
+        }
+        return 0;
+    }
+
+    static void MergeTree(const ThreadTree &from, int from_node,
+            ThreadTree &to, int to_node) {
+        for (const std::pair<int, int> &child :
+                from.nodes.at(from_node).children) {
+            const TreeNode &source = from.nodes.at(child.second);
+            int target = to.Child(to_node, child.first);
+            TreeNode &node = to.nodes.at(target);
+            node.count += source.count;
+            node.inclusive_time += source.inclusive_time;
+            node.child_time += source.child_time;
+            for (int i = 0; i < HISTOGRAM_SIZE; ++i) {
+                node.histogram.at(i) += source.histogram.at(i);
+            }
+            MergeTree(from, child.second, to, target);
+        }
+    }
+
+    void ReportTree(const ThreadTree &tree, int node, int depth,
+            std::vector<ProfileStat> &report) const {
+        if (node != 0) {
+            const TreeNode &tree_node = tree.nodes.at(node);
+            ProfileStat stat;
+            stat.name = event_names_.at(tree_node.event);
+            stat.depth = depth;
+            stat.count = tree_node.count;
+            stat.inclusive_time = tree_node.inclusive_time;
+            stat.exclusive_time = tree_node.inclusive_time -
+                tree_node.child_time;
+            stat.p50 = Percentile(tree_node, 0.5);
+            stat.p95 = Percentile(tree_node, 0.95);
+            stat.p99 = Percentile(tree_node, 0.99);
+            report.push_back(stat);
+        }
+        std::vector<int> children;
+        for (const std::pair<int, int> &child : tree.nodes.at(node).children) {
+            children.push_back(child.second);
+        }
+        std::sort(children.begin(), children.end(), [&tree](int a, int b) {
+                return tree.nodes.at(a).inclusive_time >
+                    tree.nodes.at(b).inclusive_time;
+                });
+        for (int child : children) {
+            ReportTree(tree, child, depth + 1, report);
+        }
+    }
+
+    static int TraceThread() {
+        static std::atomic<int> next(0);
+        thread_local int thread = next++;
+        return thread;
+    }
+
+    void RecordTrace(const char *name, const char *category, char phase) {
+        long long time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - trace_start_).count();
+        TraceEvent &event =
+            trace_events_[trace_next_++ % trace_events_.size()];
+        strncpy(event.name, name, sizeof(event.name) - 1);
+        event.name[sizeof(event.name) - 1] = 0;
+        event.category = category;
+        event.phase = phase;
+        event.thread = TraceThread();
+        event.time_in_nanoseconds = time;
+    }
+
     std::map<std::string, Event> event_map_;
     std::stack<Elapsed> running_events_;
     Event *root_ = NULL;
     bool enabled_ = false;
+    std::atomic<bool> tracing_{false};
+    bool tree_enabled_ = false;
+    std::mutex tree_mutex_;
+    std::vector<ThreadTree*> trees_;
+    std::vector<std::string> event_names_;
+    std::unordered_map<std::string, int> event_ids_;
+    std::vector<TraceEvent> trace_events_;
+    std::atomic<long long> trace_next_{0};
+    std::chrono::steady_clock::time_point trace_start_;
+};
+
+// Begin() and End() of a scope
+class ProfileScope {
+public:
+    explicit ProfileScope(int event) {
+        Profiler::Ins().Begin(event);
+    }
+
+    ~ProfileScope() {
+        Profiler::Ins().End();
+    }
 };
 
 }
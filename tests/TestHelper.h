@@ -0,0 +1,48 @@
+#ifndef N3LDG_TEST_HELPER_H
+#define N3LDG_TEST_HELPER_H
+
+/*
+*  TestHelper.h:
+*  checks for the tests, every test is an executable which fails when one
+*  of its checks failed.
+*/
+
+#include <cmath>
+#include <iostream>
+#include "MyLib.h"
+
+int &FailureCount() {
+    static int count = 0;
+    return count;
+}
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::cout << __FILE__ << ":" << __LINE__ << ": check failed: " << \
+                #condition << std::endl; \
+            FailureCount()++; \
+        } \
+    } while (0)
+
+bool Near(const dtype *a, const dtype *b, int size, dtype tolerance = 1e-5) {
+    for (int i = 0; i < size; ++i) {
+        if (std::fabs(a[i] - b[i]) > tolerance * (1 + std::fabs(b[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#define CHECK_NEAR(a, b, size) CHECK(Near(a, b, size))
+
+int TestResult() {
+    if (FailureCount() == 0) {
+        std::cout << "passed" << std::endl;
+        return 0;
+    }
+    std::cout << FailureCount() << " checks failed" << std::endl;
+    return 1;
+}
+
+#endif
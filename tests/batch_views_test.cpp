@@ -0,0 +1,244 @@
+#include "N3LDG.h"
+#include "TestHelper.h"
+
+// nodes must not view the rows of pooled execs after clearValue(), which
+// may free them when the execs are reused for a larger batch
+void TestViewsReleasedBeforePooling() {
+    UniParams params;
+    params.initial(4, 3);
+    BucketNode inputs[5];
+    UniNode nodes[5];
+    for (int i = 0; i < 5; ++i) {
+        inputs[i].init(3, -1);
+        nodes[i].setParam(&params);
+        nodes[i].init(4, -1);
+    }
+
+    Graph graph;
+    graph.setBatchViewsEnabled(true);
+    // trains nodes[begin, end) or evaluates them
+    auto run = [&](int begin, int end, bool train) {
+        graph.clearValue(train);
+        for (int i = begin; i < end; ++i) {
+            inputs[i].forward(&graph, 0.1 * (i + 1));
+            nodes[i].forward(&graph, &inputs[i]);
+        }
+        graph.compute();
+        if (train) {
+            for (int i = begin; i < end; ++i) {
+                nodes[i].loss = 1;
+            }
+            graph.backward();
+        }
+    };
+
+    run(0, 1, true);
+    run(1, 5, true);
+    run(0, 1, false);
+    graph.clearValue(true);
+    for (int i = 0; i < 5; ++i) {
+        CHECK(!nodes[i].val.isView());
+        CHECK(!nodes[i].loss.isView());
+    }
+}
+
+const int N = 6;
+const int IN_DIM = 3;
+const int DIM = 4;
+
+struct Model {
+    UniParams uni, linear;
+    BiParams bi;
+    TriParams tri;
+    FourParams four;
+
+    Model() {
+        uni.initial(DIM, IN_DIM);
+        linear.initial(DIM, IN_DIM, false);
+        bi.initial(DIM, DIM, DIM);
+        tri.initial(DIM, DIM, DIM, DIM);
+        four.initial(DIM, DIM, DIM, DIM, DIM);
+    }
+
+    vector<Param*> params() {
+        return {&uni.W, &uni.b, &linear.W, &bi.W1, &bi.W2, &bi.b,
+            &tri.W1, &tri.W2, &tri.W3, &tri.b,
+            &four.W1, &four.W2, &four.W3, &four.W4, &four.b};
+    }
+};
+
+// TriNode computes into buffers of its execute only
+class TriTestNode : public TriNode {
+  public:
+    Tensor1D ty, lty;
+
+    inline void init(int ndim, dtype dropout) {
+        TriNode::init(ndim, dropout);
+        ty.init(ndim);
+        lty.init(ndim);
+    }
+
+    inline void compute() {
+        TriNode::compute(ty);
+    }
+
+    inline void backward() {
+        TriNode::backward(ty, lty);
+    }
+};
+
+// one batch per op, the bi, tri and four nodes read rows of the batches
+// below them out of order
+struct Network {
+    BucketNode x[N];
+    UniNode uni[N];
+    LinearNode linear[N];
+    BiNode bi[N];
+    TriTestNode tri[N];
+    FourNode four[N];
+
+    void init(Model &model) {
+        for (int i = 0; i < N; ++i) {
+            x[i].init(IN_DIM, -1);
+            uni[i].setParam(&model.uni);
+            uni[i].init(DIM, 0.3);
+            linear[i].setParam(&model.linear);
+            linear[i].init(DIM, -1);
+            bi[i].setParam(&model.bi);
+            bi[i].init(DIM, 0.3);
+            tri[i].setParam(&model.tri);
+            tri[i].init(DIM, 0.2);
+            four[i].setParam(&model.four);
+            four[i].init(DIM, 0.2);
+        }
+    }
+
+    void forward(Graph *cg) {
+        for (int i = 0; i < N; ++i) {
+            for (int j = 0; j < IN_DIM; ++j) {
+                x[i].val[j] = 0.3 * std::sin(1.0 + i * IN_DIM + j);
+            }
+            x[i].forward(cg);
+        }
+        for (int i = 0; i < N; ++i) {
+            uni[i].forward(cg, &x[i]);
+            linear[i].forward(cg, &x[N - 1 - i]);
+        }
+        for (int i = 0; i < N; ++i) {
+            bi[i].forward(cg, &uni[N - 1 - i], &linear[(i + 2) % N]);
+        }
+        for (int i = 0; i < N; ++i) {
+            tri[i].forward(cg, &bi[(i + 3) % N], &uni[i], &linear[i]);
+        }
+        for (int i = 0; i < N; ++i) {
+            four[i].forward(cg, &tri[N - 1 - i], &bi[i], &uni[(2 * i) % N],
+                    &linear[(i + 1) % N]);
+        }
+    }
+
+    // computing nodes in topological order
+    vector<PNode> nodes() {
+        vector<PNode> result;
+        for (int i = 0; i < N; ++i) result.push_back(&uni[i]);
+        for (int i = 0; i < N; ++i) result.push_back(&linear[i]);
+        for (int i = 0; i < N; ++i) result.push_back(&bi[i]);
+        for (int i = 0; i < N; ++i) result.push_back(&tri[i]);
+        for (int i = 0; i < N; ++i) result.push_back(&four[i]);
+        return result;
+    }
+};
+
+struct Outputs {
+    vector<vector<dtype> > vals, masks, input_losses, grads;
+};
+
+// trains the network with the graph, or node by node with the masks the
+// graph drew when masks is given
+Outputs Train(Model &model, bool views, const Outputs *masks) {
+    Network network;
+    network.init(model);
+    vector<PNode> nodes = network.nodes();
+    for (Param *param : model.params()) {
+        param->clearGrad();
+    }
+
+    Graph graph;
+    graph.setBatchViewsEnabled(views);
+    graph.clearValue(true);
+    network.forward(&graph);
+    if (masks == NULL) {
+        graph.compute();
+    } else {
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            std::copy(masks->masks[i].begin(), masks->masks[i].end(),
+                    nodes[i]->drop_mask.v);
+            nodes[i]->compute();
+            nodes[i]->apply_drop(true, 1.0);
+        }
+    }
+
+    Outputs outputs;
+    for (PNode node : nodes) {
+        outputs.vals.emplace_back(node->val.v, node->val.v + DIM);
+        outputs.masks.emplace_back(node->drop_mask.v,
+                node->drop_mask.v + DIM);
+    }
+    for (int i = 0; i < N; ++i) {
+        for (int j = 0; j < DIM; ++j) {
+            network.four[i].loss[j] = 0.1 * std::cos(2.0 + i * DIM + j);
+        }
+    }
+    if (masks == NULL) {
+        graph.backward();
+    } else {
+        for (int i = nodes.size() - 1; i >= 0; --i) {
+            nodes[i]->backward_drop();
+            nodes[i]->backward();
+        }
+    }
+    for (int i = 0; i < N; ++i) {
+        outputs.input_losses.emplace_back(network.x[i].loss.v,
+                network.x[i].loss.v + IN_DIM);
+    }
+    for (Param *param : model.params()) {
+        outputs.grads.emplace_back(param->grad.v,
+                param->grad.v + param->grad.size);
+    }
+    graph.clearValue(true);
+    return outputs;
+}
+
+void CheckSame(const vector<vector<dtype> > &a,
+        const vector<vector<dtype> > &b) {
+    CHECK(a.size() == b.size());
+    for (size_t i = 0; i < a.size() && i < b.size(); ++i) {
+        CHECK(a[i].size() == b[i].size());
+        CHECK_NEAR(a[i].data(), b[i].data(), a[i].size());
+    }
+}
+
+void CheckSame(const Outputs &a, const Outputs &b) {
+    CheckSame(a.vals, b.vals);
+    CheckSame(a.input_losses, b.input_losses);
+    CheckSame(a.grads, b.grads);
+}
+
+// the count x dim rows of the batched executes give the values and
+// gradients of computing the nodes one by one, with views on or off
+void TestViewsMatchPerNode() {
+    Model model;
+    Dropout::Ins().Seed(7);
+    Outputs off = Train(model, false, NULL);
+    Dropout::Ins().Seed(7);
+    Outputs on = Train(model, true, NULL);
+    CheckSame(on.masks, off.masks);
+    CheckSame(on, off);
+    CheckSame(off, Train(model, false, &off));
+    CheckSame(on, Train(model, true, &on));
+}
+
+int main() {
+    TestViewsReleasedBeforePooling();
+    TestViewsMatchPerNode();
+    return TestResult();
+}
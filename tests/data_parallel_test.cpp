@@ -0,0 +1,219 @@
+#include "N3LDG.h"
+#include "DataParallel.h"
+#include "TestHelper.h"
+
+// replicas trained on shards of a minibatch against one model trained on
+// all of it
+
+const int BATCH = 8;
+const int WORKERS = 2;
+const int VOCAB = 10;
+const int EMB = 8;
+const int HIDDEN = 128;
+const int OUT = 160;
+
+struct Model {
+    LookupTable words;
+    APParams features;
+    BiParams pair;
+    UniParams up, down;
+
+    // down.W is large enough to be reduced in several chunks
+    void init(PAlphabet word_alpha, PAlphabet feature_alpha) {
+        words.initial(word_alpha, EMB);
+        features.initial(feature_alpha, EMB);
+        pair.initial(EMB, EMB, EMB);
+        up.initial(HIDDEN, EMB);
+        down.initial(OUT, HIDDEN);
+    }
+
+    void exportAdaParams(ModelUpdate &ada) {
+        words.exportAdaParams(ada);
+        features.exportAdaParams(ada);
+        pair.exportAdaParams(ada);
+        up.exportAdaParams(ada);
+        down.exportAdaParams(ada);
+    }
+};
+
+// two looked up words are paired and widened, the features of the
+// instance are a second output
+struct Network {
+    LookupNode word[2];
+    APNode features;
+    BiNode pair;
+    UniNode up, down;
+
+    void init(Model &model) {
+        for (int i = 0; i < 2; ++i) {
+            word[i].setParam(&model.words);
+            word[i].init(EMB, -1);
+        }
+        features.setParam(&model.features);
+        features.init(EMB, -1);
+        pair.setParam(&model.pair);
+        pair.init(EMB, -1);
+        up.setParam(&model.up);
+        up.init(HIDDEN, -1);
+        down.setParam(&model.down);
+        down.init(OUT, -1);
+    }
+
+    void forward(Graph *cg, int instance) {
+        word[0].forward(cg, std::to_string(instance % VOCAB));
+        word[1].forward(cg, std::to_string((3 * instance + 1) % VOCAB));
+        features.forward(cg, {std::to_string(instance % 3),
+                std::to_string(5 + instance % 2)});
+        pair.forward(cg, &word[0], &word[1]);
+        up.forward(cg, &pair);
+        down.forward(cg, &up);
+    }
+
+    void setLosses(int instance) {
+        for (int j = 0; j < OUT; ++j) {
+            down.loss[j] = 0.01 * std::cos(1.0 + instance * OUT + j);
+        }
+        for (int j = 0; j < EMB; ++j) {
+            features.loss[j] = 0.1 * std::sin(2.0 + instance * EMB + j);
+        }
+    }
+};
+
+// trains instances [begin, end) of the minibatch on graph
+void Train(Graph &graph, Model &model, Network *networks, int begin,
+        int end) {
+    for (int instance = begin; instance < end; ++instance) {
+        networks[instance].init(model);
+    }
+    graph.clearValue(true);
+    for (int instance = begin; instance < end; ++instance) {
+        networks[instance].forward(&graph, instance);
+    }
+    graph.compute();
+    for (int instance = begin; instance < end; ++instance) {
+        networks[instance].setLosses(instance);
+    }
+    graph.backward();
+}
+
+vector<vector<dtype> > Grads(const vector<BaseParam*> &params) {
+    vector<vector<dtype> > grads;
+    for (BaseParam *param : params) {
+        grads.emplace_back(param->grad.v, param->grad.v + param->grad.size);
+    }
+    return grads;
+}
+
+// the rows of the sparse params updates will visit
+vector<vector<bool> > TouchedRows(Model &model) {
+    vector<vector<bool> > rows;
+    for (NRVec<bool> *indexers : {&model.words.E.indexers,
+            &model.features.W.indexers}) {
+        rows.emplace_back();
+        for (int row = 0; row < indexers->size(); ++row) {
+            rows.back().push_back((*indexers)[row]);
+        }
+    }
+    return rows;
+}
+
+bool Cleared(const vector<BaseParam*> &params) {
+    for (BaseParam *param : params) {
+        for (int i = 0; i < param->grad.size; ++i) {
+            if (param->grad.v[i] != 0) {
+                return false;
+            }
+        }
+        SparseParam *sparse = dynamic_cast<SparseParam*>(param);
+        if (sparse != NULL && !sparse->touched_rows.empty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct Fixture {
+    Alphabet word_alpha, feature_alpha;
+    Model master, replicas[WORKERS];
+    ModelUpdate master_update, replica_updates[WORKERS];
+    DataParallelTrainer trainer;
+
+    Fixture() {
+        for (int i = 0; i < VOCAB; ++i) {
+            word_alpha.from_string(std::to_string(i));
+            feature_alpha.from_string(std::to_string(i));
+        }
+        word_alpha.set_fixed_flag(true);
+        feature_alpha.set_fixed_flag(true);
+        master.init(&word_alpha, &feature_alpha);
+        master.exportAdaParams(master_update);
+        vector<vector<BaseParam*> > replica_params;
+        for (int worker = 0; worker < WORKERS; ++worker) {
+            replicas[worker].init(&word_alpha, &feature_alpha);
+            replicas[worker].exportAdaParams(replica_updates[worker]);
+            replica_params.push_back(replica_updates[worker]._params);
+        }
+        trainer.init(master_update._params, replica_params);
+    }
+};
+
+void TestReduceMatchesWholeBatch() {
+    Fixture fixture;
+    Graph graph;
+    Network networks[BATCH];
+    Train(graph, fixture.master, networks, 0, BATCH);
+    vector<vector<dtype> > expected = Grads(fixture.master_update._params);
+    vector<vector<bool> > expected_rows = TouchedRows(fixture.master);
+    fixture.master_update.clearGrad();
+
+    Graph graphs[WORKERS];
+    Network shards[BATCH];
+    fixture.trainer.run(BATCH, [&](int worker, int begin, int end) {
+            Train(graphs[worker], fixture.replicas[worker], shards, begin,
+                end);
+            });
+    for (int worker = 0; worker < WORKERS; ++worker) {
+        CHECK(!Cleared(fixture.replica_updates[worker]._params));
+    }
+    fixture.trainer.reduce();
+
+    vector<vector<dtype> > grads = Grads(fixture.master_update._params);
+    CHECK(grads.size() == expected.size());
+    for (size_t i = 0; i < grads.size() && i < expected.size(); ++i) {
+        CHECK_NEAR(grads[i].data(), expected[i].data(), grads[i].size());
+    }
+    CHECK(TouchedRows(fixture.master) == expected_rows);
+    for (int worker = 0; worker < WORKERS; ++worker) {
+        CHECK(Cleared(fixture.replica_updates[worker]._params));
+    }
+}
+
+// the lookup rows are applied to the master by the workers, so neither the
+// replicas nor the master keep their grads, the dense grads wait for reduce()
+void TestAsyncUpdateClearsSparseGrads() {
+    Fixture fixture;
+    vector<dtype> vals(fixture.master.words.E.val.v,
+            fixture.master.words.E.val.v + fixture.master.words.E.val.size);
+    Graph graphs[WORKERS];
+    Network shards[BATCH];
+    fixture.trainer.run(BATCH, [&](int worker, int begin, int end) {
+            Train(graphs[worker], fixture.replicas[worker], shards, begin,
+                end);
+            fixture.trainer.asyncUpdateAdagrad(worker, fixture.master_update);
+            });
+
+    SparseParam &master = fixture.master.words.E;
+    CHECK(vals != vector<dtype>(master.val.v, master.val.v + master.val.size));
+    CHECK(Cleared({&master}));
+    for (int worker = 0; worker < WORKERS; ++worker) {
+        Model &replica = fixture.replicas[worker];
+        CHECK(Cleared({&replica.words.E}));
+        CHECK(!Cleared({&replica.down.W}));
+    }
+}
+
+int main() {
+    TestReduceMatchesWholeBatch();
+    TestAsyncUpdateClearsSparseGrads();
+    return TestResult();
+}
@@ -0,0 +1,141 @@
+#include <map>
+#include "N3LDG.h"
+#include "TestHelper.h"
+
+// instances built on pool threads through staging slots against the same
+// instances built on one thread
+
+const int N = 12;
+const int IN_DIM = 3;
+const int DIM = 4;
+
+struct Model {
+    UniParams uni, linear;
+    BiParams pair;
+
+    Model() {
+        uni.initial(DIM, IN_DIM);
+        linear.initial(DIM, IN_DIM);
+        pair.initial(DIM, DIM, DIM);
+    }
+};
+
+struct Instance {
+    BucketNode x[2];
+    UniNode uni;
+    LinearNode linear;
+    BiNode pair;
+
+    void init(Model &model) {
+        for (int i = 0; i < 2; ++i) {
+            x[i].init(IN_DIM, -1);
+        }
+        uni.setParam(&model.uni);
+        uni.init(DIM, -1);
+        linear.setParam(&model.linear);
+        linear.init(DIM, -1);
+        pair.setParam(&model.pair);
+        pair.init(DIM, -1);
+    }
+
+    void forward(Graph *cg, int instance) {
+        for (int i = 0; i < 2; ++i) {
+            for (int j = 0; j < IN_DIM; ++j) {
+                x[i].val[j] = 0.3 * std::sin(1.0 + (2 * instance + i) *
+                        IN_DIM + j);
+            }
+            x[i].forward(cg);
+        }
+        uni.forward(cg, &x[0]);
+        linear.forward(cg, &x[1]);
+        pair.forward(cg, &uni, &linear);
+    }
+
+    vector<PNode> members() {
+        return {&x[0], &x[1], &uni, &linear, &pair};
+    }
+};
+
+class OrderGraph : public Graph {
+  public:
+    // every node as instance * 5 + its place among the instance members
+    vector<int> order(Instance *instances) const {
+        std::map<PNode, int> labels;
+        for (int instance = 0; instance < N; ++instance) {
+            vector<PNode> members = instances[instance].members();
+            for (size_t m = 0; m < members.size(); ++m) {
+                labels[members.at(m)] = instance * members.size() + m;
+            }
+        }
+        vector<int> result;
+        for (PNode p : nodes) {
+            result.push_back(labels.count(p) > 0 ? labels.at(p) : -1);
+        }
+        return result;
+    }
+};
+
+void Build(Graph &graph, Instance *instances) {
+    for (int instance = 0; instance < N; ++instance) {
+        instances[instance].forward(&graph, instance);
+    }
+}
+
+// builder threads stage every instance in its own slot
+void BuildStaged(Graph &graph, Instance *instances) {
+    ThreadPool::Ins().Run(N, [&](int instance) {
+            GraphStagingScope scope(graph, instance);
+            instances[instance].forward(&graph, instance);
+            });
+}
+
+void CheckSame(Instance *a, Instance *b) {
+    for (int instance = 0; instance < N; ++instance) {
+        vector<PNode> members = a[instance].members();
+        vector<PNode> other = b[instance].members();
+        for (size_t m = 0; m < members.size(); ++m) {
+            CHECK_NEAR(members.at(m)->val.v, other.at(m)->val.v,
+                    members.at(m)->dim);
+        }
+    }
+}
+
+// the second staged minibatch is built before the graph of the first one is
+// cleared
+void TestStagedBuildMatchesSerial() {
+    Model model;
+    Instance serial[N], first[N], second[N];
+    for (int instance = 0; instance < N; ++instance) {
+        serial[instance].init(model);
+        first[instance].init(model);
+        second[instance].init(model);
+    }
+
+    OrderGraph graph;
+    graph.clearValue(false);
+    Build(graph, serial);
+    vector<int> expected = graph.order(serial);
+    graph.compute();
+
+    OrderGraph staged;
+    staged.clearValue(false);
+    BuildStaged(staged, first);
+    CHECK(staged.order(first).empty());
+    staged.mergeStaged();
+    CHECK(staged.order(first) == expected);
+    staged.compute();
+    CheckSame(first, serial);
+
+    BuildStaged(staged, second);
+    staged.clearValue(false);
+    staged.mergeStaged();
+    CHECK(staged.order(second) == expected);
+    staged.compute();
+    CheckSame(second, serial);
+}
+
+int main() {
+    ThreadPool::Ins().SetThreadCount(4);
+    TestStagedBuildMatchesSerial();
+    return TestResult();
+}
@@ -0,0 +1,260 @@
+#include "N3LDG.h"
+#include "LSTM2.h"
+#include "TestHelper.h"
+
+// the fused steps of LSTM1Builder and LSTM2Builder against the unfused
+// graphs of gate, filter and cell nodes their gpu builds add
+
+const int STEPS = 5;
+const int IN_DIM = 3;
+const int OUT_DIM = 4;
+
+struct UnfusedLSTM1 {
+    BiNode inputgates[STEPS], forgetgates[STEPS], halfcells[STEPS],
+           outputgates[STEPS];
+    PMultiNode inputfilters[STEPS], forgetfilters[STEPS], hiddens[STEPS];
+    PAddNode cells[STEPS];
+    TanhNode halfhiddens[STEPS];
+    BucketNode bucket;
+
+    void init(LSTM1Params &params) {
+        for (int i = 0; i < STEPS; ++i) {
+            inputgates[i].setParam(&params.input);
+            forgetgates[i].setParam(&params.forget);
+            outputgates[i].setParam(&params.output);
+            halfcells[i].setParam(&params.cell);
+            inputgates[i].setFunctions(&fsigmoid, &dsigmoid);
+            forgetgates[i].setFunctions(&fsigmoid, &dsigmoid);
+            outputgates[i].setFunctions(&fsigmoid, &dsigmoid);
+            halfcells[i].setFunctions(&ftanh, &dtanh);
+            inputgates[i].init(OUT_DIM, -1);
+            forgetgates[i].init(OUT_DIM, -1);
+            outputgates[i].init(OUT_DIM, -1);
+            halfcells[i].init(OUT_DIM, -1);
+            inputfilters[i].init(OUT_DIM, -1);
+            forgetfilters[i].init(OUT_DIM, -1);
+            hiddens[i].init(OUT_DIM, -1);
+            cells[i].init(OUT_DIM, -1);
+            halfhiddens[i].init(OUT_DIM, -1);
+        }
+        bucket.init(OUT_DIM, -1);
+    }
+
+    void forward(Graph *cg, BucketNode *x, bool left2right) {
+        bucket.forward(cg, 0);
+        for (int step = 0; step < STEPS; ++step) {
+            int i = left2right ? step : STEPS - 1 - step;
+            int last = left2right ? i - 1 : i + 1;
+            PNode h = step == 0 ? (PNode)&bucket : (PNode)&hiddens[last];
+            inputgates[i].forward(cg, h, &x[i]);
+            halfcells[i].forward(cg, h, &x[i]);
+            outputgates[i].forward(cg, h, &x[i]);
+            inputfilters[i].forward(cg, &halfcells[i], &inputgates[i]);
+            if (step == 0) {
+                cells[i].forward(cg, &inputfilters[i], &bucket);
+            } else {
+                forgetgates[i].forward(cg, h, &x[i]);
+                forgetfilters[i].forward(cg, &cells[last], &forgetgates[i]);
+                cells[i].forward(cg, &inputfilters[i], &forgetfilters[i]);
+            }
+            halfhiddens[i].forward(cg, &cells[i]);
+            hiddens[i].forward(cg, &halfhiddens[i], &outputgates[i]);
+        }
+    }
+};
+
+// every gate half is a linear uni with its bias, as the gpu linear nodes
+// add it
+struct UnfusedLSTM2 {
+    UniNode inputgates_hidden[STEPS], inputgates_input[STEPS],
+            forgetgates_hidden[STEPS], forgetgates_input[STEPS],
+            halfcells_hidden[STEPS], halfcells_input[STEPS],
+            outputgates_hidden[STEPS], outputgates_input[STEPS];
+    PAddNode inputgates_add[STEPS], forgetgates_add[STEPS],
+             halfcells_add[STEPS], outputgates_add[STEPS], cells[STEPS];
+    SigmoidNode inputgates[STEPS], forgetgates[STEPS], outputgates[STEPS];
+    TanhNode halfcells[STEPS], halfhiddens[STEPS];
+    PMultiNode inputfilters[STEPS], forgetfilters[STEPS], hiddens[STEPS];
+    BucketNode bucket;
+
+    void init(LSTM2Params &params) {
+        for (int i = 0; i < STEPS; ++i) {
+            inputgates_hidden[i].setParam(&params.input_hidden);
+            inputgates_input[i].setParam(&params.input_input);
+            forgetgates_hidden[i].setParam(&params.forget_hidden);
+            forgetgates_input[i].setParam(&params.forget_input);
+            halfcells_hidden[i].setParam(&params.cell_hidden);
+            halfcells_input[i].setParam(&params.cell_input);
+            outputgates_hidden[i].setParam(&params.output_hidden);
+            outputgates_input[i].setParam(&params.output_input);
+            for (UniNode *half : {&inputgates_hidden[i], &inputgates_input[i],
+                    &forgetgates_hidden[i], &forgetgates_input[i],
+                    &halfcells_hidden[i], &halfcells_input[i],
+                    &outputgates_hidden[i], &outputgates_input[i]}) {
+                half->setFunctions(&fequal, &dequal);
+                half->init(OUT_DIM, -1);
+            }
+            for (PNode node : vector<PNode>{&inputgates_add[i],
+                    &forgetgates_add[i], &halfcells_add[i],
+                    &outputgates_add[i], &cells[i], &inputgates[i],
+                    &forgetgates[i], &outputgates[i], &halfcells[i],
+                    &halfhiddens[i], &inputfilters[i], &forgetfilters[i],
+                    &hiddens[i]}) {
+                node->init(OUT_DIM, -1);
+            }
+        }
+        bucket.init(OUT_DIM, -1);
+    }
+
+    void forward(Graph *cg, BucketNode *x, bool left2right) {
+        bucket.forward(cg, 0);
+        for (int step = 0; step < STEPS; ++step) {
+            int i = left2right ? step : STEPS - 1 - step;
+            int last = left2right ? i - 1 : i + 1;
+            PNode h = step == 0 ? (PNode)&bucket : (PNode)&hiddens[last];
+            inputgates_hidden[i].forward(cg, h);
+            inputgates_input[i].forward(cg, &x[i]);
+            inputgates_add[i].forward(cg, &inputgates_hidden[i],
+                    &inputgates_input[i]);
+            inputgates[i].forward(cg, &inputgates_add[i]);
+            outputgates_hidden[i].forward(cg, h);
+            outputgates_input[i].forward(cg, &x[i]);
+            outputgates_add[i].forward(cg, &outputgates_hidden[i],
+                    &outputgates_input[i]);
+            outputgates[i].forward(cg, &outputgates_add[i]);
+            halfcells_hidden[i].forward(cg, h);
+            halfcells_input[i].forward(cg, &x[i]);
+            halfcells_add[i].forward(cg, &halfcells_hidden[i],
+                    &halfcells_input[i]);
+            halfcells[i].forward(cg, &halfcells_add[i]);
+            inputfilters[i].forward(cg, &halfcells[i], &inputgates[i]);
+            if (step == 0) {
+                cells[i].forward(cg, &inputfilters[i], &bucket);
+            } else {
+                forgetgates_hidden[i].forward(cg, h);
+                forgetgates_input[i].forward(cg, &x[i]);
+                forgetgates_add[i].forward(cg, &forgetgates_hidden[i],
+                        &forgetgates_input[i]);
+                forgetgates[i].forward(cg, &forgetgates_add[i]);
+                forgetfilters[i].forward(cg, &cells[last], &forgetgates[i]);
+                cells[i].forward(cg, &inputfilters[i], &forgetfilters[i]);
+            }
+            halfhiddens[i].forward(cg, &cells[i]);
+            hiddens[i].forward(cg, &halfhiddens[i], &outputgates[i]);
+        }
+    }
+};
+
+struct Result {
+    vector<vector<dtype> > hiddens, cells, input_losses, grads;
+};
+
+vector<Param*> GateParams(LSTM1Params &params) {
+    return {&params.input.W1, &params.input.W2, &params.input.b,
+        &params.output.W1, &params.output.W2, &params.output.b,
+        &params.forget.W1, &params.forget.W2, &params.forget.b,
+        &params.cell.W1, &params.cell.W2, &params.cell.b};
+}
+
+vector<Param*> GateParams(LSTM2Params &params) {
+    vector<Param*> result;
+    for (UniParams *half : {&params.input_hidden, &params.input_input,
+            &params.output_hidden, &params.output_input,
+            &params.forget_hidden, &params.forget_input, &params.cell_hidden,
+            &params.cell_input}) {
+        result.push_back(&half->W);
+        result.push_back(&half->b);
+    }
+    return result;
+}
+
+// builds either graph over the same inputs and losses
+template<typename Params, typename Builder, typename Unfused>
+Result Run(Params &params, bool fused, bool left2right, int segment) {
+    BucketNode x[STEPS];
+    Builder builder;
+    Unfused unfused;
+    vector<PNode> inputs;
+    for (int i = 0; i < STEPS; ++i) {
+        x[i].init(IN_DIM, -1);
+        inputs.push_back(&x[i]);
+    }
+    builder.resize(STEPS);
+    builder.setCheckpointSegment(segment);
+    builder.init(&params, -1, left2right);
+    unfused.init(params);
+    for (Param *param : GateParams(params)) {
+        param->clearGrad();
+    }
+
+    Graph graph;
+    graph.clearValue(true);
+    for (int i = 0; i < STEPS; ++i) {
+        for (int j = 0; j < IN_DIM; ++j) {
+            x[i].val[j] = 0.3 * std::sin(1.0 + i * IN_DIM + j);
+        }
+        x[i].forward(&graph);
+    }
+    if (fused) {
+        builder.forward(&graph, inputs);
+    } else {
+        unfused.forward(&graph, x, left2right);
+    }
+    graph.compute();
+
+    Result result;
+    for (int i = 0; i < STEPS; ++i) {
+        PNode hidden = fused ? builder.hidden(i) : &unfused.hiddens[i];
+        result.hiddens.emplace_back(hidden->val.v, hidden->val.v + OUT_DIM);
+        const Tensor1D &cell = fused ? builder.cell(i) : unfused.cells[i].val;
+        result.cells.emplace_back(cell.v, cell.v + OUT_DIM);
+        for (int j = 0; j < OUT_DIM; ++j) {
+            hidden->loss[j] = 0.1 * std::cos(2.0 + i * OUT_DIM + j);
+        }
+    }
+    graph.backward();
+    for (int i = 0; i < STEPS; ++i) {
+        result.input_losses.emplace_back(x[i].loss.v, x[i].loss.v + IN_DIM);
+    }
+    for (Param *param : GateParams(params)) {
+        result.grads.emplace_back(param->grad.v,
+                param->grad.v + param->grad.size);
+    }
+    return result;
+}
+
+void CheckSame(const vector<vector<dtype> > &a,
+        const vector<vector<dtype> > &b) {
+    CHECK(a.size() == b.size());
+    for (size_t i = 0; i < a.size() && i < b.size(); ++i) {
+        CHECK(a[i].size() == b[i].size());
+        CHECK_NEAR(a[i].data(), b[i].data(), a[i].size());
+    }
+}
+
+template<typename Params, typename Builder, typename Unfused>
+void TestFusedMatchesUnfused(bool left2right, int segment) {
+    Params params;
+    params.initial(OUT_DIM, IN_DIM);
+    Result fused = Run<Params, Builder, Unfused>(params, true, left2right,
+            segment);
+    Result unfused = Run<Params, Builder, Unfused>(params, false, left2right,
+            segment);
+    CheckSame(fused.hiddens, unfused.hiddens);
+    if (segment == 0) {
+        CheckSame(fused.cells, unfused.cells);
+    }
+    CheckSame(fused.input_losses, unfused.input_losses);
+    CheckSame(fused.grads, unfused.grads);
+}
+
+int main() {
+    TestFusedMatchesUnfused<LSTM1Params, LSTM1Builder, UnfusedLSTM1>(true, 0);
+    TestFusedMatchesUnfused<LSTM1Params, LSTM1Builder, UnfusedLSTM1>(false, 0);
+    TestFusedMatchesUnfused<LSTM1Params, LSTM1Builder, UnfusedLSTM1>(true, 2);
+    TestFusedMatchesUnfused<LSTM2Params, LSTM2Builder, UnfusedLSTM2>(true, 0);
+    TestFusedMatchesUnfused<LSTM2Params, LSTM2Builder, UnfusedLSTM2>(false, 0);
+    TestFusedMatchesUnfused<LSTM2Params, LSTM2Builder, UnfusedLSTM2>(true, 2);
+    TestFusedMatchesUnfused<LSTM2Params, LSTM2Builder, UnfusedLSTM2>(false, 3);
+    return TestResult();
+}
@@ -0,0 +1,162 @@
+#include <csignal>
+#include <cstdio>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "N3LDG.h"
+#include "TestHelper.h"
+
+// inference with the vals of consumed nodes sharing buffers against
+// inference with a buffer per node
+
+const int N = 5;
+const int DEPTH = 4;
+const int IN_DIM = 3;
+const int DIM = 4;
+
+struct Model {
+    UniParams layers[DEPTH];
+    UniParams skip;
+    BiParams pair;
+
+    Model() {
+        layers[0].initial(DIM, IN_DIM);
+        for (int layer = 1; layer < DEPTH; ++layer) {
+            layers[layer].initial(DIM, DIM);
+        }
+        skip.initial(DIM, IN_DIM);
+        pair.initial(DIM, DIM, DIM);
+    }
+};
+
+// a chain of unis per input whose last layer is paired with the second layer
+// of its neighbour, so the second layer has consumers in two waves. The
+// linear skip nodes are outputs read straight from the inputs.
+struct Network {
+    BucketNode x[N];
+    UniNode chain[DEPTH][N];
+    LinearNode skip[N];
+    BiNode pair[N];
+
+    void init(Model &model) {
+        for (int i = 0; i < N; ++i) {
+            x[i].init(IN_DIM, -1);
+            for (int layer = 0; layer < DEPTH; ++layer) {
+                chain[layer][i].setParam(&model.layers[layer]);
+                chain[layer][i].init(DIM, -1);
+            }
+            skip[i].setParam(&model.skip);
+            skip[i].init(DIM, -1);
+            pair[i].setParam(&model.pair);
+            pair[i].init(DIM, -1);
+        }
+    }
+
+    void forward(Graph *cg) {
+        for (int i = 0; i < N; ++i) {
+            for (int j = 0; j < IN_DIM; ++j) {
+                x[i].val[j] = 0.3 * std::sin(1.0 + i * IN_DIM + j);
+            }
+            x[i].forward(cg);
+            chain[0][i].forward(cg, &x[i]);
+            for (int layer = 1; layer < DEPTH; ++layer) {
+                chain[layer][i].forward(cg, &chain[layer - 1][i]);
+            }
+            skip[i].forward(cg, &x[i]);
+        }
+        for (int i = 0; i < N; ++i) {
+            pair[i].forward(cg, &chain[DEPTH - 1][i], &chain[1][(i + 1) % N]);
+        }
+    }
+
+    vector<PNode> outputs() {
+        vector<PNode> result;
+        for (int i = 0; i < N; ++i) {
+            result.push_back(&skip[i]);
+            result.push_back(&pair[i]);
+        }
+        return result;
+    }
+};
+
+vector<vector<dtype> > Predict(Graph &graph, Network &network) {
+    graph.clearValue(false);
+    network.forward(&graph);
+    graph.compute();
+    vector<vector<dtype> > vals;
+    for (PNode node : network.outputs()) {
+        vals.emplace_back(node->val.v, node->val.v + DIM);
+    }
+    return vals;
+}
+
+void CheckSame(const vector<vector<dtype> > &a,
+        const vector<vector<dtype> > &b) {
+    CHECK(a.size() == b.size());
+    for (size_t i = 0; i < a.size() && i < b.size(); ++i) {
+        CHECK_NEAR(a[i].data(), b[i].data(), DIM);
+    }
+}
+
+// the chains are deep enough that later layers take over the buffers of
+// earlier ones, a second prediction runs on the slots of the first
+void TestPlanMatchesUnplanned(BatchingStrategy strategy, bool batch_views) {
+    Model model;
+    Network network, planned_network;
+    network.init(model);
+    planned_network.init(model);
+
+    Graph graph;
+    graph.setBatchingStrategy(strategy);
+    graph.setBatchViewsEnabled(batch_views);
+    vector<vector<dtype> > expected = Predict(graph, network);
+
+    Graph planned;
+    planned.setBatchingStrategy(strategy);
+    planned.setBatchViewsEnabled(batch_views);
+    planned.setMemoryPlanEnabled(true);
+    for (int round = 0; round < 2; ++round) {
+        CheckSame(Predict(planned, planned_network), expected);
+        int released = 0;
+        for (int i = 0; i < N; ++i) {
+            released += planned_network.chain[0][i].val_released;
+            CHECK(!planned_network.pair[i].val_released);
+        }
+        CHECK(released == N);
+    }
+}
+
+// a released node can not get consumers in a later compute(), addParent()
+// aborts instead of handing them a buffer of other nodes
+void TestLateConsumerOfReleasedNodeAborts() {
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (freopen("/dev/null", "w", stdout) == NULL) {
+            _exit(1);
+        }
+        Model model;
+        Network network;
+        network.init(model);
+        Graph graph;
+        graph.setMemoryPlanEnabled(true);
+        Predict(graph, network);
+        UniNode late;
+        late.setParam(&model.layers[1]);
+        late.init(DIM, -1);
+        late.forward(&graph, &network.chain[0][0]);
+        _exit(0);
+    }
+    int status = 0;
+    CHECK(pid > 0 && waitpid(pid, &status, 0) == pid);
+    CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+}
+
+int main() {
+    for (BatchingStrategy strategy : {WAVEFRONT_BATCHING, DEPTH_BATCHING,
+            AGENDA_BATCHING}) {
+        TestPlanMatchesUnplanned(strategy, false);
+        TestPlanMatchesUnplanned(strategy, true);
+    }
+    TestLateConsumerOfReleasedNodeAborts();
+    return TestResult();
+}
@@ -0,0 +1,329 @@
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include "N3LDG.h"
+#include "TestHelper.h"
+
+// backward of waves whose execs share inputs and params, run on a thread
+// pool against the serial run, and probes of which execs ran at once
+
+const int N = 8;
+const int IN_DIM = 5;
+const int DIM = 6;
+
+struct Model {
+    UniParams hidden, deep;
+    BiParams pair, top;
+
+    Model() {
+        hidden.initial(DIM, IN_DIM);
+        deep.initial(DIM, DIM);
+        pair.initial(DIM, IN_DIM, IN_DIM);
+        top.initial(DIM, DIM, DIM);
+    }
+
+    vector<Param*> params() {
+        return {&hidden.W, &hidden.b, &deep.W, &deep.b, &pair.W1, &pair.W2,
+            &pair.b, &top.W1, &top.W2, &top.b};
+    }
+};
+
+// the first wave holds a tanh and a sigmoid uni, a linear and two bi execs,
+// all reading x and the unis and the linear sharing hidden. In the second
+// wave two bi execs share top.
+struct Network {
+    BucketNode x[N];
+    UniNode uni[N], sigmoid_uni[N], deep[N];
+    LinearNode linear[N];
+    BiNode pair[N], relu_pair[N], top[N], sigmoid_top[N];
+
+    void init(Model &model) {
+        for (int i = 0; i < N; ++i) {
+            x[i].init(IN_DIM, -1);
+            uni[i].setParam(&model.hidden);
+            uni[i].init(DIM, -1);
+            sigmoid_uni[i].setParam(&model.hidden);
+            sigmoid_uni[i].setFunctions(&fsigmoid, &dsigmoid);
+            sigmoid_uni[i].init(DIM, -1);
+            linear[i].setParam(&model.hidden);
+            linear[i].init(DIM, -1);
+            pair[i].setParam(&model.pair);
+            pair[i].init(DIM, -1);
+            relu_pair[i].setParam(&model.pair);
+            relu_pair[i].setFunctions(&frelu, &drelu);
+            relu_pair[i].init(DIM, -1);
+            deep[i].setParam(&model.deep);
+            deep[i].init(DIM, -1);
+            top[i].setParam(&model.top);
+            top[i].init(DIM, -1);
+            sigmoid_top[i].setParam(&model.top);
+            sigmoid_top[i].setFunctions(&fsigmoid, &dsigmoid);
+            sigmoid_top[i].init(DIM, -1);
+        }
+    }
+
+    void forward(Graph *cg) {
+        for (int i = 0; i < N; ++i) {
+            for (int j = 0; j < IN_DIM; ++j) {
+                x[i].val[j] = 0.3 * std::sin(1.0 + i * IN_DIM + j);
+            }
+            x[i].forward(cg);
+        }
+        for (int i = 0; i < N; ++i) {
+            uni[i].forward(cg, &x[i]);
+            sigmoid_uni[i].forward(cg, &x[i]);
+            linear[i].forward(cg, &x[(i + 1) % N]);
+            pair[i].forward(cg, &x[i], &x[(i + 1) % N]);
+            relu_pair[i].forward(cg, &x[(i + 2) % N], &x[i]);
+        }
+        for (int i = 0; i < N; ++i) {
+            deep[i].forward(cg, &relu_pair[i]);
+            top[i].forward(cg, &uni[i], &linear[i]);
+            sigmoid_top[i].forward(cg, &sigmoid_uni[i], &pair[(i + 1) % N]);
+        }
+    }
+
+    // every node but the inputs gets a loss of its own
+    vector<PNode> outputs() {
+        vector<PNode> result;
+        for (int i = 0; i < N; ++i) {
+            result.insert(result.end(), {&uni[i], &sigmoid_uni[i], &linear[i],
+                    &pair[i], &relu_pair[i], &deep[i], &top[i],
+                    &sigmoid_top[i]});
+        }
+        return result;
+    }
+};
+
+struct Outputs {
+    vector<vector<dtype> > vals, grads;
+};
+
+Outputs Train(BatchingStrategy strategy, bool parallel) {
+    Model model;
+    Network network;
+    network.init(model);
+    Graph graph;
+    graph.setBatchingStrategy(strategy);
+    graph.setParallelExecute(parallel);
+    graph.clearValue(true);
+    network.forward(&graph);
+    graph.compute();
+
+    Outputs outputs;
+    int output = 0;
+    for (PNode node : network.outputs()) {
+        outputs.vals.emplace_back(node->val.v, node->val.v + DIM);
+        for (int j = 0; j < DIM; ++j) {
+            node->loss[j] = 0.1 * std::cos(2.0 + output * DIM + j);
+        }
+        output++;
+    }
+    graph.backward();
+    for (Param *param : model.params()) {
+        outputs.grads.emplace_back(param->grad.v,
+                param->grad.v + param->grad.size);
+    }
+    for (int i = 0; i < N; ++i) {
+        outputs.grads.emplace_back(network.x[i].loss.v,
+                network.x[i].loss.v + IN_DIM);
+    }
+    return outputs;
+}
+
+void CheckSame(const vector<vector<dtype> > &a,
+        const vector<vector<dtype> > &b) {
+    CHECK(a.size() == b.size());
+    for (size_t i = 0; i < a.size() && i < b.size(); ++i) {
+        CHECK(a[i].size() == b[i].size());
+        CHECK_NEAR(a[i].data(), b[i].data(), a[i].size());
+    }
+}
+
+// params are drawn from rand(), so both runs start from the same seed
+void TestParallelBackwardMatchesSerial(BatchingStrategy strategy) {
+    srand(1);
+    Outputs serial = Train(strategy, false);
+    srand(1);
+    Outputs parallel = Train(strategy, true);
+    CheckSame(parallel.vals, serial.vals);
+    CheckSame(parallel.grads, serial.grads);
+}
+
+// the keys held by execs whose backward is running
+struct Probe {
+    std::mutex mutex;
+    std::map<const void*, int> busy;
+    int active = 0, max_active = 0, overlaps = 0;
+
+    static Probe &Ins() {
+        static Probe ins;
+        return ins;
+    }
+
+    void enter(const vector<const void*> &keys) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const void *key : keys) {
+            if (busy[key]++ > 0) {
+                overlaps++;
+            }
+        }
+        max_active = std::max(max_active, ++active);
+    }
+
+    void leave(const vector<const void*> &keys) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const void *key : keys) {
+            busy[key]--;
+        }
+        active--;
+    }
+};
+
+// copies its input, node_type tells the execs apart and key stands for the
+// parameters it would update
+class ProbeNode : public Node {
+  public:
+    PNode in;
+    const void *key;
+
+    ProbeNode() : Node() {
+        in = NULL;
+        key = NULL;
+    }
+
+    inline void setKind(const string &kind, const void *param_key) {
+        node_type = "probe-" + kind;
+        key = param_key;
+    }
+
+    inline void clearValue() {
+        Node::clearValue();
+        in = NULL;
+    }
+
+    const void *paramKey() const override {
+        return key;
+    }
+
+    void forward(Graph *cg, PNode x) {
+        in = x;
+        degree = 0;
+        in->addParent(this);
+        cg->addNode(this);
+    }
+
+    inline void compute() {
+        val.vec() = in->val.vec();
+    }
+
+    inline void backward() {
+        in->loss.vec() += loss.vec();
+    }
+
+    inline PExecute generate(bool bTrain, dtype cur_drop_factor);
+};
+
+// holds the input nodes and the key of its batch long enough for every
+// other exec of the wave to start
+class ProbeExecute : public Execute {
+  public:
+    inline void forward() {
+        for (PNode p : batch) {
+            p->compute();
+        }
+    }
+
+    inline void backward() {
+        vector<const void*> keys;
+        for (PNode p : batch) {
+            ProbeNode *probe = static_cast<ProbeNode*>(p);
+            for (const void *key : {(const void*)probe->in, probe->key}) {
+                if (std::find(keys.begin(), keys.end(), key) == keys.end()) {
+                    keys.push_back(key);
+                }
+            }
+        }
+        Probe::Ins().enter(keys);
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        for (PNode p : batch) {
+            p->backward();
+        }
+        Probe::Ins().leave(keys);
+    }
+};
+
+inline PExecute ProbeNode::generate(bool bTrain, dtype cur_drop_factor) {
+    ProbeExecute *exec = new ProbeExecute();
+    exec->batch.push_back(this);
+    exec->bTrain = bTrain;
+    exec->drop_factor = cur_drop_factor;
+    return exec;
+}
+
+// shared and weight probes read the same inputs, shared and other probes
+// share a param, the lone probes conflict with nobody. Agenda batching gives
+// every batch a wave of its own, so only the other strategies are probed.
+void TestConflictingExecsNeverOverlap(BatchingStrategy strategy) {
+    int shared_param, weight_param, lone_param;
+    BucketNode x[N], y[N], z[N];
+    ProbeNode shared[N], other[N], weight[N], lone[N];
+    for (int i = 0; i < N; ++i) {
+        x[i].init(DIM, -1);
+        y[i].init(DIM, -1);
+        z[i].init(DIM, -1);
+        shared[i].setKind("shared", &shared_param);
+        shared[i].init(DIM, -1);
+        other[i].setKind("other", &shared_param);
+        other[i].init(DIM, -1);
+        weight[i].setKind("weight", &weight_param);
+        weight[i].init(DIM, -1);
+        lone[i].setKind("lone", &lone_param);
+        lone[i].init(DIM, -1);
+    }
+
+    Graph graph;
+    graph.setBatchingStrategy(strategy);
+    graph.setParallelExecute(true);
+    graph.clearValue(true);
+    for (int i = 0; i < N; ++i) {
+        x[i].forward(&graph);
+        y[i].forward(&graph);
+        z[i].forward(&graph);
+    }
+    for (int i = 0; i < N; ++i) {
+        shared[i].forward(&graph, &x[i]);
+        other[i].forward(&graph, &y[i]);
+        weight[i].forward(&graph, &x[(i + 1) % N]);
+        lone[i].forward(&graph, &z[i]);
+    }
+    graph.compute();
+    for (int i = 0; i < N; ++i) {
+        for (ProbeNode *node : {&shared[i], &other[i], &weight[i], &lone[i]}) {
+            node->loss.vec().setConstant(1);
+        }
+    }
+
+    Probe &probe = Probe::Ins();
+    probe.max_active = probe.overlaps = 0;
+    graph.backward();
+    CHECK(probe.overlaps == 0);
+    CHECK(probe.max_active > 1);
+    for (int i = 0; i < N; ++i) {
+        CHECK(x[i].loss[0] == 2);
+        CHECK(y[i].loss[0] == 1);
+        CHECK(z[i].loss[0] == 1);
+    }
+}
+
+int main() {
+    ThreadPool::Ins().SetThreadCount(4);
+    for (int round = 0; round < 20; ++round) {
+        TestParallelBackwardMatchesSerial(WAVEFRONT_BATCHING);
+        TestParallelBackwardMatchesSerial(DEPTH_BATCHING);
+        TestParallelBackwardMatchesSerial(AGENDA_BATCHING);
+    }
+    TestConflictingExecsNeverOverlap(WAVEFRONT_BATCHING);
+    TestConflictingExecsNeverOverlap(DEPTH_BATCHING);
+    return TestResult();
+}
@@ -0,0 +1,183 @@
+#include "N3LDG.h"
+#include "TestHelper.h"
+
+// graphs replaying a cached plan against graphs batched again
+
+const int N = 6;
+const int IN_DIM = 3;
+const int DIM = 4;
+
+struct Model {
+    UniParams hidden, other_hidden, deep;
+    BiParams pair;
+
+    Model() {
+        hidden.initial(DIM, IN_DIM);
+        other_hidden.initial(DIM, IN_DIM);
+        deep.initial(DIM, DIM);
+        pair.initial(DIM, DIM, DIM);
+    }
+
+    vector<Param*> params() {
+        return {&hidden.W, &hidden.b, &other_hidden.W, &other_hidden.b,
+            &deep.W, &deep.b, &pair.W1, &pair.W2, &pair.b};
+    }
+};
+
+// with other the first layer uses other_hidden, which gives a graph of the
+// same structure but other node types. Only the even pairs feed a deep node,
+// so the batching strategies schedule the graph differently.
+struct Network {
+    BucketNode x[N];
+    UniNode hidden[N], deep[N];
+    BiNode pair[N];
+
+    void init(Model &model, bool other) {
+        for (int i = 0; i < N; ++i) {
+            x[i].init(IN_DIM, -1);
+            hidden[i].setParam(other ? &model.other_hidden : &model.hidden);
+            hidden[i].init(DIM, -1);
+            pair[i].setParam(&model.pair);
+            pair[i].init(DIM, -1);
+            deep[i].setParam(&model.deep);
+            deep[i].init(DIM, -1);
+        }
+    }
+
+    void forward(Graph *cg) {
+        for (int i = 0; i < N; ++i) {
+            for (int j = 0; j < IN_DIM; ++j) {
+                x[i].val[j] = 0.3 * std::sin(1.0 + i * IN_DIM + j);
+            }
+            x[i].forward(cg);
+            hidden[i].forward(cg, &x[i]);
+        }
+        for (int i = 0; i < N; ++i) {
+            pair[i].forward(cg, &hidden[i], &hidden[(i + 1) % N]);
+            if (i % 2 == 0) {
+                deep[i].forward(cg, &pair[i]);
+            }
+        }
+    }
+
+    vector<PNode> sinks() {
+        vector<PNode> result;
+        for (int i = 0; i < N; ++i) {
+            result.push_back(i % 2 == 0 ? (PNode)&deep[i] : (PNode)&pair[i]);
+        }
+        return result;
+    }
+};
+
+class CollisionGraph : public Graph {
+  public:
+    size_t signature() const {
+        vector<size_t> hashes;
+        return structureSignature(hashes);
+    }
+
+    // files the plan of signature from under signature to, as if the two
+    // structures hashed alike
+    void collide(size_t from, size_t to) {
+        plans[to] = plans.at(from);
+        plans.erase(from);
+    }
+};
+
+struct Outputs {
+    vector<vector<dtype> > vals, grads;
+    size_t signature;
+};
+
+// trains network once, with the plan cached for collide_with filed under
+// its signature if that is not 0
+Outputs Train(CollisionGraph &graph, Network &network, Model &model,
+        size_t collide_with = 0) {
+    for (Param *param : model.params()) {
+        param->clearGrad();
+    }
+    graph.clearValue(true);
+    network.forward(&graph);
+
+    Outputs outputs;
+    outputs.signature = graph.signature();
+    if (collide_with != 0) {
+        graph.collide(collide_with, outputs.signature);
+    }
+    graph.compute();
+    for (int i = 0; i < N; ++i) {
+        for (PNode node : vector<PNode>{&network.hidden[i], &network.pair[i]}) {
+            outputs.vals.emplace_back(node->val.v, node->val.v + DIM);
+        }
+    }
+    int sink = 0;
+    for (PNode node : network.sinks()) {
+        outputs.vals.emplace_back(node->val.v, node->val.v + DIM);
+        for (int j = 0; j < DIM; ++j) {
+            node->loss[j] = 0.1 * std::cos(2.0 + sink * DIM + j);
+        }
+        sink++;
+    }
+    graph.backward();
+    for (Param *param : model.params()) {
+        outputs.grads.emplace_back(param->grad.v,
+                param->grad.v + param->grad.size);
+    }
+    return outputs;
+}
+
+void CheckSame(const vector<vector<dtype> > &a,
+        const vector<vector<dtype> > &b) {
+    CHECK(a.size() == b.size());
+    for (size_t i = 0; i < a.size() && i < b.size(); ++i) {
+        CHECK(a[i].size() == b[i].size());
+        CHECK_NEAR(a[i].data(), b[i].data(), a[i].size());
+    }
+}
+
+void CheckSame(const Outputs &a, const Outputs &b) {
+    CheckSame(a.vals, b.vals);
+    CheckSame(a.grads, b.grads);
+}
+
+// a graph run again replays its plan, a graph whose signature finds the plan
+// of other node types is batched again
+void TestReplayMatchesScheduling(BatchingStrategy strategy) {
+    Model model;
+    // nodes are cleared by the graph they were added to, so every graph
+    // builds its own
+    Network network, other, cached_network, cached_other;
+    network.init(model, false);
+    other.init(model, true);
+    cached_network.init(model, false);
+    cached_other.init(model, true);
+
+    CollisionGraph uncached;
+    uncached.setBatchingStrategy(strategy);
+    uncached.setPlanCacheEnabled(false);
+    Outputs expected = Train(uncached, network, model);
+    CheckSame(Train(uncached, network, model), expected);
+    Outputs expected_other = Train(uncached, other, model);
+    CHECK(uncached.planCount() == 0);
+
+    CollisionGraph graph;
+    graph.setBatchingStrategy(strategy);
+    graph.setPlanCacheEnabled(true);
+    Outputs first = Train(graph, cached_network, model);
+    CHECK(graph.planCount() == 1);
+    CheckSame(first, expected);
+    CheckSame(Train(graph, cached_network, model), expected);
+    CHECK(graph.planCount() == 1);
+
+    Outputs collided = Train(graph, cached_other, model, first.signature);
+    CHECK(collided.signature != first.signature);
+    CheckSame(collided, expected_other);
+    CHECK(graph.planCount() == 1);
+}
+
+int main() {
+    TestReplayMatchesScheduling(WAVEFRONT_BATCHING);
+    TestReplayMatchesScheduling(DEPTH_BATCHING);
+    TestReplayMatchesScheduling(AGENDA_BATCHING);
+    return TestResult();
+}